@@ -8,6 +8,23 @@
 #define strdup SDL_strdup
 #endif
 
+/* completion.c */
+typedef struct completion_s {
+    struct completion_s *next;
+    void (*run)(struct completion_s *item); /* on the draining thread; frees the item */
+    size_t bytes; /* counted against the drain's byte budget */
+} completion_t;
+typedef struct completion_queue_s {
+    completion_t *head; /* pushed to by any thread */
+    SDL_atomic_t count;
+    completion_t *backlog, *backlog_tail; /* draining thread only */
+} completion_queue_t;
+extern completion_queue_t main_completions; /* drained by the main loop, which owns the GL context */
+
+void completion_push(completion_queue_t *queue, completion_t *item);
+int completion_drain(completion_queue_t *queue, double max_ms, size_t max_bytes);
+int completion_pending(completion_queue_t *queue);
+
 /* hashtable.c */
 typedef struct ht_item_s {
     char *key;
@@ -29,24 +46,49 @@ void *ht_delete(htable_t *table, const char *key);
 void ht_resize(htable_t *table, int new_capacity);
 void ht_deinit(htable_t *table);
 
+/* noise.c */
+#define NOISE_BITS 12
+#define NOISE_ONE (1 << NOISE_BITS) /* noise values are fixed point, with this as 1.0 */
+void noise2_grid(uint64_t seed, int x0, int y0, int w, int h, int period, int octaves, int32_t *out);
+void noise3_grid(uint64_t seed, int x0, int y0, int z, int w, int h, int period, int octaves, int32_t *out);
+int32_t noise2(uint64_t seed, int x, int y, int period, int octaves);
+int32_t noise3(uint64_t seed, int x, int y, int z, int period, int octaves);
+
 /* physfs.c */
+char *real_path_join(const char *dir, const char *name);
 void *read_physfs_file(const char *path, size_t *length);
 SDL_Surface *load_physfs_image(const char *path);
 
 /* queue.c */
-struct queue_node_s;
 typedef struct queue_s {
-    struct queue_node_s *head, *tail;
+    char *items;
+    size_t item_size;
+    int head, size, capacity;
 } queue_t;
 
-queue_t *queue_create(void);
+void queue_init(queue_t *queue, size_t item_size);
+void queue_free(queue_t *queue);
+void queue_push(queue_t *queue, const void *items, int n);
+int queue_pop(queue_t *queue, void *items, int max);
+/* For queues of pointers. queue_pull() and queue_pull_back() return NULL once the queue is empty. */
 void queue_insert(queue_t *queue, void *v);
 void *queue_pull(queue_t *queue);
-int queue_size(queue_t *queue);
+void *queue_pull_back(queue_t *queue);
+static inline int queue_size(queue_t *queue) {
+    return queue->size;
+}
 static inline bool queue_is_empty(queue_t *queue) {
-    return queue->head == NULL;
+    return queue->size == 0;
 }
 
+/* A fixed size queue of items stored inline, shared by any number of threads without a lock. */
+typedef struct bqueue_s bqueue_t;
+bqueue_t *bqueue_create(int capacity, size_t item_size);
+void bqueue_free(bqueue_t *queue);
+int bqueue_push(bqueue_t *queue, const void *items, int n);
+int bqueue_pop(bqueue_t *queue, void *items, int max);
+int bqueue_size(bqueue_t *queue);
+
 /* rbtree.c */
 typedef int (*rbtree_cmp_f)(const void *const a, const void *const b, void *extradata);
 typedef void (*rbtree_rel_f)(void *key, void *value);
@@ -94,6 +136,13 @@ typedef enum tpool_ret {
     TPOOL_FAILURE,
     TPOOL_RETRY_LATER
 } tpool_ret_t;
+typedef enum tpool_priority {
+    TPOOL_INTERACTIVE = 0,
+    TPOOL_VISIBLE,
+    TPOOL_BACKGROUND,
+    TPOOL_IDLE,
+    TPOOL_PRIORITIES
+} tpool_priority_t;
 struct tpool_s;
 typedef struct tpool_s tpool_t;
 typedef tpool_ret_t (*tpool_worker_t)(void *);
@@ -101,9 +150,30 @@ typedef tpool_ret_t (*tpool_worker_t)(void *);
 tpool_t *tpool_create(size_t workers);
 void tpool_destroy(tpool_t *pool);
 int tpool_add_work(tpool_t *pool, tpool_worker_t worker, void *arg,
-                                     bool arg_owned);
+                                     bool arg_owned, tpool_priority_t priority);
+typedef struct tpool_work_s tpool_job_t;
+tpool_job_t *tpool_add_job(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned, tpool_priority_t priority);
+bool tpool_cancel(tpool_job_t *job);
+void tpool_job_release(tpool_job_t *job);
 int tpool_busy_workers(tpool_t *pool);
+size_t tpool_num_workers(tpool_t *pool);
+void tpool_set_priority_limit(tpool_t *pool, tpool_priority_t priority, int max_running);
 void tpool_wait(tpool_t *pool);
+typedef struct tpool_signal_s tpool_signal_t;
+tpool_signal_t *tpool_signal_create(void);
+void tpool_signal_destroy(tpool_signal_t *signal);
+void tpool_signal(tpool_signal_t *signal);
+void tpool_retry_on(tpool_signal_t *signal);
+unsigned int tpool_num_physical_cores(void);
+typedef struct tpool_task_s tpool_task_t;
+tpool_task_t *tpool_task_create(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned, tpool_priority_t priority);
+void tpool_task_depends(tpool_task_t *task, tpool_task_t *on);
+void tpool_task_submit(tpool_task_t *task);
+tpool_task_t *tpool_task_then(tpool_task_t *task, tpool_worker_t worker, void *arg, bool arg_owned);
+tpool_task_t *tpool_when_all(tpool_t *pool, tpool_task_t **tasks, int count);
+bool tpool_task_done(tpool_task_t *task);
+tpool_ret_t tpool_task_wait(tpool_task_t *task);
+void tpool_task_release(tpool_task_t *task);
 #ifdef _WIN32
 #include <windows.h>
 static inline unsigned int tpool_num_cores() {
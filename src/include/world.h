@@ -1,6 +1,7 @@
 #pragma once
 #include <cglm/cglm.h>
 #include <GL/gl3w.h>
+#include <SDL.h>
 #include <stddef.h>
 #include "blox.h"
 
@@ -8,7 +9,11 @@
 #define CHUNK_HEIGHT 400
 #define CHUNK_AREA (CHUNK_WIDTH * CHUNK_WIDTH)
 #define CHUNK_TOTAL_BLOCKS (CHUNK_AREA * CHUNK_HEIGHT)
+#define CHUNK_SECTION_HEIGHT 16 /* must divide CHUNK_HEIGHT */
+#define CHUNK_SECTIONS (CHUNK_HEIGHT / CHUNK_SECTION_HEIGHT)
+#define CHUNK_SECTION_BLOCKS (CHUNK_AREA * CHUNK_SECTION_HEIGHT)
 #define GRAVITY_PER_SECOND -28.0
+#define WORLD_DEFAULT_MEMORY_BUDGET ((size_t)512 << 20)
 
 static inline int CHUNK_BLOCK_INDEX(int x, int y, int z)
 {
@@ -35,19 +40,114 @@ typedef struct block_instance_s {
 	int skylight : 4;
 } block_instance_t;
 
+static inline bool block_instance_equal(block_instance_t a, block_instance_t b)
+{
+	return a.id == b.id && a.state == b.state && a.skylight == b.skylight;
+}
+
+/* Block storage for a run of cells: a palette of the distinct blocks present, and for each cell a
+ * bit-packed index into it. The index width grows (0, 1, 2, 4, 8, 16 bits) as blocks are added.
+ * With zero bits every cell holds the first palette entry, and a zeroed palette is all air.
+ * Palettes are not synchronized; see the chunk state protocol below. */
+typedef struct palette_s {
+	block_instance_t *entries;
+	uint32_t *data;
+	int size; /* below 1 << 16, so the 16 bit indexes reach every block the cells can hold */
+	uint32_t num_entries, max_entries, hint;
+	uint8_t bits;
+} palette_t;
+
+static inline int palette_index(const palette_t *p, int index)
+{
+	if (p->bits == 0)
+		return 0;
+	int bit = index * p->bits;
+	return (p->data[bit >> 5] >> (bit & 31)) & ((1u << p->bits) - 1);
+}
+static inline block_instance_t palette_get(const palette_t *p, int index)
+{
+	if (p->num_entries == 0)
+		return (block_instance_t){ 0 };
+	return p->entries[palette_index(p, index)];
+}
+
+/* Chunk state is published through atomics. A chunk is generated in stages, each run by one job
+ * on the worker pool; the stage member is the last one finished. The job running a stage is the
+ * only writer of the chunk's blocks until it stores the stage, and a reader that observes a stage
+ * with SDL_AtomicGet() also observes every block written before it. From CHUNK_STAGE_GENERATED
+ * on, the blocks belong to the main thread and the jobs it starts; mesh jobs read them while the
+ * main thread goes on, so both sides bracket their use of each chunk with
+ * chunk_blocks_read_begin() and the like. dirty is set by whoever changes the blocks or a
+ * neighbor's, and cleared by the main thread with a CAS before remeshing, so a change made during
+ * meshing is never lost. modified is set the same way by block edits and cleared when a snapshot
+ * of the chunk is queued to be saved. */
+enum chunk_stage {
+	CHUNK_STAGE_EMPTY = 0,
+	CHUNK_STAGE_TERRAIN,
+	CHUNK_STAGE_CARVED,
+	CHUNK_STAGE_DECORATED, /* has queued its features' blocks for itself and its neighbors */
+	CHUNK_STAGE_LIT,       /* has had every neighbor's features applied to it */
+	CHUNK_STAGE_READY,     /* every neighbor is lit too, so it can be meshed */
+	CHUNK_STAGE_MAX,
+	CHUNK_STAGE_GENERATED = CHUNK_STAGE_LIT /* the blocks are final and may be read and edited */
+};
+
+typedef struct feature_batch_s feature_batch_t;
+
 typedef struct chunk_s {
-	int loc[2];
-	block_instance_t blocks[CHUNK_TOTAL_BLOCKS];
+	int loc[2]; /* must be the first member; immutable once the chunk is in the chunk map */
+	/* Blocks are stored in vertical sections of CHUNK_SECTION_HEIGHT layers. A section holding a
+	 * single block (most commonly air) keeps just that value and no index data. Because sections
+	 * are whole layers, a block index bi is at index bi % CHUNK_SECTION_BLOCKS in section
+	 * bi / CHUNK_SECTION_BLOCKS. */
+	palette_t sections[CHUNK_SECTIONS];
+	/* Where the blocks are: for each column one past its highest non-air block, and the range of
+	 * layers [min_z, max_z) holding any, empty for an empty chunk. Written along with the blocks.
+	 * Removing blocks doesn't raise min_z, so it is only a lower bound. */
+	uint16_t heightmap[CHUNK_AREA];
+	uint16_t min_z, max_z;
 	GLuint vbuf[VBUF_MAX];
 	size_t vbufsize[VBUF_MAX];
 
 	int num_lights;
 	mat4 *light_data;
 
-	int gen_stage : 7;
-	bool dirty : 1;
+	SDL_atomic_t stage, dirty, modified;
+	SDL_atomic_t readers, writing; /* the block gate, see chunk_blocks_read_begin() */
+	/* guarded by the pipeline lock in generate.c */
+	uint8_t gen_waiting; /* neighbors yet to finish the stage the next one needs */
+	uint8_t gen_state;   /* whether its next stage is queued or running */
+	uint8_t gen_runs;    /* stages run so far */
+	/* Blocks queued by the features placed in it, a batch for it and each neighbor by
+	 * neighbor_index(), written when it is decorated and read when they are lit; see features.c.
+	 * loaded is set when its blocks come from a save, features and all. */
+	feature_batch_t *features[9];
+	bool loaded;
+
+	/* main thread only, but for accounted_kib, also set by the job that generates it */
+	Uint32 last_used;
+	int accounted_kib;
+	bool meshing; /* a mesh is being built or waits to be uploaded, so it can't be unloaded */
 } chunk_t;
 
+static inline block_instance_t chunk_get_block(const chunk_t *chunk, int bi)
+{
+	return palette_get(&chunk->sections[bi / CHUNK_SECTION_BLOCKS], bi % CHUNK_SECTION_BLOCKS);
+}
+static inline bool chunk_section_is_uniform(const chunk_t *chunk, int section)
+{
+	return chunk->sections[section].bits == 0;
+}
+static inline int chunk_stage(chunk_t *chunk)
+{
+	return SDL_AtomicGet(&chunk->stage);
+}
+static inline void chunk_mark_dirty(chunk_t *chunk)
+{
+	if (chunk)
+		SDL_AtomicSet(&chunk->dirty, 1);
+}
+
 typedef struct model_element_s {
 	float cube[6];
 	float uv[6][4];
@@ -80,24 +180,180 @@ typedef struct blockdef_s {
 
 extern blockdef_t *blockdefs;
 
+/* chunkmap.c */
+typedef struct chunkmap_s chunkmap_t;
+chunkmap_t *chunkmap_create(size_t initial_capacity, void (*release)(chunk_t *));
+void chunkmap_destroy(chunkmap_t *map);
+void chunkmap_clear(chunkmap_t *map);
+size_t chunkmap_count(chunkmap_t *map);
+void chunkmap_recenter(chunkmap_t *map, int x, int y);
+bool chunkmap_insert(chunkmap_t *map, chunk_t *chunk);
+chunk_t *chunkmap_get(chunkmap_t *map, int x, int y);
+bool chunkmap_remove(chunkmap_t *map, int x, int y);
+chunk_t *chunkmap_next(chunkmap_t *map, size_t *iter);
+int chunkmap_read_begin(chunkmap_t *map);
+void chunkmap_read_end(chunkmap_t *map, int token);
+void chunkmap_reclaim(chunkmap_t *map);
+
+/* edit.c */
+int world_fill_box(const int min[3], const int max[3], block_instance_t inst);
+int world_replace_in_box(const int min[3], const int max[3], block_instance_t from, block_instance_t to);
+int world_clone_box(const int min[3], const int max[3], const int dest[3]);
+
+/* climate.c */
+typedef struct climate_s {
+	int32_t temperature, humidity, continentalness;
+} climate_t;
+typedef struct world_climate_stats_s {
+	size_t hits, misses, evictions, capacity; /* lookups served from the cache and not, tiles dropped and kept */
+} world_climate_stats_t;
+void climate_init(void);
+void climate_clear(void);
+void climate_grid(uint64_t seed, int x0, int y0, int w, int h, climate_t *out);
+void world_climate_stats(world_climate_stats_t *stats);
+
+/* evict.c */
+typedef struct world_memory_stats_s {
+	size_t resident_chunks, resident_bytes, evicted_chunks, budget_bytes;
+} world_memory_stats_t;
+size_t chunk_memory_usage(chunk_t *chunk);
+void chunk_update_accounting(chunk_t *chunk);
+void world_set_memory_budget(size_t bytes);
+void world_memory_stats(world_memory_stats_t *stats);
+void world_evict_chunks(int center_x, int center_y, int load_radius);
+
+/* features.c */
+void features_place(chunk_t *chunk, uint64_t seed);
+void features_apply(chunk_t *chunk);
+size_t features_memory_usage(chunk_t *chunk);
+void features_free(chunk_t *chunk);
+
 /* generate.c */
+#define CHUNKGEN_MARGIN 2 /* rings of chunks beyond the render radius needed to make it ready */
+typedef struct world_gen_stats_s {
+	size_t ready, held, running; /* stages waiting, waiting outside the load radius, and pool jobs running them */
+	size_t run, cancelled, wasted; /* stages run, dropped before running, and run for chunks unloaded unmeshed */
+} world_gen_stats_t;
 int world_request_chunkgen(int x, int y);
+bool world_remove_chunk(chunk_t *chunk);
+void world_set_load_focus(double x, double y, const vec3 view, int radius);
+float world_load_priority(int x, int y);
+void world_gen_stats(world_gen_stats_t *stats);
 uint64_t world_seed(void);
 void world_set_seed(uint64_t seed);
+void world_init_seed(const char *save_dir);
+int world_terrain_height(int x, int y);
+
+/* journal.c */
+void journal_init(const char *save_dir);
+void journal_record(const int loc[2], int bi, block_instance_t inst);
+void journal_record_fill(const int loc[2], const int min[3], const int max[3], block_instance_t inst);
+void journal_commit(bool force);
+uint32_t journal_seq(void);
+void journal_apply(chunk_t *chunk);
+void journal_retire(const int loc[2], uint32_t seq);
+void journal_close(void);
+
+/* palette.c */
+void palette_init(palette_t *p, int size, block_instance_t fill);
+void palette_free(palette_t *p);
+void palette_copy(palette_t *dst, const palette_t *src);
+size_t palette_memory_usage(const palette_t *p);
+void palette_set(palette_t *p, int index, block_instance_t v);
+void palette_fill(palette_t *p, int start, int count, block_instance_t v);
+bool palette_compact(palette_t *p);
+size_t palette_encoded_size(const palette_t *p);
+uint8_t *palette_encode(const palette_t *p, uint8_t *out);
+const uint8_t *palette_decode(palette_t *p, int size, const uint8_t *in, const uint8_t *end);
+
+/* region.c */
+#define REGION_WIDTH 32 /* chunks per side of a region file */
+typedef struct region_write_s {
+	int loc[2];
+	void *data;
+	int length;
+	bool ok;
+} region_write_t;
+void region_init(const char *save_dir);
+bool region_load_chunk(chunk_t *chunk);
+void *region_compress_chunk(const palette_t sections[CHUNK_SECTIONS], int *length);
+void region_write_chunks(region_write_t **writes, int count);
+void region_close_all(void);
 
 /* render.c */
 #define VERTEX_DATA_SIZE 8 /* x, y, z, face (normal), u, v, texture, is_light?-1:1 */
 int render_one_block(int x, int y, int z, bool preserve_uv, GLuint vbo);
-void chunk_render(chunk_t *chunk);
+bool chunk_render(chunk_t *chunk);
+
+/* save.c */
+typedef struct world_save_stats_s {
+	size_t queued_chunks, queued_bytes, saved_chunks;
+	unsigned write_latency_ms; /* from snapshot to written, averaged over recent saves */
+	float chunks_per_second;
+} world_save_stats_t;
+void save_init(void);
+bool chunk_save(chunk_t *chunk, bool force);
+bool chunk_load_pending(chunk_t *chunk);
+void world_autosave(void);
+void world_save_flush(void);
+void world_save_stats(world_save_stats_t *stats);
 
 /* storage.c */
+/* Reads blocks relative to a position, caching the chunk it is in and the four chunks beside it so
+ * that reads nearby don't look chunks up in the chunk map. Holds plain chunk pointers, so use it
+ * only where the chunks can't be unloaded, as on the main thread between evictions, or within
+ * chunks_read_begin() and chunks_read_end(). */
+typedef struct block_cursor_s {
+	int x, y, z;  /* world position */
+	int xoff, yoff; /* of the position in its chunk */
+	chunk_t *chunk;
+	chunk_t *neighbors[4]; /* north, south, east and west, once fetched */
+	uint8_t fetched;
+	int lookups; /* chunk map lookups made */
+} block_cursor_t;
+void chunk_init_blocks(chunk_t *chunk);
+void chunk_free_blocks(chunk_t *chunk);
+size_t chunk_blocks_memory_usage(chunk_t *chunk);
+void chunk_set_block(chunk_t *chunk, int bi, block_instance_t inst);
+void chunk_fill_blocks(chunk_t *chunk, int start, int count, block_instance_t inst);
+void chunk_fill_box(chunk_t *chunk, const int min[3], const int max[3], block_instance_t inst);
+void chunk_update_heightmap(chunk_t *chunk);
 void chunks_add(chunk_t *chunk);
 void chunks_clear(void);
 chunk_t *chunks_get(int x, int y);
+chunk_t *chunks_next(size_t *iter);
 void chunks_remove(int x, int y);
+void chunks_set_center(int x, int y);
+int chunks_read_begin(void);
+void chunks_read_end(int token);
+bool chunk_blocks_read_begin(chunk_t *chunk);
+void chunk_blocks_read_end(chunk_t *chunk);
+void chunk_blocks_write_begin(chunk_t *chunk);
+void chunk_blocks_write_end(chunk_t *chunk);
+void chunks_reclaim(void);
 void world_init(void);
-block_instance_t *world_get_block(int x, int y, int z);
+bool world_get_block(int x, int y, int z, block_instance_t *inst);
 void world_set_block(int x, int y, int z, block_instance_t *inst);
+void block_cursor_init(block_cursor_t *c, int x, int y, int z);
+void block_cursor_init_chunk(block_cursor_t *c, chunk_t *chunk, int xoff, int yoff, int z);
+void block_cursor_move(block_cursor_t *c, int x, int y, int z);
+chunk_t *block_cursor_neighbor(block_cursor_t *c, int face);
+chunk_t *block_cursor_resolve(block_cursor_t *c, int *xoff, int *yoff);
+
+/* Reads the block at an offset from the cursor, returning false if its chunk isn't loaded. */
+static inline bool block_cursor_get(block_cursor_t *c, int dx, int dy, int dz, block_instance_t *inst)
+{
+	int x = c->xoff + dx, y = c->yoff + dy, z = c->z + dz;
+	chunk_t *chunk = c->chunk;
+	if (z < 0 || z >= CHUNK_HEIGHT)
+		return false;
+	if (x < 0 || x >= CHUNK_WIDTH || y < 0 || y >= CHUNK_WIDTH)
+		chunk = block_cursor_resolve(c, &x, &y);
+	if (chunk == NULL || chunk_stage(chunk) < CHUNK_STAGE_GENERATED)
+		return false;
+	*inst = chunk_get_block(chunk, CHUNK_BLOCK_INDEX(x, y, z));
+	return true;
+}
 
 #define FACE_NAME_INDEX(X)                                                                                                                \
 	(X == NULL ? -1 :                                                                                                                 \
@@ -112,4 +368,6 @@ void world_set_block(int x, int y, int z, block_instance_t *inst);
 							 (strcmp((X), "east") == 0 ? 4 : (strcmp((X), "west") == 0 ? 5 : -1)))))))
 
 void world_load_resources(void);
+void world_set_worker_count(unsigned int workers);
 void world_init_workerpool(void);
+struct tpool_s *world_workerpool(void);
@@ -2,6 +2,7 @@
 #include "render.h"
 #include <string.h>
 #include "util.h"
+#include "world.h"
 
 struct ingame_data_s igdt;
 int chunk_render_radius = 1;
@@ -11,7 +12,7 @@ bool ingame_init(int initial_width, int initial_height)
 	memset(&igdt, 0, sizeof(struct ingame_data_s));
 	igdt.loc[0] = 5;
 	igdt.loc[1] = 5;
-	igdt.loc[2] = 5;
+	igdt.loc[2] = world_terrain_height(5, 5) + 2;
 	igdt.held_block = 1;
 	igdt.time_of_day = 7;
 	memset(igdt.sun, 0, sizeof(igdt.sun));
@@ -8,9 +8,11 @@ static void handle_block_pick(Uint8 button)
 		block_instance_t air = { 0 };
 		world_set_block(bx, by, bz, &air);
 	} else if (button == SDL_BUTTON_MIDDLE) {
-		block_instance_t *inst = world_get_block(bx, by, bz);
-		igdt.held_block = inst->id;
-		igdt.held_block_state = inst->state;
+		block_instance_t inst;
+		if (world_get_block(bx, by, bz, &inst)) {
+			igdt.held_block = inst.id;
+			igdt.held_block_state = inst.state;
+		}
 	} else if (button == SDL_BUTTON_RIGHT) {
 		block_instance_t tgt = { .id = igdt.held_block, .state = igdt.held_block_state };
 		world_set_block(bx + cube_normal[fx][0], by + cube_normal[fx][1], bz + cube_normal[fx][2], &tgt);
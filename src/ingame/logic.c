@@ -1,22 +1,61 @@
+#include <assert.h>
 #include "ingame.h"
 #include "world.h"
 
+typedef struct mesh_order_s {
+	chunk_t *chunk;
+	float priority;
+} mesh_order_t;
+
+static int compare_mesh_order(const void *a, const void *b)
+{
+	float p1 = ((const mesh_order_t *)a)->priority, p2 = ((const mesh_order_t *)b)->priority;
+	return (p1 > p2) - (p1 < p2);
+}
+
 static inline void load_chunks(int render_radius)
 {
-	int center_x, center_y, load_radius = render_radius + 1;
+	/* Kept from frame to frame, and only grown when the render radius is. */
+	static mesh_order_t *dirty;
+	static int max_dirty;
+	int center_x, center_y, load_radius = render_radius + CHUNKGEN_MARGIN, num_dirty = 0;
+	if (max_dirty < (2 * render_radius + 1) * (2 * render_radius + 1)) {
+		max_dirty = (2 * render_radius + 1) * (2 * render_radius + 1);
+		dirty = realloc(dirty, max_dirty * sizeof(mesh_order_t));
+		assert(dirty);
+	}
+	vec3 view;
 	WORLD_CHUNK(igdt.loc[0], &center_x, NULL);
 	WORLD_CHUNK(igdt.loc[1], &center_y, NULL);
+	orientation_from_angles(view, igdt.pitch, igdt.yaw);
+	world_set_load_focus(igdt.loc[0], igdt.loc[1], view, load_radius);
+	chunks_set_center(center_x, center_y);
+	chunks_reclaim();
 
 	for (int rx = -load_radius; rx <= load_radius; rx++) {
 		for (int ry = -load_radius; ry <= load_radius; ry++) {
 			chunk_t *chunk = chunks_get(center_x + rx, center_y + ry);
 			if (chunk == NULL)
 				world_request_chunkgen(center_x + rx, center_y + ry);
-			else if (abs(rx) <= render_radius && abs(ry) <= render_radius) {
-				chunk_render(chunk);
+			else {
+				chunk->last_used = SDL_GetTicks();
+				if (abs(rx) <= render_radius && abs(ry) <= render_radius && chunk_stage(chunk) == CHUNK_STAGE_READY &&
+				    SDL_AtomicGet(&chunk->dirty))
+					dirty[num_dirty++] = (mesh_order_t){ chunk, world_load_priority(chunk->loc[0], chunk->loc[1]) };
 			}
 		}
 	}
+
+	/* Mesh in the order the chunks were generated, nearest and in view first. Meshing happens on
+	 * the workers, a few chunks at a time, and the uploads are spread over frames by the main
+	 * loop, so a burst of newly ready chunks doesn't stall one. */
+	qsort(dirty, num_dirty, sizeof(mesh_order_t), compare_mesh_order);
+	for (int i = 0; i < num_dirty; i++)
+		chunk_render(dirty[i].chunk);
+
+	world_evict_chunks(center_x, center_y, load_radius);
+	world_autosave();
+	journal_commit(false);
 }
 
 static void sun_params(vec3 sun, float latitude, float longitude, int day_of_year, float time_of_day)
@@ -43,6 +82,9 @@ static void find_picked_block(void)
 		w[i] = u[i];
 	}
 
+	/* The ray moves a block at a time, so the cursor only looks up the chunks it crosses into. */
+	block_cursor_t cursor;
+	block_cursor_init(&cursor, (int)floorf(w[0]), (int)floorf(w[1]), (int)floorf(w[2]));
 	igdt.picked_block_face = FACE_UNKNOWN;
 	while (t < CHUNK_WIDTH) {
 		float dt = -1;
@@ -76,8 +118,14 @@ static void find_picked_block(void)
 				b[i] = (int)ceilf(w[i] - 1);
 		}
 
-		block_instance_t *bi = world_get_block(b[0], b[1], b[2]);
-		if (bi && blockdefs[bi->id].states[bi->state].pickable) {
+		block_instance_t bi;
+		block_cursor_move(&cursor, b[0], b[1], b[2]);
+		/* Nothing but air above the column; workers still write the heightmap of chunks that
+		 * aren't generated yet. */
+		if (cursor.chunk && chunk_stage(cursor.chunk) >= CHUNK_STAGE_GENERATED &&
+		    b[2] >= cursor.chunk->heightmap[cursor.xoff + cursor.yoff * CHUNK_WIDTH])
+			continue;
+		if (block_cursor_get(&cursor, 0, 0, 0, &bi) && blockdefs[bi.id].states[bi.state].pickable) {
 			for (int i = 0; i < 3; i++)
 				igdt.picked_block[i] = b[i];
 			igdt.picked_block_face = 2 * (2 - dti) + (copysignf(1, v[dti]) == 1);
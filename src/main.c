@@ -6,8 +6,12 @@
 #include "render.h"
 #include <stdio.h>
 #include <SDL.h>
+#include "util.h"
 #include "world.h"
 
+#define UPLOAD_BUDGET_MS 2.0           /* of each frame spent handing finished work to GL */
+#define UPLOAD_BUDGET_BYTES (4 << 20) /* uploaded per frame, past the first item */
+
 bool doQuit = false;
 static SDL_Window *main_window;
 static SDL_GLContext gl_ctx;
@@ -27,6 +31,10 @@ static int physfs_init(const char *argv0)
 		fprintf(stderr, "Error mounting saves at %s: %s\n", pref_dir, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
 		return 1;
 	}
+	if (PHYSFS_setWriteDir(pref_dir) == 0) {
+		fprintf(stderr, "Error writing saves to %s: %s\n", pref_dir, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+		return 1;
+	}
 
 	return 0;
 }
@@ -70,6 +78,7 @@ int main(int argc, char **argv)
 	       glGetString(GL_VERSION), glGetString(GL_SHADING_LANGUAGE_VERSION));
 
 	UNUSED(argc);
+	world_load_resources();
 	world_init();
 	assert(ingame_init(initial_width, initial_height));
 
@@ -112,6 +121,8 @@ int main(int argc, char **argv)
 		nk_input_end(ui_ctx);
 
 		ingame_logic(delta_ms);
+		/* Whatever doesn't fit rolls over to the next frame. */
+		completion_drain(&main_completions, UPLOAD_BUDGET_MS, UPLOAD_BUDGET_BYTES);
 		render_main(main_window, ui_ctx);
 
 		SDL_Delay(MAX((int32_t)(8 - delta_ms), 1));
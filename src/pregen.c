@@ -0,0 +1,156 @@
+#include <inttypes.h>
+#include <physfs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL.h>
+#include "util.h"
+#include "world.h"
+
+/* Generates the chunks within a radius of the origin into a save directory, without a window or a
+ * GL context, and prints how fast that went and a hash of every generated block. The hash only
+ * depends on the seed and the radius, so it can be compared across machines and thread counts. */
+
+/* The chunks are compressed by one task per worker, each taking the next chunk until none are
+ * left, and then written in one batch once all the tasks have finished. */
+typedef struct compress_batch_s {
+	region_write_t *writes;
+	int num_writes;
+	SDL_atomic_t next;
+} compress_batch_t;
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s <output dir> [seed] [radius] [threads]\n", argv0);
+}
+
+/* FNV-1a over the blocks of the chunks in order, up to each chunk's top layer. */
+static uint64_t hash_chunks(int radius)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (int y = -radius; y <= radius; y++) {
+		for (int x = -radius; x <= radius; x++) {
+			chunk_t *chunk = chunks_get(x, y);
+			int end = CHUNK_BLOCK_INDEX(0, 0, chunk->max_z);
+			hash = (hash ^ chunk->max_z) * 0x100000001b3;
+			for (int bi = 0; bi < end; bi++) {
+				block_instance_t b = chunk_get_block(chunk, bi);
+				hash = (hash ^ (b.id | (uint32_t)b.state << 16)) * 0x100000001b3;
+			}
+		}
+	}
+	return hash;
+}
+
+static tpool_ret_t compress_worker(void *_batch)
+{
+	compress_batch_t *batch = _batch;
+	int token = chunks_read_begin();
+	for (int i; (i = SDL_AtomicAdd(&batch->next, 1)) < batch->num_writes;) {
+		region_write_t *w = &batch->writes[i];
+		w->data = region_compress_chunk(chunks_get(w->loc[0], w->loc[1])->sections, &w->length);
+	}
+	chunks_read_end(token);
+	return TPOOL_SUCCESS;
+}
+
+static void save_chunks(int radius)
+{
+	compress_batch_t batch = { .num_writes = (2 * radius + 1) * (2 * radius + 1) };
+	batch.writes = calloc(batch.num_writes, sizeof(region_write_t));
+	region_write_t **writes = malloc(batch.num_writes * sizeof(region_write_t *));
+	for (int i = 0; i < batch.num_writes; i++) {
+		batch.writes[i].loc[0] = i % (2 * radius + 1) - radius;
+		batch.writes[i].loc[1] = i / (2 * radius + 1) - radius;
+		writes[i] = &batch.writes[i];
+	}
+	/* Nothing else is waiting for the workers. */
+	tpool_set_priority_limit(world_workerpool(), TPOOL_BACKGROUND, 0);
+	int num_tasks = tpool_num_workers(world_workerpool());
+	tpool_task_t **tasks = malloc(num_tasks * sizeof(tpool_task_t *));
+	for (int i = 0; i < num_tasks; i++) {
+		tasks[i] = tpool_task_create(world_workerpool(), compress_worker, &batch, false, TPOOL_BACKGROUND);
+		tpool_task_submit(tasks[i]);
+	}
+	tpool_task_t *compressed = tpool_when_all(world_workerpool(), tasks, num_tasks);
+	tpool_task_wait(compressed);
+	tpool_task_release(compressed);
+	for (int i = 0; i < num_tasks; i++)
+		tpool_task_release(tasks[i]);
+	free(tasks);
+
+	region_write_chunks(writes, batch.num_writes);
+	for (int i = 0; i < batch.num_writes; i++) {
+		if (!batch.writes[i].ok)
+			fprintf(stderr, "Failed to save chunk %d,%d\n", batch.writes[i].loc[0], batch.writes[i].loc[1]);
+		free(batch.writes[i].data);
+	}
+	free(writes);
+	free(batch.writes);
+}
+
+static bool all_generated(int radius)
+{
+	for (int y = -radius; y <= radius; y++) {
+		for (int x = -radius; x <= radius; x++) {
+			if (chunk_stage(chunks_get(x, y)) < CHUNK_STAGE_GENERATED)
+				return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 5) {
+		usage(argv[0]);
+		return 1;
+	}
+	uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 0;
+	int radius = argc > 3 ? atoi(argv[3]) : 8;
+	/* Nothing else runs meanwhile, so by default there is a worker for the main thread's core too. */
+	int threads = argc > 4 ? atoi(argv[4]) : (int)tpool_num_physical_cores();
+	if (radius < 0 || threads < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	PHYSFS_init(argv[0]);
+	if (PHYSFS_setWriteDir(argv[1]) == 0) {
+		fprintf(stderr, "Error writing to %s: %s\n", argv[1], PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+		return 1;
+	}
+	world_set_seed(seed);
+	world_set_worker_count(threads);
+	world_init();
+	if (world_seed() != seed)
+		fprintf(stderr, "%s was generated with seed %" PRIu64 ", continuing with that\n", argv[1], world_seed());
+
+	/* Chunks are final once lit, which needs a ring of decorated chunks around them, one ring fewer
+	 * than the game loads to make them ready. That ring is left out of the save. */
+	int margin = CHUNKGEN_MARGIN - 1, num_chunks = (2 * radius + 1) * (2 * radius + 1);
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int y = -radius - margin; y <= radius + margin; y++) {
+		for (int x = -radius - margin; x <= radius + margin; x++)
+			world_request_chunkgen(x, y);
+	}
+	while (!all_generated(radius))
+		SDL_Delay(1);
+	Uint64 t1 = SDL_GetPerformanceCounter();
+
+	save_chunks(radius);
+	Uint64 t2 = SDL_GetPerformanceCounter();
+
+	double freq = SDL_GetPerformanceFrequency(), seconds = (t1 - t0) / freq;
+	int cores = tpool_num_workers(world_workerpool());
+	world_gen_stats_t stats;
+	world_climate_stats_t climate;
+	world_gen_stats(&stats);
+	world_climate_stats(&climate);
+	printf("seed %" PRIu64 " radius %d: %d chunks (%zu stages) in %.2fs, %.1f chunks/s, %.1f per thread on %d threads; saved in %.2fs\n",
+	       world_seed(), radius, num_chunks, stats.run, seconds, num_chunks / seconds, num_chunks / seconds / cores,
+	       cores, (t2 - t1) / freq);
+	printf("climate: %zu hits, %zu misses (%.1f%% hit), %zu evictions\n", climate.hits, climate.misses,
+	       100.0 * climate.hits / MAX(1, climate.hits + climate.misses), climate.evictions);
+	printf("hash %016llx\n", (unsigned long long)hash_chunks(radius));
+	return 0;
+}
@@ -41,10 +41,29 @@ int buffer_light_data(int cx, int cy)
 	return total_lights;
 }
 
+/* The range of layers holding blocks in the chunks around cx, cy. */
+static void terrain_z_bounds(int cx, int cy, float bounds[2])
+{
+	bounds[0] = CHUNK_HEIGHT;
+	bounds[1] = 0;
+	for (int rx = -chunk_render_radius; rx <= chunk_render_radius; rx++) {
+		for (int ry = -chunk_render_radius; ry <= chunk_render_radius; ry++) {
+			chunk_t *ch = chunks_get(cx + rx, cy + ry);
+			if (ch == NULL || chunk_stage(ch) < CHUNK_STAGE_GENERATED || ch->max_z == 0)
+				continue;
+			bounds[0] = MIN(bounds[0], ch->min_z);
+			bounds[1] = MAX(bounds[1], ch->max_z);
+		}
+	}
+	bounds[0] = MIN(bounds[0], bounds[1]);
+}
+
 void draw_skyshadow_maps(int cx, int cy, vec4 *vf_corners, mat4 *lightspace, float *proj_cascade_planes)
 {
 	vec4 subvf_corners[8] = { 0 };
 	mat4 lv,lp;
+	float terrain_z[2];
+	terrain_z_bounds(cx, cy, terrain_z);
 	use_shader(shaders[SHADER_DEPTHRENDER]);
 	glm_lookat(igdt.sun, GLM_VEC4_ZERO, GLM_ZUP, lv);
 	glViewport(0, 0, SUN_SHADOW_SIZE, SUN_SHADOW_SIZE);
@@ -66,16 +85,37 @@ void draw_skyshadow_maps(int cx, int cy, vec4 *vf_corners, mat4 *lightspace, flo
 			glm_frustum_corners_at(vf_corners, cascade_planes[i], RENDER_FAR, subvf_corners + 4);
 
 		/* Calculate the bounding box of the sub-frustum and make an
-		 * orthographic projection matrix from it. Add 10 blocks' padding. */
+		 * orthographic projection matrix from it. Add 10 blocks' padding.
+		 * Nothing above or below the terrain casts or receives shadows, so the
+		 * box is limited to what the sub-frustum covers of the terrain's layers,
+		 * extended towards the sun to take in everything that can shade it. */
+		vec3 wb[2], tb[2];
+		vec4 terrain_corners[8];
+		glm_frustum_box(subvf_corners, GLM_MAT4_IDENTITY, wb);
+		wb[0][2] = glm_clamp(wb[0][2], terrain_z[0], terrain_z[1]);
+		wb[1][2] = glm_clamp(wb[1][2], terrain_z[0], terrain_z[1]);
+		for (int c = 0; c < 8; c++)
+			glm_vec4_copy((vec4){ wb[c & 1][0], wb[c >> 1 & 1][1], wb[c >> 2][2], 1 }, terrain_corners[c]);
 		glm_frustum_box(subvf_corners, lv, lp_bb);
+		glm_frustum_box(terrain_corners, lv, tb);
+		for (int a = 0; a < 2; a++) {
+			lp_bb[0][a] = MAX(lp_bb[0][a], tb[0][a]);
+			lp_bb[1][a] = MAX(MIN(lp_bb[1][a], tb[1][a]), lp_bb[0][a]);
+		}
+		lp_bb[0][2] = tb[0][2];
+		lp_bb[1][2] = tb[1][2];
 		glm_ortho_aabb_p(lp_bb, 10.f, lp);
 		glm_mat4_mul(lp, lv, lightspace[i]);
 
+		/* Only chunks inside the cascade's box are drawn into its map. */
+		vec4 box_planes[6];
+		glm_frustum_planes(lightspace[i], box_planes);
+
 		glUniformMatrix4fv(get_shader_uniform(0, "lightspace"), 1, GL_FALSE, *lightspace[i]);
 		glUniformMatrix4fv(get_shader_uniform(0, "model"), 1, GL_FALSE, *GLM_MAT4_IDENTITY);
 		glBindFramebuffer(GL_FRAMEBUFFER, sun_shadow[i]);
 		glClear(GL_DEPTH_BUFFER_BIT);
-		render_chunk_buffers(cx, cy, VBUF_BLOCKS, NULL);
+		render_chunk_buffers(cx, cy, VBUF_BLOCKS, box_planes);
 	}
 	glCullFace(GL_BACK);
 	glViewport(0, 0, g_screen_width, g_screen_height);
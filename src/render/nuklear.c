@@ -1,8 +1,3 @@
 #define NK_IMPLEMENTATION
 #define NK_SDL_GL3_IMPLEMENTATION
-#define STB_IMAGE_IMPLEMENTATION
-#define STB_ONLY_PNG
-#define STBI_NO_STDIO
-#define STBI_NO_FAILURE_STRINGS
-#include "nuklear_custom.h"
-#include "stb_image.h"
\ No newline at end of file
+#include "nuklear_custom.h"
\ No newline at end of file
@@ -42,6 +42,14 @@ static void draw_debug_info(struct nk_context *ui_ctx, int vw, int vh)
 	Uint32 curr_frame_time = SDL_GetTicks();
 
 	char plbuf[256];
+	world_memory_stats_t mstats;
+	world_save_stats_t sstats;
+	world_gen_stats_t gstats;
+	world_climate_stats_t cstats;
+	world_memory_stats(&mstats);
+	world_save_stats(&sstats);
+	world_gen_stats(&gstats);
+	world_climate_stats(&cstats);
 	nk_style_push_color(ui_ctx, &ui_ctx->style.window.background, nk_rgba(0, 0, 0, 0));
 	nk_style_push_style_item(ui_ctx, &ui_ctx->style.window.fixed_background, nk_style_item_color(nk_rgba(0, 0, 0, 0)));
 	if (nk_begin(ui_ctx, "DEBUG_INFO_WIN", nk_rect(0, 0, vw, vh / 2), NK_WINDOW_NO_SCROLLBAR)) {
@@ -51,6 +59,20 @@ static void draw_debug_info(struct nk_context *ui_ctx, int vw, int vh)
 			igdt.loc[2], 180 * igdt.pitch / M_PI, 180 * igdt.yaw / M_PI, igdt.dz, curr_frame_time - last_frame_time,
 			(int)igdt.time_of_day, (int)(60 * (igdt.time_of_day - ((int)igdt.time_of_day))));
 		nk_label(ui_ctx, plbuf, NK_TEXT_LEFT);
+		sprintf(plbuf, "chunks:%zu resident:%zuMiB/%zuMiB evicted:%zu", mstats.resident_chunks, mstats.resident_bytes >> 20,
+			mstats.budget_bytes >> 20, mstats.evicted_chunks);
+		nk_label(ui_ctx, plbuf, NK_TEXT_LEFT);
+		sprintf(plbuf, "saves: queued:%zu (%zuKiB) saved:%zu %.1f/s latency:%ums", sstats.queued_chunks, sstats.queued_bytes >> 10,
+			sstats.saved_chunks, sstats.chunks_per_second, sstats.write_latency_ms);
+		nk_label(ui_ctx, plbuf, NK_TEXT_LEFT);
+		sprintf(plbuf, "chunkgen: ready:%zu held:%zu running:%zu run:%zu cancelled:%zu wasted:%zu", gstats.ready, gstats.held,
+			gstats.running, gstats.run, gstats.cancelled, gstats.wasted);
+		nk_label(ui_ctx, plbuf, NK_TEXT_LEFT);
+		sprintf(plbuf, "climate tiles: hits:%zu misses:%zu (%.1f%% hit) evicted:%zu of %zu", cstats.hits, cstats.misses,
+			100.0 * cstats.hits / MAX(1, cstats.hits + cstats.misses), cstats.evictions, cstats.capacity);
+		nk_label(ui_ctx, plbuf, NK_TEXT_LEFT);
+		sprintf(plbuf, "uploads: pending:%d", completion_pending(&main_completions));
+		nk_label(ui_ctx, plbuf, NK_TEXT_LEFT);
 		nk_end(ui_ctx);
 	}
 	nk_style_pop_color(ui_ctx);
@@ -73,8 +95,8 @@ void render_chunk_buffers(int cx, int cy, int vb, vec4 *vf_planes)
 			if (chunk->vbufsize[vb] == 0)
 				continue;
 
-			if (vf_planes != NULL && glm_aabb_frustum((vec3[]){ { (cx + rx) * CHUNK_WIDTH, (cy + ry) * CHUNK_WIDTH, 0 },
-						       { (cx + rx + 1) * CHUNK_WIDTH, (cy + ry + 1) * CHUNK_WIDTH, CHUNK_HEIGHT } },
+			if (vf_planes != NULL && glm_aabb_frustum((vec3[]){ { (cx + rx) * CHUNK_WIDTH, (cy + ry) * CHUNK_WIDTH, chunk->min_z },
+						       { (cx + rx + 1) * CHUNK_WIDTH, (cy + ry + 1) * CHUNK_WIDTH, chunk->max_z } },
 					     vf_planes) == false)
 				continue;
 
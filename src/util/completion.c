@@ -0,0 +1,63 @@
+#include "util.h"
+
+/* Workers push finished items onto a stack with a compare and swap, so pushing never waits. The
+ * main thread takes the whole stack with one exchange, reverses it into the order the items were
+ * pushed in and appends it to its backlog, which it works through until the frame's budget is
+ * spent. What is left stays in the backlog for the next frame, ahead of anything pushed since. */
+completion_queue_t main_completions;
+
+/* Hands the item to the thread draining the queue. Safe to call from any thread. */
+void completion_push(completion_queue_t *queue, completion_t *item)
+{
+	completion_t *head;
+	SDL_AtomicAdd(&queue->count, 1);
+	do
+		item->next = head = SDL_AtomicGetPtr((void **)&queue->head);
+	while (!SDL_AtomicCASPtr((void **)&queue->head, head, item));
+}
+
+/* Runs queued items in the order they were pushed until either max_ms or max_bytes is used up,
+ * and returns how many it ran. At least one runs, so a large item can't hold up the queue. Only
+ * ever called from one thread. */
+int completion_drain(completion_queue_t *queue, double max_ms, size_t max_bytes)
+{
+	completion_t *taken = SDL_AtomicSetPtr((void **)&queue->head, NULL), *ordered = NULL;
+	while (taken) {
+		completion_t *next = taken->next;
+		taken->next = ordered;
+		ordered = taken;
+		taken = next;
+	}
+	if (ordered) {
+		if (queue->backlog_tail)
+			queue->backlog_tail->next = ordered;
+		else
+			queue->backlog = ordered;
+		while (ordered->next)
+			ordered = ordered->next;
+		queue->backlog_tail = ordered;
+	}
+
+	Uint64 start = SDL_GetPerformanceCounter(), limit = max_ms * SDL_GetPerformanceFrequency() / 1000;
+	size_t bytes = 0;
+	int ran = 0;
+	while (queue->backlog) {
+		completion_t *item = queue->backlog;
+		if (ran > 0 && (bytes + item->bytes > max_bytes || SDL_GetPerformanceCounter() - start >= limit))
+			break;
+		queue->backlog = item->next;
+		if (queue->backlog == NULL)
+			queue->backlog_tail = NULL;
+		bytes += item->bytes;
+		ran++;
+		SDL_AtomicAdd(&queue->count, -1);
+		item->run(item);
+	}
+	return ran;
+}
+
+/* Items pushed and not run yet, including the backlog. */
+int completion_pending(completion_queue_t *queue)
+{
+	return SDL_AtomicGet(&queue->count);
+}
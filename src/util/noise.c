@@ -0,0 +1,150 @@
+#include <string.h>
+#include "util.h"
+
+/* Gradient (Perlin) noise in fixed point. Every step is integer arithmetic, so a given seed gives
+ * the same values on every platform, compiler and thread. Lattice gradients come from hashing the
+ * lattice point with the seed: the four diagonals in 2D and the eight in 3D, which make each dot
+ * product a sum of signed offsets.
+ *
+ * The grid functions evaluate a whole w x h block of columns per call. Everything that depends on
+ * only x or only y is worked out once per column or row, leaving inner loops over x of plain
+ * integer operations on arrays that the compiler can vectorize. Those arrays have a fixed size,
+ * so wider grids are done in strips of NOISE_STRIP columns. The single-sample functions are 1 x 1
+ * grids, so both always agree. */
+#define NOISE_STRIP 64
+
+static inline uint32_t noise_hash(uint32_t seed, int32_t x, int32_t y, int32_t z)
+{
+	uint32_t h = seed ^ (uint32_t)x * 0x9e3779b1u ^ (uint32_t)y * 0x85ebca77u ^ (uint32_t)z * 0xc2b2ae3du;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	h *= 0x297a2d39u;
+	h ^= h >> 15;
+	return h;
+}
+
+static inline uint32_t octave_seed(uint64_t seed, int octave)
+{
+	return (uint32_t)(seed ^ seed >> 32) + octave * 0x9e3779b9u;
+}
+
+/* Returns v or -v, by bit b of h, without branching. */
+static inline int32_t noise_sign(uint32_t h, int b, int32_t v)
+{
+	int32_t mask = -(int32_t)(h >> b & 1);
+	return (v ^ mask) - mask;
+}
+
+/* 6t^5 - 15t^4 + 10t^3 for t in [0, NOISE_ONE]. */
+static inline int32_t noise_fade(int32_t t)
+{
+	int32_t t3 = ((t * t) >> NOISE_BITS) * t >> NOISE_BITS;
+	return (t3 * (((t * (t * 6 - 15 * NOISE_ONE)) >> NOISE_BITS) + 10 * NOISE_ONE)) >> NOISE_BITS;
+}
+
+static inline int32_t noise_lerp(int32_t a, int32_t b, int32_t t)
+{
+	return a + (((b - a) * t) >> NOISE_BITS);
+}
+
+/* Splits a coordinate into its lattice cell, its offset within it and the faded offset. */
+static inline void noise_cell(int v, int period, int32_t *cell, int32_t *frac, int32_t *fade)
+{
+	*cell = (v >= 0 ? v : v - period + 1) / period;
+	*frac = ((v - *cell * period) << NOISE_BITS) / period;
+	*fade = noise_fade(*frac);
+}
+
+/* Adds an octave to a strip of w <= NOISE_STRIP columns of a grid stride columns wide. */
+static void noise2_octave(uint32_t seed, int x0, int y0, int w, int h, int stride, int period, int shift, int32_t *out)
+{
+	int32_t cx[NOISE_STRIP], fx[NOISE_STRIP], ux[NOISE_STRIP], h00[NOISE_STRIP], h10[NOISE_STRIP], h01[NOISE_STRIP], h11[NOISE_STRIP];
+	for (int x = 0; x < w; x++)
+		noise_cell(x0 + x, period, &cx[x], &fx[x], &ux[x]);
+
+	for (int y = 0; y < h; y++, out += stride) {
+		int32_t cy, fy, uy;
+		noise_cell(y0 + y, period, &cy, &fy, &uy);
+		for (int x = 0; x < w; x++) {
+			h00[x] = noise_hash(seed, cx[x], cy, 0);
+			h10[x] = noise_hash(seed, cx[x] + 1, cy, 0);
+			h01[x] = noise_hash(seed, cx[x], cy + 1, 0);
+			h11[x] = noise_hash(seed, cx[x] + 1, cy + 1, 0);
+		}
+		for (int x = 0; x < w; x++) {
+			int32_t gx0 = fx[x], gx1 = fx[x] - NOISE_ONE, gy0 = fy, gy1 = fy - NOISE_ONE;
+			int32_t d00 = noise_sign(h00[x], 0, gx0) + noise_sign(h00[x], 1, gy0);
+			int32_t d10 = noise_sign(h10[x], 0, gx1) + noise_sign(h10[x], 1, gy0);
+			int32_t d01 = noise_sign(h01[x], 0, gx0) + noise_sign(h01[x], 1, gy1);
+			int32_t d11 = noise_sign(h11[x], 0, gx1) + noise_sign(h11[x], 1, gy1);
+			int32_t v = noise_lerp(noise_lerp(d00, d10, ux[x]), noise_lerp(d01, d11, ux[x]), uy);
+			out[x] += v >> shift;
+		}
+	}
+}
+
+static void noise3_octave(uint32_t seed, int x0, int y0, int z, int w, int h, int stride, int period, int shift, int32_t *out)
+{
+	int32_t cx[NOISE_STRIP], fx[NOISE_STRIP], ux[NOISE_STRIP], hash[8][NOISE_STRIP];
+	int32_t cz, fz, uz;
+	for (int x = 0; x < w; x++)
+		noise_cell(x0 + x, period, &cx[x], &fx[x], &ux[x]);
+	noise_cell(z, period, &cz, &fz, &uz);
+
+	for (int y = 0; y < h; y++, out += stride) {
+		int32_t cy, fy, uy;
+		noise_cell(y0 + y, period, &cy, &fy, &uy);
+		for (int c = 0; c < 8; c++) {
+			for (int x = 0; x < w; x++)
+				hash[c][x] = noise_hash(seed, cx[x] + (c & 1), cy + (c >> 1 & 1), cz + (c >> 2));
+		}
+		for (int x = 0; x < w; x++) {
+			int32_t d[8];
+			for (int c = 0; c < 8; c++) {
+				d[c] = noise_sign(hash[c][x], 0, fx[x] - (c & 1) * NOISE_ONE) +
+				       noise_sign(hash[c][x], 1, fy - (c >> 1 & 1) * NOISE_ONE) +
+				       noise_sign(hash[c][x], 2, fz - (c >> 2) * NOISE_ONE);
+			}
+			int32_t v0 = noise_lerp(noise_lerp(d[0], d[1], ux[x]), noise_lerp(d[2], d[3], ux[x]), uy);
+			int32_t v1 = noise_lerp(noise_lerp(d[4], d[5], ux[x]), noise_lerp(d[6], d[7], ux[x]), uy);
+			out[x] += noise_lerp(v0, v1, uz) >> shift;
+		}
+	}
+}
+
+/* Fills out, w by h ordered x first, with 2D noise at (x0 + x, y0 + y). The first octave has
+ * features period blocks apart; each further one has half the period and half the amplitude,
+ * until the period drops below 2. Values stay roughly within +-NOISE_ONE. */
+void noise2_grid(uint64_t seed, int x0, int y0, int w, int h, int period, int octaves, int32_t *out)
+{
+	memset(out, 0, w * h * sizeof(int32_t));
+	for (int o = 0; o < octaves && (period >> o) >= 2; o++) {
+		for (int sx = 0; sx < w; sx += NOISE_STRIP)
+			noise2_octave(octave_seed(seed, o), x0 + sx, y0, MIN(w - sx, NOISE_STRIP), h, w, period >> o, o, out + sx);
+	}
+}
+
+/* Like noise2_grid(), for one layer of 3D noise. */
+void noise3_grid(uint64_t seed, int x0, int y0, int z, int w, int h, int period, int octaves, int32_t *out)
+{
+	memset(out, 0, w * h * sizeof(int32_t));
+	for (int o = 0; o < octaves && (period >> o) >= 2; o++) {
+		for (int sx = 0; sx < w; sx += NOISE_STRIP)
+			noise3_octave(octave_seed(seed, o), x0 + sx, y0, z, MIN(w - sx, NOISE_STRIP), h, w, period >> o, o, out + sx);
+	}
+}
+
+int32_t noise2(uint64_t seed, int x, int y, int period, int octaves)
+{
+	int32_t v;
+	noise2_grid(seed, x, y, 1, 1, period, octaves, &v);
+	return v;
+}
+
+int32_t noise3(uint64_t seed, int x, int y, int z, int period, int octaves)
+{
+	int32_t v;
+	noise3_grid(seed, x, y, z, 1, 1, period, octaves, &v);
+	return v;
+}
@@ -1,10 +1,26 @@
 #include <physfs.h>
 #include <SDL.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "util.h"
+#define STB_IMAGE_IMPLEMENTATION
+#define STB_ONLY_PNG
+#define STBI_NO_STDIO
+#define STBI_NO_FAILURE_STRINGS
 #include "stb_image.h"
 
+/* Joins a name to a real (platform dependent) directory path, such as PHYSFS_getWriteDir(). */
+char *real_path_join(const char *dir, const char *name)
+{
+	const char *sep = PHYSFS_getDirSeparator();
+	size_t dir_len = strlen(dir), sep_len = strlen(sep), len = dir_len + sep_len + strlen(name) + 1;
+	bool has_sep = dir_len >= sep_len && strcmp(dir + dir_len - sep_len, sep) == 0;
+	char *path = malloc(len);
+	snprintf(path, len, "%s%s%s", dir, has_sep ? "" : sep, name);
+	return path;
+}
+
 void *read_physfs_file(const char *path, size_t *length)
 {
 	if (PHYSFS_exists(path) == 0)
@@ -1,54 +1,411 @@
 #include <assert.h>
 #include "util.h"
 
-struct queue_node_s {
-	struct queue_node_s *next;
-	void *payload;
-};
-
-queue_t *queue_create(void)
+/* A ring of items stored inline, which doubles when full and never shrinks, so a queue that is
+ * used over and over stops allocating once it has grown to its busiest size. */
+void queue_init(queue_t *queue, size_t item_size)
 {
-	queue_t *q = malloc(sizeof(queue_t));
-	assert(q);
-	memset(q, 0, sizeof(queue_t));
-	return q;
+	memset(queue, 0, sizeof(queue_t));
+	queue->item_size = item_size;
 }
 
-void queue_insert(queue_t *queue, void *v)
+void queue_free(queue_t *queue)
 {
-	struct queue_node_s *n = calloc(1, sizeof(struct queue_node_s));
-	n->payload = v;
+	free(queue->items);
+	queue->items = NULL;
+	queue->head = queue->size = queue->capacity = 0;
+}
 
-	if (queue->tail == NULL)
-		queue->head = queue->tail = n;
-	else {
-		queue->tail->next = n;
-		queue->tail = n;
+static void queue_grow(queue_t *queue, int min_capacity)
+{
+	int capacity = MAX(16, queue->capacity);
+	while (capacity < min_capacity)
+		capacity *= 2;
+	if (capacity == queue->capacity)
+		return;
+	char *items = malloc(capacity * queue->item_size);
+	assert(items);
+	/* Unwrap the ring so it starts at the front of the new storage. */
+	int first = MIN(queue->size, queue->capacity - queue->head);
+	if (queue->size) {
+		memcpy(items, queue->items + queue->head * queue->item_size, first * queue->item_size);
+		memcpy(items + first * queue->item_size, queue->items, (queue->size - first) * queue->item_size);
 	}
+	free(queue->items);
+	queue->items = items;
+	queue->head = 0;
+	queue->capacity = capacity;
+}
+
+/* Appends n items, copied from the array items. */
+void queue_push(queue_t *queue, const void *items, int n)
+{
+	/* An empty queue may have no storage yet to copy nothing into. */
+	if (n <= 0)
+		return;
+	if (queue->size + n > queue->capacity)
+		queue_grow(queue, queue->size + n);
+	int tail = (queue->head + queue->size) & (queue->capacity - 1);
+	int first = MIN(n, queue->capacity - tail);
+	memcpy(queue->items + tail * queue->item_size, items, first * queue->item_size);
+	memcpy(queue->items, (const char *)items + first * queue->item_size, (n - first) * queue->item_size);
+	queue->size += n;
+}
+
+/* Removes up to max items from the front into the array items, and returns how many. */
+int queue_pop(queue_t *queue, void *items, int max)
+{
+	int n = MIN(max, queue->size);
+	if (n == 0)
+		return 0;
+	int first = MIN(n, queue->capacity - queue->head);
+	memcpy(items, queue->items + queue->head * queue->item_size, first * queue->item_size);
+	memcpy((char *)items + first * queue->item_size, queue->items, (n - first) * queue->item_size);
+	queue->head = (queue->head + n) & (queue->capacity - 1);
+	queue->size -= n;
+	return n;
+}
+
+/* Queues of pointers are the common case, so these skip the copies. */
+void queue_insert(queue_t *queue, void *v)
+{
+	assert(queue->item_size == sizeof(void *));
+	if (queue->size == queue->capacity)
+		queue_grow(queue, queue->size + 1);
+	((void **)queue->items)[(queue->head + queue->size++) & (queue->capacity - 1)] = v;
 }
 
 void *queue_pull(queue_t *queue)
 {
-	if (queue->head == NULL)
+	assert(queue->item_size == sizeof(void *));
+	if (queue->size == 0)
 		return NULL;
+	void *v = ((void **)queue->items)[queue->head];
+	queue->head = (queue->head + 1) & (queue->capacity - 1);
+	queue->size--;
+	return v;
+}
+
+/* Takes the pointer inserted last instead of the one inserted first, or NULL if there is none. */
+void *queue_pull_back(queue_t *queue)
+{
+	assert(queue->item_size == sizeof(void *));
+	if (queue->size == 0)
+		return NULL;
+	return ((void **)queue->items)[(queue->head + --queue->size) & (queue->capacity - 1)];
+}
+
+/* The bounded queue is Vyukov's: every cell carries a sequence number that says whether it is
+ * free for the push at its position, or holds the item for the pop at that position, in which
+ * lap around the ring. A pusher claims positions by moving tail on with a compare and swap once
+ * it has seen that the cells are free, copies its items in and then publishes each cell by
+ * bumping its sequence; popping mirrors that with head. Nobody waits on a lock, and a push and a
+ * pop only touch the same cell when the queue is nearly empty or nearly full. Positions wrap
+ * around with the int, which the differences are taken modulo. */
+typedef struct bqueue_cell_s {
+	SDL_atomic_t sequence;
+	char item[];
+} bqueue_cell_t;
+
+/* Pushers and poppers each get a cache line. */
+struct bqueue_s {
+	SDL_atomic_t head;
+	char pad0[64 - sizeof(SDL_atomic_t)];
+	SDL_atomic_t tail;
+	char pad1[64 - sizeof(SDL_atomic_t)];
+	int capacity; /* a power of two */
+	size_t item_size, stride;
+	char *cells;
+};
+
+static inline bqueue_cell_t *bqueue_cell(bqueue_t *queue, unsigned pos)
+{
+	return (bqueue_cell_t *)(queue->cells + (pos & (queue->capacity - 1)) * queue->stride);
+}
+
+/* Returns a queue of at least capacity items of item_size bytes. */
+bqueue_t *bqueue_create(int capacity, size_t item_size)
+{
+	bqueue_t *queue = malloc(sizeof(bqueue_t));
+	assert(queue && capacity > 0);
+	queue->capacity = 2;
+	while (queue->capacity < capacity)
+		queue->capacity *= 2;
+	queue->item_size = item_size;
+	queue->stride = (sizeof(bqueue_cell_t) + item_size + 7) & ~(size_t)7;
+	queue->cells = malloc(queue->capacity * queue->stride);
+	assert(queue->cells);
+	for (int i = 0; i < queue->capacity; i++)
+		SDL_AtomicSet(&bqueue_cell(queue, i)->sequence, i);
+	SDL_AtomicSet(&queue->head, 0);
+	SDL_AtomicSet(&queue->tail, 0);
+	return queue;
+}
+
+/* No other thread may be using the queue. Items still in it are dropped. */
+void bqueue_free(bqueue_t *queue)
+{
+	free(queue->cells);
+	free(queue);
+}
+
+/* Pushes up to n items from the array items, in order and next to each other in the queue, and
+ * returns how many; fewer than n if it filled up. Safe from any thread. */
+int bqueue_push(bqueue_t *queue, const void *items, int n)
+{
+	unsigned pos;
+	int count;
+	if (n <= 0)
+		return 0;
+	for (;;) {
+		pos = SDL_AtomicGet(&queue->tail);
+		for (count = 0; count < n; count++) {
+			if (SDL_AtomicGet(&bqueue_cell(queue, pos + count)->sequence) != (int)(pos + count))
+				break;
+		}
+		if (count == 0) {
+			/* Full, unless another pusher moved tail on since it was read. */
+			int diff = SDL_AtomicGet(&bqueue_cell(queue, pos)->sequence) - (int)pos;
+			if (diff < 0)
+				return 0;
+			continue;
+		}
+		if (SDL_AtomicCAS(&queue->tail, (int)pos, (int)(pos + count)))
+			break;
+	}
+	for (int i = 0; i < count; i++) {
+		bqueue_cell_t *cell = bqueue_cell(queue, pos + i);
+		memcpy(cell->item, (const char *)items + i * queue->item_size, queue->item_size);
+		SDL_AtomicSet(&cell->sequence, pos + i + 1);
+	}
+	return count;
+}
+
+/* Pops up to max items into the array items, in the order they were pushed, and returns how many;
+ * 0 if the queue is empty. Safe from any thread. */
+int bqueue_pop(bqueue_t *queue, void *items, int max)
+{
+	unsigned pos;
+	int count;
+	if (max <= 0)
+		return 0;
+	for (;;) {
+		pos = SDL_AtomicGet(&queue->head);
+		for (count = 0; count < max; count++) {
+			if (SDL_AtomicGet(&bqueue_cell(queue, pos + count)->sequence) != (int)(pos + count + 1))
+				break;
+		}
+		if (count == 0) {
+			/* Empty, or the next item is still being copied in, unless another popper moved head on. */
+			int diff = SDL_AtomicGet(&bqueue_cell(queue, pos)->sequence) - (int)(pos + 1);
+			if (diff < 0)
+				return 0;
+			continue;
+		}
+		if (SDL_AtomicCAS(&queue->head, (int)pos, (int)(pos + count)))
+			break;
+	}
+	for (int i = 0; i < count; i++) {
+		bqueue_cell_t *cell = bqueue_cell(queue, pos + i);
+		memcpy((char *)items + i * queue->item_size, cell->item, queue->item_size);
+		SDL_AtomicSet(&cell->sequence, pos + i + queue->capacity);
+	}
+	return count;
+}
+
+/* How many items are claimed by pushes and not yet by pops; only a snapshot while other threads
+ * use the queue. */
+int bqueue_size(bqueue_t *queue)
+{
+	int head = SDL_AtomicGet(&queue->head);
+	return SDL_AtomicGet(&queue->tail) - head;
+}
 
-	struct queue_node_s *n = queue->head;
-	queue->head = queue->head->next;
-	if (queue->head == NULL)
-		queue->tail = NULL;
+#if 0
+#include <stdio.h>
+#include "tinycthread.h"
+/* Runs the same pointer traffic through the linked list queue_t used to be, the ring and the
+ * bounded queue: a steady queue of jobs that is pushed to and popped from one at a time, the same
+ * in batches of 16, and then two pushing and two popping threads sharing the bounded queue or the
+ * list under a mutex, as the pool's injection queue was. */
+struct bench_node_s {
+	struct bench_node_s *next;
+	void *payload;
+};
+
+typedef struct bench_list_s {
+	struct bench_node_s *head, *tail;
+} bench_list_t;
+
+static void bench_list_insert(bench_list_t *list, void *v)
+{
+	struct bench_node_s *n = calloc(1, sizeof(struct bench_node_s));
+	n->payload = v;
+	if (list->tail == NULL)
+		list->head = list->tail = n;
+	else {
+		list->tail->next = n;
+		list->tail = n;
+	}
+}
 
+static void *bench_list_pull(bench_list_t *list)
+{
+	struct bench_node_s *n = list->head;
+	list->head = n->next;
+	if (list->head == NULL)
+		list->tail = NULL;
 	void *v = n->payload;
 	free(n);
 	return v;
 }
 
-int queue_size(queue_t *queue)
+#define BENCH_OPS 20000000
+#define BENCH_DEPTH 256 /* items kept queued throughout */
+#define BENCH_BATCH 16
+#define BENCH_THREADS 2 /* of each side */
+
+static bqueue_t *bench_shared;
+static bench_list_t bench_locked;
+static mtx_t bench_mutex;
+static bool bench_use_lock;
+static SDL_atomic_t bench_popped;
+
+static int bench_shared_push(void **items, int n)
 {
-	int size = 0;
-	struct queue_node_s *it = queue->head;
-	while (it) {
-		size++;
-		it = it->next;
+	if (!bench_use_lock)
+		return bqueue_push(bench_shared, items, n);
+	mtx_lock(&bench_mutex);
+	for (int i = 0; i < n; i++)
+		bench_list_insert(&bench_locked, items[i]);
+	mtx_unlock(&bench_mutex);
+	return n;
+}
+
+static int bench_shared_pop(void **items, int max)
+{
+	if (!bench_use_lock)
+		return bqueue_pop(bench_shared, items, max);
+	int n = 0;
+	mtx_lock(&bench_mutex);
+	while (n < max && bench_locked.head)
+		items[n++] = bench_list_pull(&bench_locked);
+	mtx_unlock(&bench_mutex);
+	return n;
+}
+
+static int bench_pusher(void *arg)
+{
+	UNUSED(arg);
+	void *items[BENCH_BATCH];
+	for (int i = 0; i < BENCH_BATCH; i++)
+		items[i] = &items[i];
+	for (int pushed = 0; pushed < BENCH_OPS / BENCH_THREADS;) {
+		int n = bench_shared_push(items, MIN(BENCH_BATCH, BENCH_OPS / BENCH_THREADS - pushed));
+		if (n == 0)
+			thrd_yield();
+		pushed += n;
+	}
+	return 0;
+}
+
+static int bench_popper(void *arg)
+{
+	UNUSED(arg);
+	void *items[BENCH_BATCH];
+	while (SDL_AtomicGet(&bench_popped) < BENCH_OPS) {
+		int n = bench_shared_pop(items, BENCH_BATCH);
+		if (n == 0)
+			thrd_yield();
+		SDL_AtomicAdd(&bench_popped, n);
 	}
-	return size;
+	return 0;
+}
+
+void queue_bench(void)
+{
+	double freq = SDL_GetPerformanceFrequency();
+	uintptr_t sum = 0;
+	bench_list_t list = { 0 };
+	queue_t ring;
+	queue_init(&ring, sizeof(void *));
+	bqueue_t *bounded = bqueue_create(BENCH_DEPTH * 2, sizeof(void *));
+	void *batch[BENCH_BATCH];
+	for (int i = 0; i < BENCH_DEPTH; i++) {
+		bench_list_insert(&list, &batch[i % BENCH_BATCH]);
+		queue_insert(&ring, &batch[i % BENCH_BATCH]);
+		bqueue_push(bounded, &batch[i % BENCH_BATCH], 1);
+	}
+
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < BENCH_OPS; i++) {
+		void *v = bench_list_pull(&list);
+		sum += (uintptr_t)v;
+		bench_list_insert(&list, v);
+	}
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < BENCH_OPS; i++) {
+		void *v = queue_pull(&ring);
+		sum += (uintptr_t)v;
+		queue_insert(&ring, v);
+	}
+	Uint64 t2 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < BENCH_OPS; i++) {
+		void *v;
+		bqueue_pop(bounded, &v, 1);
+		sum += (uintptr_t)v;
+		bqueue_push(bounded, &v, 1);
+	}
+	Uint64 t3 = SDL_GetPerformanceCounter();
+	printf("one at a time: list %.0f Mops/s, ring %.0f Mops/s, bounded %.0f Mops/s\n", BENCH_OPS / (1e6 * (t1 - t0) / freq),
+	       BENCH_OPS / (1e6 * (t2 - t1) / freq), BENCH_OPS / (1e6 * (t3 - t2) / freq));
+
+	t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < BENCH_OPS; i += BENCH_BATCH) {
+		for (int j = 0; j < BENCH_BATCH; j++)
+			batch[j] = bench_list_pull(&list);
+		for (int j = 0; j < BENCH_BATCH; j++)
+			bench_list_insert(&list, batch[j]);
+	}
+	t1 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < BENCH_OPS; i += BENCH_BATCH) {
+		queue_pop(&ring, batch, BENCH_BATCH);
+		queue_push(&ring, batch, BENCH_BATCH);
+	}
+	t2 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < BENCH_OPS; i += BENCH_BATCH) {
+		int n = bqueue_pop(bounded, batch, BENCH_BATCH);
+		bqueue_push(bounded, batch, n);
+	}
+	t3 = SDL_GetPerformanceCounter();
+	printf("batches of %d: list %.0f Mops/s, ring %.0f Mops/s, bounded %.0f Mops/s\n", BENCH_BATCH, BENCH_OPS / (1e6 * (t1 - t0) / freq),
+	       BENCH_OPS / (1e6 * (t2 - t1) / freq), BENCH_OPS / (1e6 * (t3 - t2) / freq));
+	printf("size: ring %d, bounded %d (%zu)\n", queue_size(&ring), bqueue_size(bounded), (size_t)sum);
+
+	bench_shared = bqueue_create(1024, sizeof(void *));
+	mtx_init(&bench_mutex, mtx_plain);
+	double shared[2];
+	for (int locked = 0; locked < 2; locked++) {
+		thrd_t threads[BENCH_THREADS * 2];
+		bench_use_lock = locked;
+		SDL_AtomicSet(&bench_popped, 0);
+		t0 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < BENCH_THREADS; i++) {
+			thrd_create(&threads[i], bench_pusher, NULL);
+			thrd_create(&threads[BENCH_THREADS + i], bench_popper, NULL);
+		}
+		for (int i = 0; i < BENCH_THREADS * 2; i++)
+			thrd_join(threads[i], NULL);
+		shared[locked] = BENCH_OPS / (1e6 * (SDL_GetPerformanceCounter() - t0) / freq);
+	}
+	printf("%d pushers, %d poppers: locked list %.0f Mops/s, bounded %.0f Mops/s\n", BENCH_THREADS, BENCH_THREADS, shared[1], shared[0]);
+
+	while (list.head)
+		bench_list_pull(&list);
+	queue_free(&ring);
+	bqueue_free(bounded);
+	bqueue_free(bench_shared);
+	mtx_destroy(&bench_mutex);
+	exit(0);
 }
+#endif
@@ -1,141 +1,826 @@
+#include <assert.h>
+#include <stdio.h>
 #include <time.h>
 #include "tinycthread.h"
 #include "util.h"
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
 
+#define TPOOL_INJECT_INTERVAL 61 /* a worker with local work still checks the shared queue this often */
+#define TPOOL_AGING_INTERVAL 16  /* and looks at a lower priority first this often */
+
+enum { WORK_QUEUED, WORK_RUNNING, WORK_CANCELLED };
+
+/* A job is shared by the queue and, if it was added with tpool_add_job(), the caller's handle.
+ * Whichever lets go of it last frees it. The state decides between a worker starting it and the
+ * caller cancelling it, so a cancelled job stays queued and is dropped when a worker reaches it. */
 typedef struct tpool_work_s {
+	struct tpool_s *pool;
 	tpool_worker_t fn;
 	void *arg;
 	bool arg_owned;
+	tpool_priority_t priority;
+	SDL_atomic_t state, refs;
 } tpool_work_t;
 
+/* A job that returns TPOOL_RETRY_LATER waits on the signal it named with tpool_retry_on() instead
+ * of going back in the queue, and is queued again once the signal is raised. The generation tells
+ * a waiter whether the signal was raised after it last looked at its condition, in which case it
+ * is queued again straight away; anything raised after it joins the waiters finds it there.
+ * Raising a signal nobody waits on is one atomic add. */
+struct tpool_signal_s {
+	SDL_atomic_t generation, num_waiting;
+	mtx_t mutex, release_mutex;
+	queue_t waiting; /* guarded by mutex */
+	queue_t ready;   /* guarded by release_mutex: the waiters being queued again, empty otherwise */
+};
+
+/* A queue of jobs used from both ends. The owner pushes and pops at the back, so it runs what it
+ * added last while that is still in cache, and thieves take from the front, the oldest and usually
+ * largest work. */
+typedef struct tpool_deque_s {
+	mtx_t mutex;
+	queue_t jobs; /* guarded by mutex */
+} tpool_deque_t;
+
+typedef struct tpool_thread_s {
+	struct tpool_s *pool;
+	tpool_deque_t deques[TPOOL_PRIORITIES];
+	unsigned ticks;
+	int limited; /* the priority whose running count the current job holds, or -1 */
+	tpool_signal_t *retry_signal; /* what the running job waits on if it asks to be retried */
+	int retry_generation;
+	bool searching; /* woken to look for work, and counted in the pool's num_searching */
+	/* guarded by the pool's park_mutex */
+	cnd_t wake;
+	bool woken;
+	struct tpool_thread_s *next_parked;
+} tpool_thread_t;
+
+/* Every worker has its own deque per priority, and jobs a worker adds go on it. Jobs from any
+ * other thread go on the shared injection queue of their priority. An idle worker looks through
+ * the priorities from the highest, and in each takes from its own deque, then the injection
+ * queue, then steals from the others in turn, and parks once all of them are empty.
+ *
+ * Adding a job wakes one parked worker, and only if no other woken worker is still looking for
+ * work; one that finds some wakes the next, so a burst of jobs wakes workers one after another
+ * instead of all at once. A worker about to park registers first and stops counting as searching,
+ * then looks for work once more, and adders look for searching and parked workers after queueing,
+ * so a job is never left queued with every worker asleep.
+ *
+ * So that a steady stream of urgent work can't hold back the rest forever, every
+ * TPOOL_AGING_INTERVAL jobs a worker starts its search at one of the lower priorities, taking
+ * each in turn. A priority can also be limited to a number of jobs running at once, which a
+ * worker reserves before taking one; workers that can't are free for other work, and whoever
+ * frees the reservation looks for work again straight after, so a job held back by the limit is
+ * picked up without waking anybody. */
 struct tpool_s {
-	queue_t work_queue;
-	mtx_t work_mutex;
-	cnd_t work_cond, working_cond;
-	size_t num_busy, total_threads;
-	bool stop;
+	tpool_thread_t *threads;
+	size_t num_threads;
+	mtx_t inject_mutex;
+	queue_t inject[TPOOL_PRIORITIES];
+	SDL_atomic_t queued[TPOOL_PRIORITIES];  /* jobs in the deques and injection queue, to skip empty priorities */
+	SDL_atomic_t running[TPOOL_PRIORITIES]; /* only counted for limited priorities */
+	SDL_atomic_t limits[TPOOL_PRIORITIES];  /* 0 for none */
+	mtx_t park_mutex;
+	tpool_thread_t *parked;
+	SDL_atomic_t num_parked, num_searching, num_busy, pending, stop;
+	mtx_t wait_mutex;
+	cnd_t wait_cond;
+	size_t num_alive; /* guarded by wait_mutex */
 };
 
-static inline void tpool_insert_work(tpool_t *pool, tpool_work_t *work)
+static _Thread_local tpool_thread_t *current_thread;
+
+static void tpool_deque_push(tpool_deque_t *d, tpool_work_t *work)
 {
-	mtx_lock(&pool->work_mutex);
-	queue_insert(&pool->work_queue, work);
-	cnd_broadcast(&pool->work_cond);
-	mtx_unlock(&pool->work_mutex);
+	mtx_lock(&d->mutex);
+	queue_insert(&d->jobs, work);
+	mtx_unlock(&d->mutex);
 }
 
-static int tpool_worker(void *arg)
+static tpool_work_t *tpool_deque_pop(tpool_deque_t *d, bool back)
+{
+	mtx_lock(&d->mutex);
+	tpool_work_t *work = back ? queue_pull_back(&d->jobs) : queue_pull(&d->jobs);
+	mtx_unlock(&d->mutex);
+	return work;
+}
+
+static tpool_work_t *tpool_inject_pull(tpool_t *pool, int priority)
+{
+	mtx_lock(&pool->inject_mutex);
+	tpool_work_t *work = queue_pull(&pool->inject[priority]);
+	mtx_unlock(&pool->inject_mutex);
+	return work;
+}
+
+static void tpool_wake_one(tpool_t *pool)
+{
+	if (SDL_AtomicGet(&pool->num_parked) == 0 || !SDL_AtomicCAS(&pool->num_searching, 0, 1))
+		return;
+	mtx_lock(&pool->park_mutex);
+	tpool_thread_t *t = pool->parked;
+	if (t) {
+		pool->parked = t->next_parked;
+		SDL_AtomicAdd(&pool->num_parked, -1);
+		t->woken = true;
+		cnd_signal(&t->wake);
+	} else
+		SDL_AtomicAdd(&pool->num_searching, -1);
+	mtx_unlock(&pool->park_mutex);
+}
+
+/* A woken worker that found a job wakes the next, in case more were added meanwhile. */
+static void tpool_stop_searching(tpool_thread_t *self, bool found)
+{
+	if (!self->searching)
+		return;
+	self->searching = false;
+	if (SDL_AtomicAdd(&self->pool->num_searching, -1) == 1 && found)
+		tpool_wake_one(self->pool);
+}
+
+/* Queues the job on the calling worker's deque, or the injection queue if shared or the caller
+ * isn't one of the pool's workers, and wakes a worker for it. */
+static void tpool_insert_work(tpool_t *pool, tpool_work_t *work, bool shared)
+{
+	SDL_AtomicAdd(&pool->queued[work->priority], 1);
+	if (!shared && current_thread && current_thread->pool == pool)
+		tpool_deque_push(&current_thread->deques[work->priority], work);
+	else {
+		mtx_lock(&pool->inject_mutex);
+		queue_insert(&pool->inject[work->priority], work);
+		mtx_unlock(&pool->inject_mutex);
+	}
+	tpool_wake_one(pool);
+}
+
+static void tpool_work_release(tpool_work_t *work)
+{
+	if (SDL_AtomicAdd(&work->refs, -1) == 1) {
+		if (work->arg_owned && work->arg)
+			free(work->arg);
+		free(work);
+	}
+}
+
+/* Counts a job as done, run or dropped, waking tpool_wait() after the last. */
+static void tpool_work_done(tpool_t *pool)
+{
+	if (SDL_AtomicAdd(&pool->pending, -1) == 1) {
+		mtx_lock(&pool->wait_mutex);
+		cnd_broadcast(&pool->wait_cond);
+		mtx_unlock(&pool->wait_mutex);
+	}
+}
+
+static void tpool_signal_init(tpool_signal_t *signal)
+{
+	SDL_AtomicSet(&signal->generation, 0);
+	SDL_AtomicSet(&signal->num_waiting, 0);
+	mtx_init(&signal->mutex, mtx_plain);
+	mtx_init(&signal->release_mutex, mtx_plain);
+	queue_init(&signal->waiting, sizeof(tpool_work_t *));
+	queue_init(&signal->ready, sizeof(tpool_work_t *));
+}
+
+/* Queues every job waiting on the signal again, each in its own pool. The waiters are swapped out
+ * for the empty ready queue, so new ones can join while these are queued and neither queue's
+ * storage is given up. */
+static void tpool_signal_release(tpool_signal_t *signal)
 {
-	tpool_t *pool = arg;
 	tpool_work_t *work;
+	mtx_lock(&signal->release_mutex);
+	mtx_lock(&signal->mutex);
+	queue_t ready = signal->ready;
+	signal->ready = signal->waiting;
+	signal->waiting = ready;
+	SDL_AtomicSet(&signal->num_waiting, 0);
+	mtx_unlock(&signal->mutex);
+	while ((work = queue_pull(&signal->ready)) != NULL)
+		tpool_insert_work(work->pool, work, true);
+	mtx_unlock(&signal->release_mutex);
+}
 
-	while (true) {
-		mtx_lock(&pool->work_mutex);
-		if (pool->stop)
-			break;
+/* Adds a job to the signal's waiters, or queues it again if the signal was raised since
+ * generation. The waiter count is raised before the generation is read, and raising a signal adds
+ * to the generation before reading the count, so one of the two always sees the other. */
+static void tpool_signal_wait(tpool_signal_t *signal, tpool_work_t *work, int generation)
+{
+	mtx_lock(&signal->mutex);
+	queue_insert(&signal->waiting, work);
+	SDL_AtomicAdd(&signal->num_waiting, 1);
+	bool missed = SDL_AtomicGet(&signal->generation) != generation;
+	mtx_unlock(&signal->mutex);
+	if (missed)
+		tpool_signal_release(signal);
+}
 
-		if (queue_is_empty(&pool->work_queue))
-			cnd_wait(&pool->work_cond, &pool->work_mutex);
+tpool_signal_t *tpool_signal_create(void)
+{
+	tpool_signal_t *signal = malloc(sizeof(tpool_signal_t));
+	tpool_signal_init(signal);
+	return signal;
+}
 
-		work = queue_pull(&pool->work_queue);
-		pool->num_busy++;
-		mtx_unlock(&pool->work_mutex);
+/* Queues the jobs still waiting on the signal again, and frees it. Must happen before the pools
+ * of those jobs are destroyed. */
+void tpool_signal_destroy(tpool_signal_t *signal)
+{
+	if (signal == NULL)
+		return;
+	tpool_signal_release(signal);
+	mtx_destroy(&signal->mutex);
+	mtx_destroy(&signal->release_mutex);
+	queue_free(&signal->waiting);
+	queue_free(&signal->ready);
+	free(signal);
+}
 
-		if (work) {
-			tpool_ret_t r = work->fn(work->arg);
-			if (r == TPOOL_RETRY_LATER) {
-				tpool_insert_work(pool, work);
-			} else {
-				if (work->arg_owned && work->arg)
-					free(work->arg);
-				free(work);
-			}
-			SDL_Delay(100);
+/* Queues again the jobs that asked to be retried on the signal. Safe to call from any thread. */
+void tpool_signal(tpool_signal_t *signal)
+{
+	SDL_AtomicAdd(&signal->generation, 1);
+	if (SDL_AtomicGet(&signal->num_waiting) != 0)
+		tpool_signal_release(signal);
+}
+
+/* Called by a running job before it checks whatever it would wait for: if it then returns
+ * TPOOL_RETRY_LATER, it is run again once the signal is raised, and straight away if it was raised
+ * in between. A job must call this before returning TPOOL_RETRY_LATER, since only whatever it waits
+ * for knows when it is worth running again. */
+void tpool_retry_on(tpool_signal_t *signal)
+{
+	assert(current_thread);
+	current_thread->retry_signal = signal;
+	current_thread->retry_generation = SDL_AtomicGet(&signal->generation);
+}
+
+static tpool_work_t *tpool_find_priority(tpool_thread_t *self, int priority)
+{
+	tpool_t *pool = self->pool;
+	tpool_work_t *work = NULL;
+	if (SDL_AtomicGet(&pool->queued[priority]) == 0)
+		return NULL;
+	/* Read once, as it can change meanwhile, so the reservation is given back as it was taken. */
+	int limit = SDL_AtomicGet(&pool->limits[priority]);
+	if (limit) {
+		if (SDL_AtomicAdd(&pool->running[priority], 1) >= limit) {
+			SDL_AtomicAdd(&pool->running[priority], -1);
+			return NULL;
 		}
+	}
+
+	/* Workers feeding themselves mustn't starve the main thread's jobs. */
+	if (self->ticks % TPOOL_INJECT_INTERVAL == 0)
+		work = tpool_inject_pull(pool, priority);
+	if (work == NULL)
+		work = tpool_deque_pop(&self->deques[priority], true);
+	if (work == NULL)
+		work = tpool_inject_pull(pool, priority);
+	for (size_t i = 1; work == NULL && i < pool->num_threads; i++)
+		work = tpool_deque_pop(&pool->threads[(self - pool->threads + i) % pool->num_threads].deques[priority], false);
+
+	if (work) {
+		SDL_AtomicAdd(&pool->queued[priority], -1);
+		self->limited = limit ? priority : -1;
+	} else if (limit)
+		SDL_AtomicAdd(&pool->running[priority], -1);
+	return work;
+}
+
+static tpool_work_t *tpool_find_work(tpool_thread_t *self)
+{
+	tpool_work_t *work = NULL;
+	int first = 0;
+	if (++self->ticks % TPOOL_AGING_INTERVAL == 0)
+		first = 1 + self->ticks / TPOOL_AGING_INTERVAL % (TPOOL_PRIORITIES - 1);
+	work = tpool_find_priority(self, first);
+	for (int p = 0; work == NULL && p < TPOOL_PRIORITIES; p++) {
+		if (p != first)
+			work = tpool_find_priority(self, p);
+	}
+	return work;
+}
+
+/* Parks the worker until a job is added, unless it finds one on the way, which it returns. */
+static tpool_work_t *tpool_park(tpool_thread_t *self)
+{
+	tpool_t *pool = self->pool;
+	mtx_lock(&pool->park_mutex);
+	self->woken = false;
+	self->next_parked = pool->parked;
+	pool->parked = self;
+	SDL_AtomicAdd(&pool->num_parked, 1);
+	mtx_unlock(&pool->park_mutex);
+	tpool_stop_searching(self, false);
+
+	/* Anything queued before registering is found here, and anything after wakes a worker. */
+	tpool_work_t *work = tpool_find_work(self);
+	mtx_lock(&pool->park_mutex);
+	if (work && !self->woken) {
+		tpool_thread_t **p = &pool->parked;
+		while (*p != self)
+			p = &(*p)->next_parked;
+		*p = self->next_parked;
+		SDL_AtomicAdd(&pool->num_parked, -1);
+	}
+	while (!work && !self->woken && !SDL_AtomicGet(&pool->stop))
+		cnd_wait(&self->wake, &pool->park_mutex);
+	/* Whoever woke it counted it as searching. */
+	self->searching = self->woken;
+	mtx_unlock(&pool->park_mutex);
+	return work;
+}
 
-		mtx_lock(&pool->work_mutex);
-		pool->num_busy--;
-		if (!pool->stop && pool->num_busy == 0 && queue_is_empty(&pool->work_queue))
-			cnd_signal(&pool->working_cond);
-		mtx_unlock(&pool->work_mutex);
+static void tpool_run(tpool_thread_t *self, tpool_work_t *work)
+{
+	tpool_t *pool = self->pool;
+	if (!SDL_AtomicCAS(&work->state, WORK_QUEUED, WORK_RUNNING)) {
+		if (self->limited >= 0)
+			SDL_AtomicAdd(&pool->running[self->limited], -1);
+		tpool_work_release(work); /* cancelled while queued */
+		tpool_work_done(pool);
+		return;
+	}
+	SDL_AtomicAdd(&pool->num_busy, 1);
+	self->retry_signal = NULL;
+	tpool_ret_t r = work->fn(work->arg);
+	if (r == TPOOL_RETRY_LATER) {
+		/* Still pending, and can be cancelled while it waits. A job that named nothing to wait
+		 * for is a bug, but rather than lose it, it goes to the back of the shared queue. */
+		assert(self->retry_signal && "TPOOL_RETRY_LATER without tpool_retry_on()");
+		SDL_AtomicSet(&work->state, WORK_QUEUED);
+		if (self->retry_signal)
+			tpool_signal_wait(self->retry_signal, work, self->retry_generation);
+		else
+			tpool_insert_work(pool, work, true);
+	} else {
+		tpool_work_release(work);
+		tpool_work_done(pool);
+	}
+	SDL_AtomicAdd(&pool->num_busy, -1);
+	if (self->limited >= 0)
+		SDL_AtomicAdd(&pool->running[self->limited], -1);
+}
+
+static int tpool_worker(void *arg)
+{
+	tpool_thread_t *self = arg;
+	tpool_t *pool = self->pool;
+	current_thread = self;
+
+	while (!SDL_AtomicGet(&pool->stop)) {
+		tpool_work_t *work = tpool_find_work(self);
+		if (work == NULL)
+			work = tpool_park(self);
+		if (work) {
+			tpool_stop_searching(self, true);
+			tpool_run(self, work);
+		}
 	}
 
-	pool->total_threads--;
-	cnd_signal(&pool->working_cond);
-	mtx_unlock(&pool->work_mutex);
+	mtx_lock(&pool->wait_mutex);
+	pool->num_alive--;
+	cnd_broadcast(&pool->wait_cond);
+	mtx_unlock(&pool->wait_mutex);
 	return 0;
 }
 
+/* Hardware threads on the same core share its execution units, so beyond one worker per core the
+ * generation work, bound by arithmetic and memory, hardly goes faster. Falls back to the number of
+ * logical processors where the topology can't be read. */
+unsigned int tpool_num_physical_cores(void)
+{
+	unsigned int cores = 0;
+#if defined(_WIN32)
+	DWORD length = 0;
+	GetLogicalProcessorInformation(NULL, &length);
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info = malloc(length);
+	if (info && GetLogicalProcessorInformation(info, &length)) {
+		for (DWORD i = 0; i < length / sizeof(*info); i++)
+			cores += info[i].Relationship == RelationProcessorCore;
+	}
+	free(info);
+#elif defined(__APPLE__)
+	int n;
+	size_t size = sizeof(n);
+	if (sysctlbyname("hw.physicalcpu", &n, &size, NULL, 0) == 0 && n > 0)
+		cores = n;
+#else
+	/* A core is counted by its first hardware thread, the lowest numbered of its siblings. */
+	long configured = sysconf(_SC_NPROCESSORS_CONF);
+	for (long cpu = 0; cpu < configured; cpu++) {
+		char path[96];
+		unsigned int first;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/topology/thread_siblings_list", cpu);
+		FILE *f = fopen(path, "r");
+		if (f == NULL)
+			continue; /* offline */
+		if (fscanf(f, "%u", &first) == 1 && first == cpu)
+			cores++;
+		fclose(f);
+	}
+#endif
+	return cores ? MIN(cores, tpool_num_cores()) : tpool_num_cores();
+}
+
+/* With workers 0, sizes the pool to one worker per physical core but the one the main thread
+ * runs on. */
 tpool_t *tpool_create(size_t workers)
 {
 	thrd_t thread;
 	tpool_t *pool = calloc(1, sizeof(tpool_t));
-	workers = MIN(workers, 2);
-	pool->total_threads = workers;
-	mtx_init(&pool->work_mutex, mtx_plain);
-	cnd_init(&pool->work_cond);
-	cnd_init(&pool->working_cond);
+	if (workers == 0)
+		workers = MAX(1, (int)tpool_num_physical_cores() - 1);
+	pool->threads = calloc(workers, sizeof(tpool_thread_t));
+	pool->num_threads = pool->num_alive = workers;
+	mtx_init(&pool->inject_mutex, mtx_plain);
+	for (int p = 0; p < TPOOL_PRIORITIES; p++)
+		queue_init(&pool->inject[p], sizeof(tpool_work_t *));
+	mtx_init(&pool->park_mutex, mtx_plain);
+	mtx_init(&pool->wait_mutex, mtx_plain);
+	cnd_init(&pool->wait_cond);
 
 	for (size_t i = 0; i < workers; i++) {
-		thrd_create(&thread, tpool_worker, pool);
+		pool->threads[i].pool = pool;
+		pool->threads[i].limited = -1;
+		for (int p = 0; p < TPOOL_PRIORITIES; p++) {
+			mtx_init(&pool->threads[i].deques[p].mutex, mtx_plain);
+			queue_init(&pool->threads[i].deques[p].jobs, sizeof(tpool_work_t *));
+		}
+		cnd_init(&pool->threads[i].wake);
+	}
+	for (size_t i = 0; i < workers; i++) {
+		thrd_create(&thread, tpool_worker, &pool->threads[i]);
 		thrd_detach(thread);
 	}
 	return pool;
 }
 
+static void tpool_task_finish(tpool_task_t *task, tpool_ret_t result);
+static tpool_ret_t tpool_task_job(void *arg);
+
+/* Frees a job that will never run. A task's job fails the task instead of leaving it unfinished, so
+ * whoever waits on it wakes, and whatever depends on it fails in turn. */
+static void tpool_drop(tpool_work_t *work)
+{
+	if (work->fn == tpool_task_job)
+		tpool_task_finish(work->arg, TPOOL_FAILURE);
+	SDL_AtomicSet(&work->state, WORK_CANCELLED);
+	tpool_work_release(work);
+}
+
+/* Drops the jobs still queued. Tasks they belong to fail, as does anything depending on those. */
 void tpool_destroy(tpool_t *pool)
 {
 	tpool_work_t *work;
 	if (pool == NULL)
 		return;
 
-	mtx_lock(&pool->work_mutex);
-	while (!queue_is_empty(&pool->work_queue)) {
-		work = queue_pull(&pool->work_queue);
-		if (work->arg_owned && work->arg)
-			free(work->arg);
-		free(work);
-	}
-	pool->stop = true;
-	cnd_broadcast(&pool->work_cond);
-	mtx_unlock(&pool->work_mutex);
+	/* Workers finish the job they are running, and may queue more, before they exit. */
+	SDL_AtomicSet(&pool->stop, 1);
+	mtx_lock(&pool->park_mutex);
+	for (tpool_thread_t *t = pool->parked; t; t = t->next_parked)
+		cnd_signal(&t->wake);
+	mtx_unlock(&pool->park_mutex);
+	mtx_lock(&pool->wait_mutex);
+	while (pool->num_alive != 0)
+		cnd_wait(&pool->wait_cond, &pool->wait_mutex);
+	mtx_unlock(&pool->wait_mutex);
 
-	mtx_destroy(&pool->work_mutex);
-	cnd_destroy(&pool->work_cond);
-	cnd_destroy(&pool->working_cond);
+	for (int p = 0; p < TPOOL_PRIORITIES; p++) {
+		while ((work = queue_pull(&pool->inject[p])) != NULL)
+			tpool_drop(work);
+		queue_free(&pool->inject[p]);
+	}
+	for (size_t i = 0; i < pool->num_threads; i++) {
+		tpool_thread_t *t = &pool->threads[i];
+		for (int p = 0; p < TPOOL_PRIORITIES; p++) {
+			while ((work = tpool_deque_pop(&t->deques[p], false)) != NULL)
+				tpool_drop(work);
+			queue_free(&t->deques[p].jobs);
+			mtx_destroy(&t->deques[p].mutex);
+		}
+		cnd_destroy(&t->wake);
+	}
+	mtx_destroy(&pool->inject_mutex);
+	mtx_destroy(&pool->park_mutex);
+	mtx_destroy(&pool->wait_mutex);
+	cnd_destroy(&pool->wait_cond);
+	free(pool->threads);
 	free(pool);
 }
 
-int tpool_add_work(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned)
+static tpool_work_t *tpool_queue_work(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned,
+				      tpool_priority_t priority, int refs)
 {
-	tpool_work_t *work;
-	if (pool == NULL)
-		return -1;
-
-	work = malloc(sizeof(tpool_work_t));
+	assert(priority >= 0 && priority < TPOOL_PRIORITIES);
+	tpool_work_t *work = malloc(sizeof(tpool_work_t));
+	work->pool = pool;
 	work->fn = worker;
 	work->arg = arg;
 	work->arg_owned = arg_owned;
+	work->priority = priority;
+	SDL_AtomicSet(&work->state, WORK_QUEUED);
+	SDL_AtomicSet(&work->refs, refs);
 
-	tpool_insert_work(pool, work);
+	SDL_AtomicAdd(&pool->pending, 1);
+	tpool_insert_work(pool, work, false);
+	return work;
+}
+
+int tpool_add_work(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned, tpool_priority_t priority)
+{
+	if (pool == NULL)
+		return -1;
+	tpool_queue_work(pool, worker, arg, arg_owned, priority, 1);
 	return 0;
 }
 
+/* Like tpool_add_work(), returning a handle the job can be cancelled through until a worker starts
+ * it. The handle must be given back with tpool_job_release(). */
+tpool_job_t *tpool_add_job(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned, tpool_priority_t priority)
+{
+	if (pool == NULL)
+		return NULL;
+	return tpool_queue_work(pool, worker, arg, arg_owned, priority, 2);
+}
+
+/* Returns true if the job will never run, and false if it already started. An owned argument is
+ * freed with the job. */
+bool tpool_cancel(tpool_job_t *job)
+{
+	int state = SDL_AtomicGet(&job->state);
+	return state == WORK_CANCELLED || SDL_AtomicCAS(&job->state, WORK_QUEUED, WORK_CANCELLED);
+}
+
+void tpool_job_release(tpool_job_t *job)
+{
+	if (job)
+		tpool_work_release(job);
+}
+
 int tpool_busy_workers(tpool_t *pool)
 {
-	return pool->num_busy;
+	return SDL_AtomicGet(&pool->num_busy);
+}
+
+size_t tpool_num_workers(tpool_t *pool)
+{
+	return pool->num_threads;
 }
 
+/* Lets at most max_running jobs of the priority run at once, or any number with 0. Applies to jobs
+ * started from then on. */
+void tpool_set_priority_limit(tpool_t *pool, tpool_priority_t priority, int max_running)
+{
+	assert(priority >= 0 && priority < TPOOL_PRIORITIES && max_running >= 0);
+	SDL_AtomicSet(&pool->limits[priority], max_running);
+}
+
+/* Waits until every job added so far, and every job those add, has run or been cancelled. Not
+ * to be called from one of the pool's own jobs. */
 void tpool_wait(tpool_t *pool)
 {
 	if (pool) {
-		mtx_lock(&pool->work_mutex);
-		while (true) {
-			if ((pool->stop == false && pool->num_busy != 0) || (pool->stop && pool->total_threads != 0))
-				cnd_wait(&pool->working_cond, &pool->work_mutex);
-			else
-				break;
+		mtx_lock(&pool->wait_mutex);
+		while (SDL_AtomicGet(&pool->pending) != 0)
+			cnd_wait(&pool->wait_cond, &pool->wait_mutex);
+		mtx_unlock(&pool->wait_mutex);
+	}
+}
+
+/* A task is a job that starts once the tasks it depends on have finished. Each counts the
+ * predecessors it still waits for, plus one until it is submitted, and whichever finishing
+ * predecessor, or the submit, takes the count to zero queues it. A finished task records its
+ * result, so the handle doubles as a future, and anything depending on it later doesn't wait. A
+ * task whose predecessor failed doesn't run and fails too. Tasks without a function only join
+ * their predecessors and finish as soon as they are ready, without going through the queue.
+ *
+ * The handle and the graph each hold a reference, the graph's dropped when the task finishes, so
+ * a handle can be released as soon as the task is submitted. Every task created must be
+ * submitted. */
+struct tpool_task_s {
+	tpool_t *pool;
+	tpool_worker_t fn;
+	void *arg;
+	bool arg_owned;
+	tpool_priority_t priority;
+	SDL_atomic_t waiting, failed, refs;
+	bool submitted; /* only touched by whoever builds the graph */
+	mtx_t mutex;
+	cnd_t finished;
+	/* guarded by mutex */
+	bool done;
+	tpool_ret_t result;
+	struct tpool_task_s **successors;
+	int num_successors, max_successors;
+};
+
+static void tpool_task_ready(tpool_task_t *task);
+
+void tpool_task_release(tpool_task_t *task)
+{
+	if (task && SDL_AtomicAdd(&task->refs, -1) == 1) {
+		mtx_destroy(&task->mutex);
+		cnd_destroy(&task->finished);
+		free(task);
+	}
+}
+
+static void tpool_task_finish(tpool_task_t *task, tpool_ret_t result)
+{
+	mtx_lock(&task->mutex);
+	task->done = true;
+	task->result = result;
+	tpool_task_t **successors = task->successors;
+	int num_successors = task->num_successors;
+	task->successors = NULL;
+	task->num_successors = task->max_successors = 0;
+	cnd_broadcast(&task->finished);
+	mtx_unlock(&task->mutex);
+
+	for (int i = 0; i < num_successors; i++) {
+		if (result == TPOOL_FAILURE)
+			SDL_AtomicSet(&successors[i]->failed, 1);
+		if (SDL_AtomicAdd(&successors[i]->waiting, -1) == 1)
+			tpool_task_ready(successors[i]);
+	}
+	free(successors);
+	if (task->arg_owned && task->arg)
+		free(task->arg);
+	tpool_task_release(task);
+}
+
+static tpool_ret_t tpool_task_job(void *arg)
+{
+	tpool_task_t *task = arg;
+	tpool_ret_t r = task->fn(task->arg);
+	if (r != TPOOL_RETRY_LATER)
+		tpool_task_finish(task, r);
+	return r;
+}
+
+static void tpool_task_ready(tpool_task_t *task)
+{
+	if (SDL_AtomicGet(&task->failed))
+		tpool_task_finish(task, TPOOL_FAILURE);
+	else if (task->fn == NULL)
+		tpool_task_finish(task, TPOOL_SUCCESS);
+	else
+		tpool_add_work(task->pool, tpool_task_job, task, false, task->priority);
+}
+
+/* Creates a task that runs worker on the pool once it is submitted and everything it depends on
+ * has finished. With no worker, the task just joins its dependencies. */
+tpool_task_t *tpool_task_create(tpool_t *pool, tpool_worker_t worker, void *arg, bool arg_owned, tpool_priority_t priority)
+{
+	assert(pool);
+	tpool_task_t *task = calloc(1, sizeof(tpool_task_t));
+	assert(task);
+	task->pool = pool;
+	task->fn = worker;
+	task->arg = arg;
+	task->arg_owned = arg_owned;
+	task->priority = priority;
+	SDL_AtomicSet(&task->waiting, 1);
+	SDL_AtomicSet(&task->refs, 2);
+	mtx_init(&task->mutex, mtx_plain);
+	cnd_init(&task->finished);
+	return task;
+}
+
+/* Makes task wait for on, which may have finished already. Only before task is submitted. */
+void tpool_task_depends(tpool_task_t *task, tpool_task_t *on)
+{
+	assert(!task->submitted);
+	mtx_lock(&on->mutex);
+	if (on->done) {
+		if (on->result == TPOOL_FAILURE)
+			SDL_AtomicSet(&task->failed, 1);
+	} else {
+		if (on->num_successors == on->max_successors) {
+			on->max_successors = MAX(4, on->max_successors * 2);
+			on->successors = realloc(on->successors, on->max_successors * sizeof(tpool_task_t *));
+			assert(on->successors);
 		}
-		mtx_unlock(&pool->work_mutex);
+		on->successors[on->num_successors++] = task;
+		SDL_AtomicAdd(&task->waiting, 1);
+	}
+	mtx_unlock(&on->mutex);
+}
+
+void tpool_task_submit(tpool_task_t *task)
+{
+	assert(!task->submitted);
+	task->submitted = true;
+	if (SDL_AtomicAdd(&task->waiting, -1) == 1)
+		tpool_task_ready(task);
+}
+
+/* Submits a task that runs worker, at the same priority, once task has finished. */
+tpool_task_t *tpool_task_then(tpool_task_t *task, tpool_worker_t worker, void *arg, bool arg_owned)
+{
+	tpool_task_t *next = tpool_task_create(task->pool, worker, arg, arg_owned, task->priority);
+	tpool_task_depends(next, task);
+	tpool_task_submit(next);
+	return next;
+}
+
+/* Submits a task that finishes once all of the tasks have, failing if any of them did. Its
+ * continuations run at the highest of their priorities. */
+tpool_task_t *tpool_when_all(tpool_t *pool, tpool_task_t **tasks, int count)
+{
+	tpool_task_t *all = tpool_task_create(pool, NULL, NULL, false, TPOOL_IDLE);
+	for (int i = 0; i < count; i++) {
+		all->priority = MIN(all->priority, tasks[i]->priority);
+		tpool_task_depends(all, tasks[i]);
+	}
+	tpool_task_submit(all);
+	return all;
+}
+
+bool tpool_task_done(tpool_task_t *task)
+{
+	mtx_lock(&task->mutex);
+	bool done = task->done;
+	mtx_unlock(&task->mutex);
+	return done;
+}
+
+/* Waits for the task to finish and returns its result. Not to be called from one of the pool's
+ * own jobs. */
+tpool_ret_t tpool_task_wait(tpool_task_t *task)
+{
+	mtx_lock(&task->mutex);
+	while (!task->done)
+		cnd_wait(&task->finished, &task->mutex);
+	tpool_ret_t result = task->result;
+	mtx_unlock(&task->mutex);
+	return result;
+}
+
+#if 0
+/* Runs a million tiny jobs added from this thread, a million more added from inside the pool, a
+ * thousand per job, and jobs about the size of generating a chunk's terrain, on 1, 2, 4, ...
+ * workers up to the number of cores. */
+static SDL_atomic_t bench_count;
+
+static tpool_ret_t bench_tiny(void *unused)
+{
+	UNUSED(unused);
+	SDL_AtomicAdd(&bench_count, 1);
+	return TPOOL_SUCCESS;
+}
+
+static tpool_ret_t bench_fan_out(void *pool)
+{
+	for (int i = 0; i < 1000; i++)
+		tpool_add_work(pool, bench_tiny, NULL, false, TPOOL_BACKGROUND);
+	return TPOOL_SUCCESS;
+}
+
+static tpool_ret_t bench_chunk(void *unused)
+{
+	UNUSED(unused);
+	int32_t out[25 * 25];
+	int n = SDL_AtomicAdd(&bench_count, 1);
+	for (int i = 0; i < 8; i++)
+		noise2_grid(1234, n * 25, i * 25, 25, 25, 256, 5, out);
+	return TPOOL_SUCCESS;
+}
+
+void tpool_bench(void)
+{
+	const int tiny = 1000000, chunks = 10000;
+	double freq = SDL_GetPerformanceFrequency();
+	for (unsigned workers = 1;; workers = MIN(workers * 2, tpool_num_cores())) {
+		tpool_t *pool = tpool_create(workers);
+		Uint64 t0 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < tiny; i++)
+			tpool_add_work(pool, bench_tiny, NULL, false, TPOOL_BACKGROUND);
+		tpool_wait(pool);
+		Uint64 t1 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < tiny / 1000; i++)
+			tpool_add_work(pool, bench_fan_out, pool, false, TPOOL_BACKGROUND);
+		tpool_wait(pool);
+		Uint64 t2 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < chunks; i++)
+			tpool_add_work(pool, bench_chunk, NULL, false, TPOOL_BACKGROUND);
+		tpool_wait(pool);
+		Uint64 t3 = SDL_GetPerformanceCounter();
+		tpool_destroy(pool);
+
+		printf("%u workers: tiny %.2fM jobs/s, fanned out %.2fM jobs/s, chunk-sized %.0f jobs/s (%d run)\n", workers,
+		       tiny / 1e6 / ((t1 - t0) / freq), tiny / 1e6 / ((t2 - t1) / freq), chunks / ((t3 - t2) / freq),
+		       SDL_AtomicGet(&bench_count));
+		SDL_AtomicSet(&bench_count, 0);
+		if (workers >= tpool_num_cores())
+			break;
 	}
+	exit(0);
 }
+#endif
@@ -0,0 +1,443 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tinycthread.h"
+#include "util.h"
+#include "world.h"
+
+#define CHUNKMAP_MIN_CAPACITY 64
+#define CHUNKMAP_GRID_WIDTH 32 /* must be a power of two */
+#define CHUNKMAP_GRID_MASK (CHUNKMAP_GRID_WIDTH - 1)
+#define CHUNKMAP_TOMBSTONE ((chunk_t *)&chunkmap_tombstone)
+#define SLOT_GET(P) ((chunk_t *)SDL_AtomicGetPtr((void **)&(P)))
+#define SLOT_SET(P, V) SDL_AtomicSetPtr((void **)&(P), (V))
+
+/* A removed slot must not terminate a probe sequence, so it is marked with a sentinel that
+ * lookups skip over. */
+static int chunkmap_tombstone[2];
+
+/* Readers never take a lock. They may hold pointers into a table or a chunk after a writer has
+ * unlinked it, so unlinked memory is retired and only released once every read section that
+ * could have seen it has ended. */
+typedef struct chunkmap_retired_s {
+	void *ptr;
+	void (*release)(void *);
+	struct chunkmap_retired_s *next;
+} chunkmap_retired_t;
+
+typedef struct chunkmap_table_s {
+	size_t capacity;
+	chunk_t *slots[];
+} chunkmap_table_t;
+
+struct chunkmap_s {
+	chunkmap_table_t *table;
+	SDL_atomic_t count;
+	size_t used; /* live entries + tombstones, only touched by writers */
+	mtx_t write_mutex;
+	void (*release)(chunk_t *);
+
+	/* The toroidal grid is a direct-mapped cache of the chunks around the player. Any chunk within
+	 * half the grid width of the center maps to its own slot, so lookups of nearby chunks never
+	 * touch the hash table. Entries are validated against the chunk's own location, and only
+	 * writers fill the grid, so a removed chunk can never be cached again. */
+	chunk_t *grid[CHUNKMAP_GRID_WIDTH * CHUNKMAP_GRID_WIDTH];
+	int center[2];
+
+	/* Two-phase epochs: readers announce themselves in the counter for the current epoch's parity.
+	 * Memory retired before an epoch flip is released once the other parity has drained. */
+	SDL_atomic_t epoch, active[2];
+	chunkmap_retired_t *retired, *pending;
+};
+
+static inline uint64_t chunkmap_hash(int x, int y)
+{
+	/* The finalizer from MurmurHash3, which spreads the packed coordinates over all 64 bits. */
+	uint64_t h = (uint64_t)pack32(x, y);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline bool chunkmap_in_window(chunkmap_t *map, int x, int y)
+{
+	return abs(x - map->center[0]) < CHUNKMAP_GRID_WIDTH / 2 && abs(y - map->center[1]) < CHUNKMAP_GRID_WIDTH / 2;
+}
+
+static inline chunk_t **chunkmap_grid_slot(chunkmap_t *map, int x, int y)
+{
+	return &map->grid[(x & CHUNKMAP_GRID_MASK) + (y & CHUNKMAP_GRID_MASK) * CHUNKMAP_GRID_WIDTH];
+}
+
+static chunkmap_table_t *chunkmap_table_create(size_t capacity)
+{
+	chunkmap_table_t *t = calloc(1, sizeof(chunkmap_table_t) + capacity * sizeof(chunk_t *));
+	assert(t);
+	t->capacity = capacity;
+	return t;
+}
+
+static void chunkmap_retire(chunkmap_t *map, void *ptr, void (*release)(void *))
+{
+	chunkmap_retired_t *r = malloc(sizeof(chunkmap_retired_t));
+	assert(r);
+	r->ptr = ptr;
+	r->release = release;
+	r->next = map->retired;
+	map->retired = r;
+}
+
+static void chunkmap_release_list(chunkmap_retired_t *r)
+{
+	while (r) {
+		chunkmap_retired_t *next = r->next;
+		r->release(r->ptr);
+		free(r);
+		r = next;
+	}
+}
+
+/* precondition: write_mutex is held */
+static chunk_t *chunkmap_find(chunkmap_table_t *t, int x, int y, size_t *index)
+{
+	size_t mask = t->capacity - 1;
+	for (size_t i = chunkmap_hash(x, y) & mask;; i = (i + 1) & mask) {
+		chunk_t *c = SLOT_GET(t->slots[i]);
+		if (c == NULL)
+			return NULL;
+		if (c != CHUNKMAP_TOMBSTONE && c->loc[0] == x && c->loc[1] == y) {
+			if (index)
+				*index = i;
+			return c;
+		}
+	}
+}
+
+/* precondition: write_mutex is held */
+static void chunkmap_rehash(chunkmap_t *map, size_t new_capacity)
+{
+	chunkmap_table_t *old = map->table, *t = chunkmap_table_create(new_capacity);
+	for (size_t i = 0; i < old->capacity; i++) {
+		chunk_t *c = old->slots[i];
+		if (c == NULL || c == CHUNKMAP_TOMBSTONE)
+			continue;
+
+		size_t j = chunkmap_hash(c->loc[0], c->loc[1]) & (new_capacity - 1);
+		while (t->slots[j] != NULL)
+			j = (j + 1) & (new_capacity - 1);
+		t->slots[j] = c;
+	}
+
+	/* Readers still probing the old table see a consistent, if slightly stale, snapshot. */
+	map->used = SDL_AtomicGet(&map->count);
+	SDL_AtomicSetPtr((void **)&map->table, t);
+	chunkmap_retire(map, old, free);
+}
+
+chunkmap_t *chunkmap_create(size_t initial_capacity, void (*release)(chunk_t *))
+{
+	chunkmap_t *map = calloc(1, sizeof(chunkmap_t));
+	assert(map);
+	size_t capacity = CHUNKMAP_MIN_CAPACITY;
+	while (capacity < initial_capacity * 2)
+		capacity <<= 1;
+	map->table = chunkmap_table_create(capacity);
+	map->release = release;
+	mtx_init(&map->write_mutex, mtx_plain);
+	return map;
+}
+
+/* precondition: no other thread is using the map */
+void chunkmap_destroy(chunkmap_t *map)
+{
+	if (map == NULL)
+		return;
+	chunkmap_clear(map);
+	chunkmap_release_list(map->pending);
+	chunkmap_release_list(map->retired);
+	mtx_destroy(&map->write_mutex);
+	free(map->table);
+	free(map);
+}
+
+/* precondition: no other thread is using the map */
+void chunkmap_clear(chunkmap_t *map)
+{
+	chunkmap_table_t *t = map->table;
+	for (size_t i = 0; i < t->capacity; i++) {
+		chunk_t *c = t->slots[i];
+		if (c != NULL && c != CHUNKMAP_TOMBSTONE && map->release)
+			map->release(c);
+		t->slots[i] = NULL;
+	}
+	memset(map->grid, 0, sizeof(map->grid));
+	SDL_AtomicSet(&map->count, 0);
+	map->used = 0;
+}
+
+size_t chunkmap_count(chunkmap_t *map)
+{
+	return SDL_AtomicGet(&map->count);
+}
+
+void chunkmap_recenter(chunkmap_t *map, int x, int y)
+{
+	mtx_lock(&map->write_mutex);
+	if (map->center[0] != x || map->center[1] != y) {
+		map->center[0] = x;
+		map->center[1] = y;
+		for (int gx = x - CHUNKMAP_GRID_WIDTH / 2 + 1; gx < x + CHUNKMAP_GRID_WIDTH / 2; gx++) {
+			for (int gy = y - CHUNKMAP_GRID_WIDTH / 2 + 1; gy < y + CHUNKMAP_GRID_WIDTH / 2; gy++)
+				SLOT_SET(*chunkmap_grid_slot(map, gx, gy), chunkmap_find(map->table, gx, gy, NULL));
+		}
+	}
+	mtx_unlock(&map->write_mutex);
+}
+
+bool chunkmap_insert(chunkmap_t *map, chunk_t *chunk)
+{
+	mtx_lock(&map->write_mutex);
+
+	/* Keep the table at most half full, counting tombstones, so probe sequences stay short. */
+	chunkmap_table_t *t = map->table;
+	size_t count = SDL_AtomicGet(&map->count);
+	if ((map->used + 1) * 2 > t->capacity) {
+		chunkmap_rehash(map, count * 4 >= t->capacity ? t->capacity * 2 : t->capacity);
+		t = map->table;
+	}
+
+	size_t mask = t->capacity - 1, i = chunkmap_hash(chunk->loc[0], chunk->loc[1]) & mask, insert_at = SIZE_MAX;
+	for (chunk_t *c; (c = t->slots[i]) != NULL; i = (i + 1) & mask) {
+		if (c == CHUNKMAP_TOMBSTONE) {
+			if (insert_at == SIZE_MAX)
+				insert_at = i;
+		} else if (c->loc[0] == chunk->loc[0] && c->loc[1] == chunk->loc[1]) {
+			mtx_unlock(&map->write_mutex);
+			return false;
+		}
+	}
+
+	if (insert_at == SIZE_MAX) {
+		insert_at = i;
+		map->used++;
+	}
+	/* The slot store publishes the chunk; everything written to it beforehand is visible to any
+	 * reader that finds it. */
+	SLOT_SET(t->slots[insert_at], chunk);
+	SDL_AtomicAdd(&map->count, 1);
+
+	if (chunkmap_in_window(map, chunk->loc[0], chunk->loc[1]))
+		SLOT_SET(*chunkmap_grid_slot(map, chunk->loc[0], chunk->loc[1]), chunk);
+	mtx_unlock(&map->write_mutex);
+	return true;
+}
+
+chunk_t *chunkmap_get(chunkmap_t *map, int x, int y)
+{
+	chunk_t *c = SLOT_GET(*chunkmap_grid_slot(map, x, y));
+	if (c != NULL && c->loc[0] == x && c->loc[1] == y)
+		return c;
+
+	chunkmap_table_t *t = SDL_AtomicGetPtr((void **)&map->table);
+	size_t mask = t->capacity - 1;
+	for (size_t i = chunkmap_hash(x, y) & mask; (c = SLOT_GET(t->slots[i])) != NULL; i = (i + 1) & mask) {
+		if (c != CHUNKMAP_TOMBSTONE && c->loc[0] == x && c->loc[1] == y)
+			return c;
+	}
+	return NULL;
+}
+
+bool chunkmap_remove(chunkmap_t *map, int x, int y)
+{
+	size_t i;
+	mtx_lock(&map->write_mutex);
+	chunk_t *c = chunkmap_find(map->table, x, y, &i);
+	if (c != NULL) {
+		SLOT_SET(map->table->slots[i], CHUNKMAP_TOMBSTONE);
+		SDL_AtomicAdd(&map->count, -1);
+		SDL_AtomicCASPtr((void **)chunkmap_grid_slot(map, x, y), c, NULL);
+		if (map->release)
+			chunkmap_retire(map, c, (void (*)(void *))map->release);
+	}
+	mtx_unlock(&map->write_mutex);
+	return c != NULL;
+}
+
+/* Iteration sees every chunk that was present for the whole walk, and may or may not see chunks
+ * inserted or removed meanwhile. The caller must be in a read section if other threads remove. */
+chunk_t *chunkmap_next(chunkmap_t *map, size_t *iter)
+{
+	chunkmap_table_t *t = SDL_AtomicGetPtr((void **)&map->table);
+	while (*iter < t->capacity) {
+		chunk_t *c = SLOT_GET(t->slots[(*iter)++]);
+		if (c != NULL && c != CHUNKMAP_TOMBSTONE)
+			return c;
+	}
+	return NULL;
+}
+
+int chunkmap_read_begin(chunkmap_t *map)
+{
+	while (true) {
+		int epoch = SDL_AtomicGet(&map->epoch);
+		SDL_AtomicAdd(&map->active[epoch & 1], 1);
+		/* If a writer flipped the epoch between the two operations, it may already have decided
+		 * that this parity is drained. Back out and join the new epoch instead. */
+		if (SDL_AtomicGet(&map->epoch) == epoch)
+			return epoch & 1;
+		SDL_AtomicAdd(&map->active[epoch & 1], -1);
+	}
+}
+
+void chunkmap_read_end(chunkmap_t *map, int token)
+{
+	SDL_AtomicAdd(&map->active[token], -1);
+}
+
+void chunkmap_reclaim(chunkmap_t *map)
+{
+	chunkmap_retired_t *done = NULL;
+	mtx_lock(&map->write_mutex);
+	int epoch = SDL_AtomicGet(&map->epoch);
+	if (map->pending && SDL_AtomicGet(&map->active[(epoch + 1) & 1]) == 0) {
+		done = map->pending;
+		map->pending = NULL;
+	}
+	if (map->pending == NULL && map->retired) {
+		map->pending = map->retired;
+		map->retired = NULL;
+		SDL_AtomicAdd(&map->epoch, 1);
+	}
+	mtx_unlock(&map->write_mutex);
+	chunkmap_release_list(done);
+}
+
+#if 0
+#include <stdio.h>
+/* Compares lookups against the rbtree that used to index chunks. The keys only carry a location,
+ * which is all either structure ever reads from a chunk. */
+static int bench_rbtree_cmp(const void *const a, const void *const b, void *extradata)
+{
+	const int *const c1 = a, *const c2 = b;
+	if (c1[0] == c2[0])
+		return c2[1] - c1[1];
+	return c2[0] - c1[0];
+}
+
+void chunkmap_bench()
+{
+	const int sizes[] = { 1000, 10000, 100000 }, lookups = 10000000;
+	for (int s = 0; s < 3; s++) {
+		int side = (int)ceil(sqrt(sizes[s])), (*keys)[2] = malloc(sizes[s] * sizeof(int[2]));
+		rbtree_t *tree = rbtree_create(bench_rbtree_cmp, NULL, NULL);
+		chunkmap_t *map = chunkmap_create(0, NULL);
+		for (int i = 0; i < sizes[s]; i++) {
+			keys[i][0] = i % side - side / 2;
+			keys[i][1] = i / side - side / 2;
+			rbtree_insert(tree, keys[i], keys[i]);
+			chunkmap_insert(map, (chunk_t *)keys[i]);
+		}
+
+		/* A random access pattern over all resident chunks, then a meshing-like pattern that
+		 * stays within a few chunks of the player. */
+		for (int pattern = 0; pattern < 2; pattern++) {
+			Uint64 t0, t1, t2, found = 0;
+			srand(1);
+			t0 = SDL_GetPerformanceCounter();
+			for (int i = 0; i < lookups; i++) {
+				int *k = keys[pattern == 0 ? rand() % sizes[s] : 0], q[2] = { k[0], k[1] };
+				if (pattern)
+					q[0] += i % 5 - 2, q[1] += (i / 5) % 5 - 2;
+				found += rbtree_get(tree, q) != NULL;
+			}
+			srand(1);
+			t1 = SDL_GetPerformanceCounter();
+			for (int i = 0; i < lookups; i++) {
+				int *k = keys[pattern == 0 ? rand() % sizes[s] : 0], q[2] = { k[0], k[1] };
+				if (pattern)
+					q[0] += i % 5 - 2, q[1] += (i / 5) % 5 - 2;
+				found += chunkmap_get(map, q[0], q[1]) != NULL;
+			}
+			t2 = SDL_GetPerformanceCounter();
+			printf("%6d chunks, %s: rbtree %.1f ns/lookup, chunkmap %.1f ns/lookup (%lu found)\n", sizes[s],
+			       pattern ? "local " : "random", 1e9 * (t1 - t0) / SDL_GetPerformanceFrequency() / lookups,
+			       1e9 * (t2 - t1) / SDL_GetPerformanceFrequency() / lookups, (unsigned long)found);
+		}
+
+		rbtree_destroy(tree);
+		chunkmap_destroy(map);
+		free(keys);
+	}
+	exit(0);
+}
+
+/* Hammers one map from many threads. Every thread owns a stripe of keys it inserts and removes,
+ * and looks up keys from every stripe; a lookup must return either nothing or a live chunk with
+ * the location that was asked for. Run under a sanitizer to catch early reclamation. */
+#define STRESS_THREADS 8
+#define STRESS_KEYS 4096
+#define STRESS_ROUNDS 200000
+typedef struct stress_key_s {
+	int loc[2];
+	int alive;
+} stress_key_t;
+
+static chunkmap_t *stress_map;
+static SDL_atomic_t stress_failures;
+
+static void stress_release(chunk_t *chunk)
+{
+	((stress_key_t *)chunk)->alive = 0;
+	free(chunk);
+}
+
+static int stress_worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	unsigned seed = id * 7919 + 1;
+	for (int round = 0; round < STRESS_ROUNDS; round++) {
+		seed = seed * 1103515245 + 12345;
+		int k = (seed >> 8) % STRESS_KEYS, x = k % 64, y = k / 64;
+		if (k % STRESS_THREADS == id && (seed & 3) == 0) {
+			stress_key_t *key = malloc(sizeof(stress_key_t));
+			key->loc[0] = x;
+			key->loc[1] = y;
+			key->alive = 1;
+			if (!chunkmap_insert(stress_map, (chunk_t *)key))
+				free(key);
+		} else if (k % STRESS_THREADS == id && (seed & 3) == 1) {
+			chunkmap_remove(stress_map, x, y);
+		} else {
+			int token = chunkmap_read_begin(stress_map);
+			stress_key_t *key = (stress_key_t *)chunkmap_get(stress_map, x, y);
+			if (key && (key->loc[0] != x || key->loc[1] != y || !key->alive))
+				SDL_AtomicAdd(&stress_failures, 1);
+			chunkmap_read_end(stress_map, token);
+		}
+		if ((round & 255) == 0) {
+			chunkmap_reclaim(stress_map);
+			chunkmap_recenter(stress_map, seed % 64, (seed >> 6) % 64);
+		}
+	}
+	return 0;
+}
+
+void chunkmap_stress()
+{
+	thrd_t threads[STRESS_THREADS];
+	stress_map = chunkmap_create(0, stress_release);
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < STRESS_THREADS; i++)
+		thrd_create(&threads[i], stress_worker, (void *)(intptr_t)i);
+	for (int i = 0; i < STRESS_THREADS; i++)
+		thrd_join(threads[i], NULL);
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	printf("%d threads x %d operations in %.1f ms, %d chunks resident, %d failures\n", STRESS_THREADS, STRESS_ROUNDS,
+	       1e3 * (t1 - t0) / SDL_GetPerformanceFrequency(), (int)chunkmap_count(stress_map), SDL_AtomicGet(&stress_failures));
+	chunkmap_destroy(stress_map);
+	exit(SDL_AtomicGet(&stress_failures) != 0);
+}
+#endif
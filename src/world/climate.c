@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "tinycthread.h"
+#include "util.h"
+#include "world.h"
+
+/* Climate is made of fields that change over hundreds of blocks, so it is sampled every
+ * CLIMATE_STEP blocks and interpolated between. The samples are computed a region at a time, into
+ * a tile that the chunks of that region and of the edges of the next ones share, and tiles are
+ * kept in a small cache. The cache is split into sets by a hash of the region, each with a few
+ * ways under its own lock. A lookup holds its set's lock only to find a tile and copy out the
+ * samples it needs, so workers generating different regions never wait on each other and workers
+ * in the same one only briefly. A miss computes the tile with no lock held and then replaces the
+ * least recently used way of the set; if another worker got there first, its tile is used and the
+ * new one thrown away. */
+#define CLIMATE_STEP 16 /* blocks between samples; must divide the width of a region */
+#define CLIMATE_TILE_STEPS (REGION_WIDTH * CHUNK_WIDTH / CLIMATE_STEP)
+#define CLIMATE_WINDOW ((CHUNK_WIDTH + CLIMATE_STEP - 2) / CLIMATE_STEP + 2) /* most samples a chunk spans, each way */
+#define CLIMATE_TILE_SAMPLES (CLIMATE_TILE_STEPS + 1) /* per side, including the next tile's first */
+#define CLIMATE_SETS 8 /* must be a power of two */
+#define CLIMATE_WAYS 4
+
+#define TEMPERATURE_PERIOD 64 /* in steps */
+#define HUMIDITY_PERIOD 48
+#define CONTINENT_PERIOD 128
+#define CLIMATE_OCTAVES 3
+#define TEMPERATURE_SEED 0x7e3b1a2cu
+#define HUMIDITY_SEED 0x4d1f6e95u
+#define CONTINENT_SEED 0xc0a57a11u
+
+typedef struct climate_tile_s {
+	int loc[2];
+	uint64_t seed;
+	unsigned last_used;
+	climate_t samples[CLIMATE_TILE_SAMPLES * CLIMATE_TILE_SAMPLES];
+} climate_tile_t;
+
+typedef struct climate_set_s {
+	mtx_t mutex;
+	unsigned clock;
+	climate_tile_t *ways[CLIMATE_WAYS];
+} climate_set_t;
+
+static climate_set_t sets[CLIMATE_SETS];
+static SDL_atomic_t hits, misses, evictions;
+
+static inline int floor_div(int v, int d)
+{
+	return (v >= 0 ? v : v - d + 1) / d;
+}
+
+/* Interpolates between four samples at (wx, wy) blocks into their cell. */
+static inline int32_t climate_lerp(int32_t v00, int32_t v10, int32_t v01, int32_t v11, int wx, int wy)
+{
+	int32_t top = v00 * (CLIMATE_STEP - wx) + v10 * wx, bottom = v01 * (CLIMATE_STEP - wx) + v11 * wx;
+	return (top * (CLIMATE_STEP - wy) + bottom * wy) / (CLIMATE_STEP * CLIMATE_STEP);
+}
+
+static inline climate_set_t *climate_set(int rx, int ry)
+{
+	return &sets[(uint64_t)pack32(rx, ry) * 0x9e3779b97f4a7c15 >> 32 & (CLIMATE_SETS - 1)];
+}
+
+static climate_tile_t *climate_tile_create(uint64_t seed, int rx, int ry)
+{
+	climate_tile_t *tile = malloc(sizeof(climate_tile_t));
+	assert(tile);
+	tile->loc[0] = rx;
+	tile->loc[1] = ry;
+	tile->seed = seed;
+	int32_t field[CLIMATE_TILE_SAMPLES * CLIMATE_TILE_SAMPLES];
+	int x0 = rx * CLIMATE_TILE_STEPS, y0 = ry * CLIMATE_TILE_STEPS;
+
+	noise2_grid(seed ^ TEMPERATURE_SEED, x0, y0, CLIMATE_TILE_SAMPLES, CLIMATE_TILE_SAMPLES, TEMPERATURE_PERIOD, CLIMATE_OCTAVES, field);
+	for (int i = 0; i < CLIMATE_TILE_SAMPLES * CLIMATE_TILE_SAMPLES; i++)
+		tile->samples[i].temperature = field[i];
+	noise2_grid(seed ^ HUMIDITY_SEED, x0, y0, CLIMATE_TILE_SAMPLES, CLIMATE_TILE_SAMPLES, HUMIDITY_PERIOD, CLIMATE_OCTAVES, field);
+	for (int i = 0; i < CLIMATE_TILE_SAMPLES * CLIMATE_TILE_SAMPLES; i++)
+		tile->samples[i].humidity = field[i];
+	noise2_grid(seed ^ CONTINENT_SEED, x0, y0, CLIMATE_TILE_SAMPLES, CLIMATE_TILE_SAMPLES, CONTINENT_PERIOD, CLIMATE_OCTAVES, field);
+	for (int i = 0; i < CLIMATE_TILE_SAMPLES * CLIMATE_TILE_SAMPLES; i++)
+		tile->samples[i].continentalness = field[i];
+	return tile;
+}
+
+/* Looks up the tile in its set and copies out a w x h window of samples from (sx, sy), returning
+ * false if it isn't cached. Called with the set's lock held. */
+static bool climate_set_copy(climate_set_t *set, uint64_t seed, int rx, int ry, int sx, int sy, int w, int h, climate_t *out)
+{
+	for (int i = 0; i < CLIMATE_WAYS; i++) {
+		climate_tile_t *tile = set->ways[i];
+		if (tile && tile->loc[0] == rx && tile->loc[1] == ry && tile->seed == seed) {
+			tile->last_used = ++set->clock;
+			for (int y = 0; y < h; y++) {
+				for (int x = 0; x < w; x++)
+					out[x + y * w] = tile->samples[sx + x + (sy + y) * CLIMATE_TILE_SAMPLES];
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Puts a tile in the set's least recently used way. Called with the set's lock held. */
+static void climate_set_insert(climate_set_t *set, climate_tile_t *tile)
+{
+	int lru = 0;
+	for (int i = 0; i < CLIMATE_WAYS; i++) {
+		if (set->ways[i] == NULL) {
+			lru = i;
+			break;
+		}
+		if (set->ways[i]->last_used < set->ways[lru]->last_used)
+			lru = i;
+	}
+	if (set->ways[lru]) {
+		SDL_AtomicAdd(&evictions, 1);
+		free(set->ways[lru]);
+	}
+	tile->last_used = ++set->clock;
+	set->ways[lru] = tile;
+}
+
+/* Fills out, w by h ordered x first, with the climate of the columns from (x0, y0), which must all
+ * be in the same region and span no more than a chunk. Each field is roughly within +-NOISE_ONE.
+ * Safe to call from any thread. */
+void climate_grid(uint64_t seed, int x0, int y0, int w, int h, climate_t *out)
+{
+	int rx = floor_div(x0, REGION_WIDTH * CHUNK_WIDTH), ry = floor_div(y0, REGION_WIDTH * CHUNK_WIDTH);
+	assert(floor_div(x0 + w - 1, REGION_WIDTH * CHUNK_WIDTH) == rx && floor_div(y0 + h - 1, REGION_WIDTH * CHUNK_WIDTH) == ry);
+	int ox = x0 - rx * REGION_WIDTH * CHUNK_WIDTH, oy = y0 - ry * REGION_WIDTH * CHUNK_WIDTH;
+	int sx = ox / CLIMATE_STEP, sy = oy / CLIMATE_STEP;
+	int sw = (ox + w - 1) / CLIMATE_STEP - sx + 2, sh = (oy + h - 1) / CLIMATE_STEP - sy + 2;
+	climate_t window[CLIMATE_WINDOW * CLIMATE_WINDOW];
+	assert(sw <= CLIMATE_WINDOW && sh <= CLIMATE_WINDOW);
+
+	climate_set_t *set = climate_set(rx, ry);
+	mtx_lock(&set->mutex);
+	bool hit = climate_set_copy(set, seed, rx, ry, sx, sy, sw, sh, window);
+	mtx_unlock(&set->mutex);
+	SDL_AtomicAdd(hit ? &hits : &misses, 1);
+	if (!hit) {
+		climate_tile_t *tile = climate_tile_create(seed, rx, ry);
+		mtx_lock(&set->mutex);
+		if (climate_set_copy(set, seed, rx, ry, sx, sy, sw, sh, window))
+			free(tile);
+		else {
+			climate_set_insert(set, tile);
+			climate_set_copy(set, seed, rx, ry, sx, sy, sw, sh, window);
+		}
+		mtx_unlock(&set->mutex);
+	}
+
+	/* Bilinear, with weights in blocks. */
+	for (int y = 0; y < h; y++) {
+		int wy = oy + y - sy * CLIMATE_STEP, j = wy / CLIMATE_STEP;
+		wy %= CLIMATE_STEP;
+		for (int x = 0; x < w; x++) {
+			int wx = ox + x - sx * CLIMATE_STEP, i = wx / CLIMATE_STEP;
+			wx %= CLIMATE_STEP;
+			climate_t *c = &window[i + j * sw], *o = &out[x + y * w];
+			o->temperature = climate_lerp(c[0].temperature, c[1].temperature, c[sw].temperature, c[sw + 1].temperature, wx, wy);
+			o->humidity = climate_lerp(c[0].humidity, c[1].humidity, c[sw].humidity, c[sw + 1].humidity, wx, wy);
+			o->continentalness = climate_lerp(c[0].continentalness, c[1].continentalness, c[sw].continentalness,
+							  c[sw + 1].continentalness, wx, wy);
+		}
+	}
+}
+
+void climate_init(void)
+{
+	for (int s = 0; s < CLIMATE_SETS; s++)
+		mtx_init(&sets[s].mutex, mtx_plain);
+}
+
+/* Frees every cached tile. No generation may be running. */
+void climate_clear(void)
+{
+	for (int s = 0; s < CLIMATE_SETS; s++) {
+		for (int i = 0; i < CLIMATE_WAYS; i++) {
+			free(sets[s].ways[i]);
+			sets[s].ways[i] = NULL;
+		}
+	}
+}
+
+void world_climate_stats(world_climate_stats_t *stats)
+{
+	stats->hits = SDL_AtomicGet(&hits);
+	stats->misses = SDL_AtomicGet(&misses);
+	stats->evictions = SDL_AtomicGet(&evictions);
+	stats->capacity = CLIMATE_SETS * CLIMATE_WAYS;
+}
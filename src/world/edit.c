@@ -0,0 +1,489 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tinycthread.h"
+#include "util.h"
+#include "world.h"
+
+/* Bulk edits split their box by chunk and edit each chunk's part as a job. The main thread takes
+ * jobs along with the workers and waits for the last one, so no chunk is meshed, saved or
+ * evicted while it is being edited, and each chunk is only ever edited by one thread. Each job
+ * notes the boxes it wrote; afterwards the main thread journals them and marks every chunk that
+ * changed, and every neighbor sharing a changed border, dirty once. */
+#define EDIT_UNKNOWN 0xffff /* block id of cloned cells whose chunk isn't loaded */
+#define EDIT_HELPERS_MAX 32  /* workers joining the main thread on one batch */
+
+enum { EDIT_FILL, EDIT_REPLACE, EDIT_CLONE_READ, EDIT_CLONE_WRITE };
+enum { BORDER_WEST = 1, BORDER_EAST = 2, BORDER_SOUTH = 4, BORDER_NORTH = 8 };
+
+typedef struct edit_fill_s {
+	int min[3], max[3];
+	block_instance_t inst;
+} edit_fill_t;
+
+typedef struct edit_job_s {
+	chunk_t *chunk; /* NULL for a clone source that isn't loaded */
+	int loc[2];
+	int min[3], max[3]; /* chunk-local, inclusive */
+	int written, borders;
+	edit_fill_t *fills; /* what was written, to be journaled */
+	int num_fills, max_fills;
+} edit_job_t;
+
+/* Shared by the main thread and the workers helping it, and freed by whichever is last. */
+typedef struct edit_batch_s {
+	int op;
+	block_instance_t inst, from;
+	block_instance_t *buffer; /* the cloned blocks, ordered x, y, z */
+	int origin[3], size[3];   /* world coordinates of buffer[0] and the buffer's extent */
+	int offset[3];            /* from the clone source to its destination */
+	edit_job_t *jobs;
+	int num_jobs;
+	SDL_atomic_t next, done, refs;
+	mtx_t mutex;
+	cnd_t finished;
+} edit_batch_t;
+
+/* Notes a box the job wrote. Rows and layers written one after another with the same block are
+ * merged into one box, to keep the journal short. */
+static void edit_job_add(edit_job_t *job, const int min[3], const int max[3], block_instance_t inst)
+{
+	job->written += (max[0] - min[0] + 1) * (max[1] - min[1] + 1) * (max[2] - min[2] + 1);
+	job->borders |= (min[0] == 0 ? BORDER_WEST : 0) | (max[0] == CHUNK_WIDTH - 1 ? BORDER_EAST : 0) |
+			(min[1] == 0 ? BORDER_SOUTH : 0) | (max[1] == CHUNK_WIDTH - 1 ? BORDER_NORTH : 0);
+	if (job->num_fills > 0) {
+		edit_fill_t *last = &job->fills[job->num_fills - 1];
+		bool same_x = last->min[0] == min[0] && last->max[0] == max[0];
+		bool same_y = last->min[1] == min[1] && last->max[1] == max[1];
+		bool same_z = last->min[2] == min[2] && last->max[2] == max[2];
+		if (block_instance_equal(last->inst, inst) && same_x) {
+			if (same_z && last->max[1] + 1 == min[1]) {
+				last->max[1] = max[1];
+				return;
+			}
+			if (same_y && last->max[2] + 1 == min[2]) {
+				last->max[2] = max[2];
+				return;
+			}
+		}
+	}
+
+	if (job->num_fills == job->max_fills) {
+		job->max_fills = job->max_fills ? job->max_fills * 2 : 16;
+		job->fills = realloc(job->fills, job->max_fills * sizeof(edit_fill_t));
+		assert(job->fills);
+	}
+	edit_fill_t *fill = &job->fills[job->num_fills++];
+	memcpy(fill->min, min, sizeof(fill->min));
+	memcpy(fill->max, max, sizeof(fill->max));
+	fill->inst = inst;
+}
+
+static inline int edit_buffer_index(const edit_batch_t *batch, int x, int y, int z)
+{
+	return (x - batch->origin[0]) + ((y - batch->origin[1]) + (z - batch->origin[2]) * batch->size[1]) * batch->size[0];
+}
+
+/* Replaces block by block, except in sections that hold nothing else. */
+static void edit_replace(edit_batch_t *batch, edit_job_t *job)
+{
+	for (int s = job->min[2] / CHUNK_SECTION_HEIGHT; s <= job->max[2] / CHUNK_SECTION_HEIGHT; s++) {
+		palette_t *p = &job->chunk->sections[s];
+		int min[3] = { job->min[0], job->min[1], MAX(job->min[2], s * CHUNK_SECTION_HEIGHT) };
+		int max[3] = { job->max[0], job->max[1], MIN(job->max[2], (s + 1) * CHUNK_SECTION_HEIGHT - 1) };
+		if (p->bits == 0) {
+			if (block_instance_equal(palette_get(p, 0), batch->from)) {
+				chunk_fill_box(job->chunk, min, max, batch->inst);
+				edit_job_add(job, min, max, batch->inst);
+			}
+			continue;
+		}
+
+		uint32_t pi = 0;
+		while (pi < p->num_entries && !block_instance_equal(p->entries[pi], batch->from))
+			pi++;
+		if (pi == p->num_entries)
+			continue;
+		for (int z = min[2]; z <= max[2]; z++) {
+			for (int y = min[1]; y <= max[1]; y++) {
+				int row = CHUNK_BLOCK_INDEX(0, y, z) - s * CHUNK_SECTION_BLOCKS;
+				for (int x = min[0]; x <= max[0]; x++) {
+					if (palette_index(p, row + x) != pi)
+						continue;
+					int start = x;
+					while (x < max[0] && palette_index(p, row + x + 1) == pi)
+						x++;
+					palette_fill(p, row + start, x - start + 1, batch->inst);
+					edit_job_add(job, (int[3]){ start, y, z }, (int[3]){ x, y, z }, batch->inst);
+				}
+			}
+		}
+	}
+}
+
+static void edit_clone_read(edit_batch_t *batch, edit_job_t *job)
+{
+	for (int z = job->min[2]; z <= job->max[2]; z++) {
+		for (int y = job->min[1]; y <= job->max[1]; y++) {
+			block_instance_t *out = &batch->buffer[edit_buffer_index(batch, job->loc[0] * CHUNK_WIDTH + job->min[0],
+										   job->loc[1] * CHUNK_WIDTH + y, z)];
+			if (job->chunk == NULL) {
+				for (int x = job->min[0]; x <= job->max[0]; x++)
+					*out++ = (block_instance_t){ .id = EDIT_UNKNOWN };
+				continue;
+			}
+			const palette_t *p = &job->chunk->sections[z / CHUNK_SECTION_HEIGHT];
+			int i = CHUNK_BLOCK_INDEX(job->min[0], y, z) % CHUNK_SECTION_BLOCKS;
+			for (int x = job->min[0]; x <= job->max[0]; x++)
+				*out++ = palette_get(p, i++);
+		}
+	}
+}
+
+/* Writes the cloned blocks in runs of the same block. */
+static void edit_clone_write(edit_batch_t *batch, edit_job_t *job)
+{
+	for (int z = job->min[2]; z <= job->max[2]; z++) {
+		for (int y = job->min[1]; y <= job->max[1]; y++) {
+			const block_instance_t *in = &batch->buffer[edit_buffer_index(
+				batch, job->loc[0] * CHUNK_WIDTH + job->min[0] - batch->offset[0],
+				job->loc[1] * CHUNK_WIDTH + y - batch->offset[1], z - batch->offset[2])];
+			palette_t *p = &job->chunk->sections[z / CHUNK_SECTION_HEIGHT];
+			int row = CHUNK_BLOCK_INDEX(0, y, z) % CHUNK_SECTION_BLOCKS;
+			for (int x = job->min[0]; x <= job->max[0]; x++, in++) {
+				if (in->id == EDIT_UNKNOWN)
+					continue;
+				int start = x;
+				while (x < job->max[0] && block_instance_equal(in[1], in[0]))
+					x++, in++;
+				palette_fill(p, row + start, x - start + 1, *in);
+				edit_job_add(job, (int[3]){ start, y, z }, (int[3]){ x, y, z }, *in);
+			}
+		}
+	}
+}
+
+static void edit_job_run(edit_batch_t *batch, edit_job_t *job)
+{
+	switch (batch->op) {
+	case EDIT_FILL:
+		chunk_fill_box(job->chunk, job->min, job->max, batch->inst);
+		edit_job_add(job, job->min, job->max, batch->inst);
+		break;
+	case EDIT_REPLACE:
+		edit_replace(batch, job);
+		break;
+	case EDIT_CLONE_READ:
+		edit_clone_read(batch, job);
+		break;
+	case EDIT_CLONE_WRITE:
+		edit_clone_write(batch, job);
+		break;
+	}
+	if (job->num_fills > 0)
+		chunk_update_heightmap(job->chunk);
+}
+
+static void edit_batch_release(edit_batch_t *batch)
+{
+	if (SDL_AtomicAdd(&batch->refs, -1) == 1) {
+		mtx_destroy(&batch->mutex);
+		cnd_destroy(&batch->finished);
+		free(batch);
+	}
+}
+
+/* Takes jobs until there are none left. */
+static void edit_batch_work(edit_batch_t *batch)
+{
+	int j;
+	while ((j = SDL_AtomicAdd(&batch->next, 1)) < batch->num_jobs) {
+		edit_job_run(batch, &batch->jobs[j]);
+		if (SDL_AtomicAdd(&batch->done, 1) + 1 == batch->num_jobs) {
+			mtx_lock(&batch->mutex);
+			cnd_signal(&batch->finished);
+			mtx_unlock(&batch->mutex);
+		}
+	}
+}
+
+static tpool_ret_t edit_worker(void *_batch)
+{
+	edit_batch_t *batch = _batch;
+	edit_batch_work(batch);
+	edit_batch_release(batch);
+	return TPOOL_SUCCESS;
+}
+
+static edit_batch_t *edit_batch_create(int op, edit_job_t *jobs, int num_jobs)
+{
+	edit_batch_t *batch = calloc(1, sizeof(edit_batch_t));
+	assert(batch);
+	batch->op = op;
+	batch->jobs = jobs;
+	batch->num_jobs = num_jobs;
+	mtx_init(&batch->mutex, mtx_plain);
+	cnd_init(&batch->finished);
+	return batch;
+}
+
+/* Starts or ends writing to the chunks of the batch. Reading a clone source only reads them, which
+ * mesh jobs may do at the same time. */
+static void edit_batch_gate(edit_batch_t *batch, bool writing)
+{
+	if (batch->op == EDIT_CLONE_READ)
+		return;
+	for (int j = 0; j < batch->num_jobs; j++) {
+		chunk_t *chunk = batch->jobs[j].chunk;
+		if (chunk && writing)
+			chunk_blocks_write_begin(chunk);
+		else if (chunk)
+			chunk_blocks_write_end(chunk);
+	}
+}
+
+/* Runs every job of the batch and frees it. Helpers that haven't started by the time the main
+ * thread runs out of jobs are cancelled, and one that starts anyway just drops its reference. */
+static void edit_batch_run(edit_batch_t *batch)
+{
+	int helpers = MAX(MIN(MIN(batch->num_jobs - 1, (int)tpool_num_workers(world_workerpool())), EDIT_HELPERS_MAX), 0);
+	tpool_job_t *handles[EDIT_HELPERS_MAX];
+	edit_batch_gate(batch, true);
+	SDL_AtomicSet(&batch->refs, 1 + helpers);
+	for (int i = 0; i < helpers; i++)
+		handles[i] = tpool_add_job(world_workerpool(), edit_worker, batch, false, TPOOL_INTERACTIVE);
+	edit_batch_work(batch);
+	for (int i = 0; i < helpers; i++) {
+		if (tpool_cancel(handles[i]))
+			edit_batch_release(batch);
+		tpool_job_release(handles[i]);
+	}
+
+	mtx_lock(&batch->mutex);
+	while (SDL_AtomicGet(&batch->done) < batch->num_jobs)
+		cnd_wait(&batch->finished, &batch->mutex);
+	mtx_unlock(&batch->mutex);
+	edit_batch_gate(batch, false);
+	edit_batch_release(batch);
+}
+
+/* Orders the corners of a box and clips it to the world's height, returning false if nothing is
+ * left. */
+static bool edit_normalize(const int a[3], const int b[3], int min[3], int max[3])
+{
+	for (int i = 0; i < 3; i++) {
+		min[i] = MIN(a[i], b[i]);
+		max[i] = MAX(a[i], b[i]);
+	}
+	min[2] = MAX(min[2], 0);
+	max[2] = MIN(max[2], CHUNK_HEIGHT - 1);
+	return min[2] <= max[2];
+}
+
+/* Splits a box of world coordinates into a job per chunk. Chunks that aren't loaded or generated
+ * yet are skipped, or get a job without a chunk if keep_missing is set. */
+static int edit_split(const int min[3], const int max[3], bool keep_missing, edit_job_t **jobs)
+{
+	int cmin[2], cmax[2], n = 0;
+	for (int i = 0; i < 2; i++) {
+		WORLD_CHUNK(min[i], &cmin[i], NULL);
+		WORLD_CHUNK(max[i], &cmax[i], NULL);
+	}
+	*jobs = calloc((size_t)(cmax[0] - cmin[0] + 1) * (cmax[1] - cmin[1] + 1), sizeof(edit_job_t));
+	assert(*jobs);
+
+	for (int cy = cmin[1]; cy <= cmax[1]; cy++) {
+		for (int cx = cmin[0]; cx <= cmax[0]; cx++) {
+			chunk_t *chunk = chunks_get(cx, cy);
+			if (chunk != NULL && chunk_stage(chunk) < CHUNK_STAGE_GENERATED)
+				chunk = NULL;
+			if (chunk == NULL && !keep_missing)
+				continue;
+			edit_job_t *job = &(*jobs)[n++];
+			job->chunk = chunk;
+			job->loc[0] = cx;
+			job->loc[1] = cy;
+			job->min[0] = MAX(min[0] - cx * CHUNK_WIDTH, 0);
+			job->min[1] = MAX(min[1] - cy * CHUNK_WIDTH, 0);
+			job->max[0] = MIN(max[0] - cx * CHUNK_WIDTH, CHUNK_WIDTH - 1);
+			job->max[1] = MIN(max[1] - cy * CHUNK_WIDTH, CHUNK_WIDTH - 1);
+			job->min[2] = min[2];
+			job->max[2] = max[2];
+		}
+	}
+	return n;
+}
+
+static int compare_locs(const void *a, const void *b)
+{
+	const int *l1 = a, *l2 = b;
+	if (l1[0] != l2[0])
+		return (l1[0] > l2[0]) - (l1[0] < l2[0]);
+	return (l1[1] > l2[1]) - (l1[1] < l2[1]);
+}
+
+/* Journals what the jobs wrote and marks the changed chunks and their neighbors across changed
+ * borders dirty, each once. Frees the jobs and returns the number of blocks written. */
+static int edit_finish(edit_job_t *jobs, int num_jobs)
+{
+	int written = 0, num_marks = 0;
+	int(*marks)[2] = malloc(num_jobs * 5 * sizeof(*marks));
+	assert(marks || num_jobs == 0);
+	for (int j = 0; j < num_jobs; j++) {
+		edit_job_t *job = &jobs[j];
+		if (job->num_fills == 0)
+			continue;
+		for (int f = 0; f < job->num_fills; f++) {
+			edit_fill_t *fill = &job->fills[f];
+			if (memcmp(fill->min, fill->max, sizeof(fill->min)) == 0)
+				journal_record(job->loc, CHUNK_BLOCK_INDEX(fill->min[0], fill->min[1], fill->min[2]), fill->inst);
+			else
+				journal_record_fill(job->loc, fill->min, fill->max, fill->inst);
+		}
+		free(job->fills);
+		SDL_AtomicSet(&job->chunk->modified, 1);
+		written += job->written;
+
+		int neighbors[5][3] = { { 0, 0, ~0 }, { -1, 0, BORDER_WEST }, { 1, 0, BORDER_EAST }, { 0, -1, BORDER_SOUTH }, { 0, 1, BORDER_NORTH } };
+		for (int i = 0; i < 5; i++) {
+			if (job->borders & neighbors[i][2]) {
+				marks[num_marks][0] = job->loc[0] + neighbors[i][0];
+				marks[num_marks++][1] = job->loc[1] + neighbors[i][1];
+			}
+		}
+	}
+
+	qsort(marks, num_marks, sizeof(*marks), compare_locs);
+	for (int i = 0; i < num_marks; i++) {
+		if (i == 0 || compare_locs(marks[i], marks[i - 1]) != 0)
+			chunk_mark_dirty(chunks_get(marks[i][0], marks[i][1]));
+	}
+	free(marks);
+	free(jobs);
+	return written;
+}
+
+/* Fills a box of world coordinates, corners inclusive, returning the number of blocks written.
+ * Chunks that aren't loaded are left alone, as with world_set_block(). Main thread only, as are
+ * the other bulk edits. */
+int world_fill_box(const int a[3], const int b[3], block_instance_t inst)
+{
+	int min[3], max[3];
+	if (!edit_normalize(a, b, min, max))
+		return 0;
+	edit_job_t *jobs;
+	int num_jobs = edit_split(min, max, false, &jobs);
+	edit_batch_t *batch = edit_batch_create(EDIT_FILL, jobs, num_jobs);
+	batch->inst = inst;
+	edit_batch_run(batch);
+	return edit_finish(jobs, num_jobs);
+}
+
+/* Replaces one block with another within a box, returning the number of blocks replaced. */
+int world_replace_in_box(const int a[3], const int b[3], block_instance_t from, block_instance_t to)
+{
+	int min[3], max[3];
+	if (block_instance_equal(from, to) || !edit_normalize(a, b, min, max))
+		return 0;
+	edit_job_t *jobs;
+	int num_jobs = edit_split(min, max, false, &jobs);
+	edit_batch_t *batch = edit_batch_create(EDIT_REPLACE, jobs, num_jobs);
+	batch->inst = to;
+	batch->from = from;
+	edit_batch_run(batch);
+	return edit_finish(jobs, num_jobs);
+}
+
+/* Copies a box so its lowest corner lands on dest, returning the number of blocks written. The
+ * boxes may overlap: the source is read completely before anything is written. Blocks whose
+ * source or destination chunk isn't loaded are skipped. */
+int world_clone_box(const int a[3], const int b[3], const int dest[3])
+{
+	int min[3], max[3], dmin[3], dmax[3], offset[3];
+	for (int i = 0; i < 3; i++)
+		offset[i] = dest[i] - MIN(a[i], b[i]);
+	if (!edit_normalize(a, b, min, max))
+		return 0;
+	for (int i = 0; i < 3; i++) {
+		dmin[i] = min[i] + offset[i];
+		dmax[i] = max[i] + offset[i];
+	}
+	if (!edit_normalize(dmin, dmax, dmin, dmax))
+		return 0;
+
+	size_t volume = (size_t)(max[0] - min[0] + 1) * (max[1] - min[1] + 1) * (max[2] - min[2] + 1);
+	block_instance_t *buffer = malloc(volume * sizeof(block_instance_t));
+	assert(buffer);
+	edit_job_t *jobs = NULL;
+	int num_jobs = 0;
+	for (int op = EDIT_CLONE_READ; op <= EDIT_CLONE_WRITE; op++) {
+		free(jobs);
+		if (op == EDIT_CLONE_READ)
+			num_jobs = edit_split(min, max, true, &jobs);
+		else
+			num_jobs = edit_split(dmin, dmax, false, &jobs);
+		edit_batch_t *batch = edit_batch_create(op, jobs, num_jobs);
+		for (int i = 0; i < 3; i++) {
+			batch->origin[i] = min[i];
+			batch->size[i] = max[i] - min[i] + 1;
+			batch->offset[i] = offset[i];
+		}
+		batch->buffer = buffer;
+		edit_batch_run(batch);
+	}
+	free(buffer);
+	return edit_finish(jobs, num_jobs);
+}
+
+#if 0
+#include <physfs.h>
+#include <stdio.h>
+/* Edits a million blocks of loaded terrain block by block with world_set_block(), against the
+ * bulk edits. */
+void edit_bench(const char *dir)
+{
+	const int radius = 3, size = 100;
+	PHYSFS_init(NULL);
+	PHYSFS_setWriteDir(dir);
+	world_init();
+	for (int cy = -radius; cy <= radius; cy++) {
+		for (int cx = -radius; cx <= radius; cx++) {
+			chunk_t *chunk = calloc(1, sizeof(chunk_t));
+			chunk->loc[0] = cx;
+			chunk->loc[1] = cy;
+			chunk_init_blocks(chunk);
+			chunk_fill_blocks(chunk, 0, CHUNK_AREA * 60, (block_instance_t){ .id = 1 });
+			for (int i = 0; i < CHUNK_AREA * 10; i++)
+				chunk_set_block(chunk, CHUNK_AREA * 60 + i, (block_instance_t){ .id = 2 + (i * 7 % 13 == 0) });
+			SDL_AtomicSet(&chunk->stage, CHUNK_STAGE_GENERATED);
+			chunks_add(chunk);
+		}
+	}
+
+	int min[3] = { -50, -50, 20 }, max[3] = { min[0] + size - 1, min[1] + size - 1, min[2] + size - 1 };
+	int dest[3] = { min[0] + 13, min[1] + 7, 150 };
+	block_instance_t glass = { .id = 5 }, dirt = { .id = 2 };
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int z = min[2]; z <= max[2]; z++) {
+		for (int y = min[1]; y <= max[1]; y++) {
+			for (int x = min[0]; x <= max[0]; x++)
+				world_set_block(x, y, z, &glass);
+		}
+	}
+	journal_commit(true);
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	int filled = world_fill_box(min, max, dirt);
+	Uint64 t2 = SDL_GetPerformanceCounter();
+	int replaced = world_replace_in_box((int[3]){ min[0], min[1], 0 }, max, dirt, glass);
+	Uint64 t3 = SDL_GetPerformanceCounter();
+	int cloned = world_clone_box((int[3]){ min[0], min[1], 0 }, (int[3]){ max[0], max[1], size - 1 }, dest);
+	journal_commit(true);
+	Uint64 t4 = SDL_GetPerformanceCounter();
+
+	double ms = 1000.0 / SDL_GetPerformanceFrequency();
+	printf("%d blocks: world_set_block %.1fms, fill %.1fms, replace %d in %.1fms, clone %d in %.1fms\n", size * size * size,
+	       (t1 - t0) * ms, (t2 - t1) * ms, replaced, (t3 - t2) * ms, cloned, (t4 - t3) * ms);
+	(void)filled;
+	exit(0);
+}
+#endif
@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include "util.h"
+#include "world.h"
+
+#define EVICT_HYSTERESIS 2     /* chunks beyond the load radius by at least this much may be unloaded */
+#define EVICT_INTERVAL_MS 500 /* how often an over-budget world is rescanned if nothing changed */
+
+static size_t memory_budget = WORLD_DEFAULT_MEMORY_BUDGET;
+static SDL_atomic_t resident_chunks, resident_kib, evicted_chunks;
+static Uint32 last_scan_time;
+static int last_scan_center[2];
+
+size_t chunk_memory_usage(chunk_t *chunk)
+{
+	size_t bytes = sizeof(chunk_t) + chunk_blocks_memory_usage(chunk) + features_memory_usage(chunk) + chunk->num_lights * sizeof(mat4);
+	for (int vb = 0; vb < VBUF_MAX; vb++)
+		bytes += chunk->vbufsize[vb] * VERTEX_DATA_SIZE * sizeof(float);
+	return bytes;
+}
+
+/* Chunk sizes are tracked in KiB so the running total fits in an SDL_atomic_t. */
+void chunk_update_accounting(chunk_t *chunk)
+{
+	int kib = (chunk_memory_usage(chunk) + 1023) / 1024;
+	if (chunk->accounted_kib == 0)
+		SDL_AtomicAdd(&resident_chunks, 1);
+	SDL_AtomicAdd(&resident_kib, kib - chunk->accounted_kib);
+	chunk->accounted_kib = kib;
+}
+
+void world_set_memory_budget(size_t bytes)
+{
+	memory_budget = bytes;
+	last_scan_time = 0;
+}
+
+void world_memory_stats(world_memory_stats_t *stats)
+{
+	stats->resident_chunks = SDL_AtomicGet(&resident_chunks);
+	stats->resident_bytes = (size_t)SDL_AtomicGet(&resident_kib) * 1024;
+	stats->evicted_chunks = SDL_AtomicGet(&evicted_chunks);
+	stats->budget_bytes = memory_budget;
+}
+
+/* Unloading happens on the main thread, which owns the GL buffers and the light data. The chunk
+ * itself is retired through the chunk map and freed once no worker can be reading it. Returns
+ * false for a chunk that generation jobs still need or whose mesh is still on its way. */
+static bool unload_chunk(chunk_t *chunk)
+{
+	if (chunk->meshing || !world_remove_chunk(chunk))
+		return false;
+	if (SDL_AtomicGet(&chunk->modified))
+		chunk_save(chunk, true);
+	if (chunk->vbuf[0] != 0)
+		glDeleteBuffers(VBUF_MAX, chunk->vbuf);
+	free(chunk->light_data);
+	chunk->light_data = NULL;
+	chunk->num_lights = 0;
+
+	SDL_AtomicAdd(&resident_chunks, -1);
+	SDL_AtomicAdd(&resident_kib, -chunk->accounted_kib);
+	SDL_AtomicAdd(&evicted_chunks, 1);
+	return true;
+}
+
+static int compare_last_used(const void *a, const void *b)
+{
+	const chunk_t *c1 = *(chunk_t *const *)a, *c2 = *(chunk_t *const *)b;
+	return (c1->last_used > c2->last_used) - (c1->last_used < c2->last_used);
+}
+
+void world_evict_chunks(int center_x, int center_y, int load_radius)
+{
+	Uint32 now = SDL_GetTicks();
+	size_t resident_bytes = (size_t)SDL_AtomicGet(&resident_kib) * 1024;
+	if (resident_bytes <= memory_budget)
+		return;
+	if (center_x == last_scan_center[0] && center_y == last_scan_center[1] && last_scan_time != 0 &&
+	    now - last_scan_time < EVICT_INTERVAL_MS)
+		return;
+	last_scan_time = now;
+	last_scan_center[0] = center_x;
+	last_scan_center[1] = center_y;
+
+	/* Only chunks that are far enough away to not be reloaded on the next step are candidates.
+	 * Evict them least recently used first. */
+	size_t iter = 0, num_candidates = 0, max_candidates = SDL_AtomicGet(&resident_chunks) + 1;
+	chunk_t **candidates = malloc(max_candidates * sizeof(chunk_t *)), *chunk;
+	while ((chunk = chunks_next(&iter)) != NULL && num_candidates < max_candidates) {
+		int dist = MAX(abs(chunk->loc[0] - center_x), abs(chunk->loc[1] - center_y));
+		if (dist > load_radius + EVICT_HYSTERESIS)
+			candidates[num_candidates++] = chunk;
+	}
+	qsort(candidates, num_candidates, sizeof(chunk_t *), compare_last_used);
+
+	for (size_t i = 0; i < num_candidates && resident_bytes > memory_budget; i++) {
+		size_t bytes = (size_t)candidates[i]->accounted_kib * 1024;
+		if (unload_chunk(candidates[i]))
+			resident_bytes -= bytes;
+	}
+	free(candidates);
+}
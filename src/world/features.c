@@ -0,0 +1,161 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "util.h"
+#include "world.h"
+
+/* Features are placed by the chunk they start in but may reach into its eight neighbors, which may
+ * not even be generated yet. Nothing writes into another chunk's blocks directly: when a chunk is
+ * decorated, its features' writes are queued in one batch per target chunk, itself included, which
+ * the chunk keeps. A target applies the batches queued for it when it is lit, which waits until
+ * every neighbor has decorated, and takes them in a fixed order of where they came from, so the
+ * blocks come out the same whichever order the workers finish in. Each batch is written once, by
+ * the job decorating its chunk, and only read after, so there is no lock to share. A chunk keeps
+ * the batches for its neighbors for as long as it is loaded, so a neighbor that is unloaded and
+ * generated again finds them still there.
+ *
+ * A chunk loaded from a save already has every feature that reaches into it, so it applies none,
+ * but still decorates for its neighbors. */
+#define FEATURE_ANY 0xffff /* replaces whatever block is there */
+#define FEATURE_REACH 16   /* how far a feature may extend past the chunk it starts in */
+
+#define BOULDER_CHANCE 4 /* one chunk in this many has a boulder */
+#define BOULDER_MAX_RADIUS 3
+#define VEINS_PER_CHUNK 2
+#define VEIN_LENGTH 6
+#define VEIN_MIN_DEPTH 8 /* below the surface */
+
+enum { FEATURE_STONE = 1, FEATURE_COBBLESTONE = 4, FEATURE_GLOWSTONE = 7 };
+
+typedef struct feature_write_s {
+	int bi;
+	uint16_t id, replace;
+} feature_write_t;
+
+struct feature_batch_s {
+	int count, capacity;
+	feature_write_t writes[];
+};
+
+/* 0 to 8, row by row, with the chunk itself at 4. */
+static inline int neighbor_index(int dx, int dy)
+{
+	return dx + 1 + (dy + 1) * 3;
+}
+
+static uint32_t feature_rand(uint64_t *state)
+{
+	/* SplitMix64 */
+	uint64_t z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return (z ^ (z >> 31)) >> 32;
+}
+
+/* Queues a block at (x, y, z), relative to the placing chunk's corner, for the chunk it is in. */
+static void feature_set(chunk_t *chunk, int x, int y, int z, uint16_t id, uint16_t replace)
+{
+	assert(x >= -FEATURE_REACH && x < CHUNK_WIDTH + FEATURE_REACH && y >= -FEATURE_REACH && y < CHUNK_WIDTH + FEATURE_REACH);
+	if (z < 0 || z >= CHUNK_HEIGHT)
+		return;
+	int dx = x < 0 ? -1 : x >= CHUNK_WIDTH, dy = y < 0 ? -1 : y >= CHUNK_WIDTH, t = neighbor_index(dx, dy);
+	feature_batch_t *b = chunk->features[t];
+	if (b == NULL || b->count == b->capacity) {
+		int capacity = b ? b->capacity * 2 : 64, count = b ? b->count : 0;
+		b = realloc(b, sizeof(feature_batch_t) + capacity * sizeof(feature_write_t));
+		assert(b);
+		b->count = count;
+		b->capacity = capacity;
+		chunk->features[t] = b;
+	}
+	int bi = CHUNK_BLOCK_INDEX(x - dx * CHUNK_WIDTH, y - dy * CHUNK_WIDTH, z);
+	b->writes[b->count++] = (feature_write_t){ bi, id, replace };
+}
+
+/* A ball of cobblestone half sunk into the surface. */
+static void place_boulder(chunk_t *chunk, uint64_t *rng)
+{
+	int x = feature_rand(rng) % CHUNK_WIDTH, y = feature_rand(rng) % CHUNK_WIDTH;
+	int r = 1 + feature_rand(rng) % BOULDER_MAX_RADIUS;
+	int z = world_terrain_height(chunk->loc[0] * CHUNK_WIDTH + x, chunk->loc[1] * CHUNK_WIDTH + y) - 1;
+	for (int dz = -r; dz <= r; dz++) {
+		for (int dy = -r; dy <= r; dy++) {
+			for (int dx = -r; dx <= r; dx++) {
+				if (dx * dx + dy * dy + dz * dz <= r * r + r)
+					feature_set(chunk, x + dx, y + dy, z + dz, FEATURE_COBBLESTONE, FEATURE_ANY);
+			}
+		}
+	}
+}
+
+/* A random walk of glowstone through the stone, well below the surface. */
+static void place_vein(chunk_t *chunk, uint64_t *rng)
+{
+	int x = feature_rand(rng) % CHUNK_WIDTH, y = feature_rand(rng) % CHUNK_WIDTH;
+	int top = world_terrain_height(chunk->loc[0] * CHUNK_WIDTH + x, chunk->loc[1] * CHUNK_WIDTH + y) - VEIN_MIN_DEPTH;
+	if (top < 2)
+		return;
+	int z = 1 + feature_rand(rng) % (top - 1);
+	for (int i = 0; i < VEIN_LENGTH; i++) {
+		feature_set(chunk, x, y, z, FEATURE_GLOWSTONE, FEATURE_STONE);
+		uint32_t step = feature_rand(rng);
+		x += (int)(step % 3) - 1;
+		y += (int)(step / 3 % 3) - 1;
+		z += (int)(step / 9 % 3) - 1;
+	}
+}
+
+/* Places the features starting in the chunk, queueing their blocks for it and its neighbors. Run by
+ * the chunk's decoration stage. */
+void features_place(chunk_t *chunk, uint64_t seed)
+{
+	uint64_t rng = seed ^ (uint64_t)pack32(chunk->loc[0], chunk->loc[1]) * 0xd1342543de82ef95;
+	if (feature_rand(&rng) % BOULDER_CHANCE == 0)
+		place_boulder(chunk, &rng);
+	for (int i = 0; i < VEINS_PER_CHUNK; i++)
+		place_vein(chunk, &rng);
+	/* A saved chunk has its own features already. */
+	if (chunk->loaded) {
+		free(chunk->features[4]);
+		chunk->features[4] = NULL;
+	}
+}
+
+/* Applies the blocks queued for the chunk by itself and its neighbors, which must all be in the
+ * chunk map and decorated, taking the sources row by row from the lowest. Run by the chunk's
+ * lighting stage. */
+void features_apply(chunk_t *chunk)
+{
+	for (int s = 0; s < 9; s++) {
+		int dx = s % 3 - 1, dy = s / 3 - 1;
+		chunk_t *source = dx == 0 && dy == 0 ? chunk : chunks_get(chunk->loc[0] + dx, chunk->loc[1] + dy);
+		assert(source && chunk_stage(source) >= CHUNK_STAGE_DECORATED);
+		feature_batch_t *b = source->features[neighbor_index(-dx, -dy)];
+		for (int i = 0; b && i < b->count; i++) {
+			feature_write_t *fw = &b->writes[i];
+			if (fw->replace == FEATURE_ANY || chunk_get_block(chunk, fw->bi).id == fw->replace)
+				chunk_set_block(chunk, fw->bi, (block_instance_t){ .id = fw->id });
+		}
+	}
+	/* Nothing else needs the chunk's own batch, unlike those it keeps for its neighbors. */
+	free(chunk->features[4]);
+	chunk->features[4] = NULL;
+}
+
+size_t features_memory_usage(chunk_t *chunk)
+{
+	size_t bytes = 0;
+	for (int t = 0; t < 9; t++) {
+		if (chunk->features[t])
+			bytes += sizeof(feature_batch_t) + chunk->features[t]->capacity * sizeof(feature_write_t);
+	}
+	return bytes;
+}
+
+/* Frees the batches a chunk being released still keeps. */
+void features_free(chunk_t *chunk)
+{
+	for (int t = 0; t < 9; t++) {
+		free(chunk->features[t]);
+		chunk->features[t] = NULL;
+	}
+}
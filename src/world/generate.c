@@ -1,54 +1,509 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "tinycthread.h"
 #include "util.h"
 #include "world.h"
 
 static uint64_t chunk_gen_seed = 0;
 static tpool_t *world_threadpool = NULL;
 
+#define TERRAIN_BASE 64 /* mean surface height */
+#define TERRAIN_AMPLITUDE 48 /* of the hills, a half more inland and a half less by the coasts */
+#define TERRAIN_PERIOD 256
+#define TERRAIN_OCTAVES 5
+#define TERRAIN_CONTINENT_RISE 24 /* how far inland rises above the coasts, each way from the base */
+#define SOIL_DEPTH 3 /* mean depth of dirt under the grass, varying by up to as much again */
+#define SOIL_PERIOD 32
+#define SOIL_SEED 0x5011d1e7u
+
+#define CAVE_STEP 4 /* blocks between points of the coarse lattice, each way */
+#define CAVE_PERIOD 16 /* in lattice steps */
+#define CAVE_OCTAVES 3
+#define CAVE_THRESHOLD (NOISE_ONE * 9 / 20) /* noise above this is hollow */
+#define CAVE_FLOOR 2 /* lowest layer carved */
+#define CAVE_ROOF 6  /* least depth of blocks left over a cave */
+#define CAVE_SEED 0xca7e5eedu
+#define CAVE_LATTICE_WIDTH ((CHUNK_WIDTH + CAVE_STEP - 2) / CAVE_STEP + 2) /* most points a chunk spans, each way */
+#define CAVE_LATTICE_HEIGHT ((CHUNK_HEIGHT - 1) / CAVE_STEP + 2)
+
+enum { TERRAIN_AIR, TERRAIN_STONE, TERRAIN_DIRT, TERRAIN_GRASS };
+
+/* Turns surface noise into one past the top block of a column. */
+static inline int terrain_height(int32_t noise, const climate_t *climate)
+{
+	int base = TERRAIN_BASE + climate->continentalness * TERRAIN_CONTINENT_RISE / NOISE_ONE;
+	int amplitude = TERRAIN_AMPLITUDE + climate->continentalness * TERRAIN_AMPLITUDE / 2 / NOISE_ONE;
+	return MIN(MAX(base + noise * amplitude / NOISE_ONE, 1), CHUNK_HEIGHT - 1);
+}
+
+/* The top block of a column: bare stone where it is cold, dirt where it is dry and grass elsewhere. */
+static inline int terrain_surface(const climate_t *climate)
+{
+	if (climate->temperature < -NOISE_ONE / 4)
+		return TERRAIN_STONE;
+	return climate->humidity < -NOISE_ONE / 4 ? TERRAIN_DIRT : TERRAIN_GRASS;
+}
+
+static inline int terrain_block(int height, int soil, int surface, int z)
+{
+	if (z >= height)
+		return TERRAIN_AIR;
+	if (z == height - 1)
+		return surface;
+	return z >= soil ? TERRAIN_DIRT : TERRAIN_STONE;
+}
+
+/* Stone, under a few layers of dirt, under grass, with the surface height and the dirt depth each
+ * taken from seeded noise. The climate raises the land inland and makes it hillier, and picks the
+ * surface, with no dirt under bare stone. The noise is integer only, so a seed gives the same chunk
+ * on any machine and whichever worker generates it. Layers below the lowest dirt are filled whole,
+ * and the layers above in runs of equal blocks per row. Sections above the terrain are left as
+ * they were created, all air. The heights go in the heightmap for carving, which is rebuilt once
+ * the chunk is lit. */
 static void generate_chunk_blocks(chunk_t *chunk, uint64_t seed)
 {
-	memset(chunk->blocks, 0, sizeof(block_instance_t) * CHUNK_TOTAL_BLOCKS);
-	for (int i = 0; i < CHUNK_AREA; i++)
-		chunk->blocks[i].id = 1;
-	for (int i = 0; i < CHUNK_AREA * 2; i++)
-		chunk->blocks[CHUNK_AREA + i].id = 2;
-	for (int i = 0; i < CHUNK_AREA; i++)
-		chunk->blocks[CHUNK_AREA * 3 + i].id = 3;
+	int32_t height[CHUNK_AREA], soil[CHUNK_AREA], surface[CHUNK_AREA];
+	climate_t climate[CHUNK_AREA];
+	int x0 = chunk->loc[0] * CHUNK_WIDTH, y0 = chunk->loc[1] * CHUNK_WIDTH;
+	noise2_grid(seed, x0, y0, CHUNK_WIDTH, CHUNK_WIDTH, TERRAIN_PERIOD, TERRAIN_OCTAVES, height);
+	noise2_grid(seed ^ SOIL_SEED, x0, y0, CHUNK_WIDTH, CHUNK_WIDTH, SOIL_PERIOD, 2, soil);
+	climate_grid(seed, x0, y0, CHUNK_WIDTH, CHUNK_WIDTH, climate);
+
+	int stone_top = CHUNK_HEIGHT, top = 0;
+	for (int i = 0; i < CHUNK_AREA; i++) {
+		height[i] = terrain_height(height[i], &climate[i]);
+		surface[i] = terrain_surface(&climate[i]);
+		if (surface[i] == TERRAIN_STONE)
+			soil[i] = height[i] - 1;
+		else
+			soil[i] = MAX(0, height[i] - 1 - (SOIL_DEPTH + soil[i] * SOIL_DEPTH / NOISE_ONE));
+		stone_top = MIN(stone_top, soil[i]);
+		top = MAX(top, height[i]);
+		chunk->heightmap[i] = height[i];
+	}
+
+	chunk_fill_blocks(chunk, 0, CHUNK_BLOCK_INDEX(0, 0, stone_top), (block_instance_t){ .id = TERRAIN_STONE });
+	for (int z = stone_top; z < top; z++) {
+		for (int row = 0; row < CHUNK_AREA; row += CHUNK_WIDTH) {
+			for (int x = 0, end; x < CHUNK_WIDTH; x = end) {
+				int id = terrain_block(height[row + x], soil[row + x], surface[row + x], z);
+				for (end = x + 1; end < CHUNK_WIDTH && terrain_block(height[row + end], soil[row + end], surface[row + end], z) == id;
+				     end++)
+					;
+				if (id != TERRAIN_AIR)
+					chunk_fill_blocks(chunk, CHUNK_BLOCK_INDEX(0, 0, z) + row + x, end - x, (block_instance_t){ .id = id });
+			}
+		}
+	}
+}
+
+static inline int lattice_floor(int v)
+{
+	return (v >= 0 ? v : v - CAVE_STEP + 1) / CAVE_STEP;
+}
+
+/* Hollows out caves where 3D noise is above a threshold. The noise is only evaluated on a lattice
+ * CAVE_STEP blocks apart, aligned to the world so caves carry on across chunks, and interpolated
+ * trilinearly between. An interpolated value never leaves the range of its cell's eight corners,
+ * so a cell whose corners are all at or below the threshold is solid and skipped, and one whose
+ * corners are all above it is hollowed out whole; only cells the surface of a cave passes through
+ * are interpolated block by block. Each column of cells stops at its roof, the lowest surface
+ * over it less CAVE_ROOF, and the lattice is only evaluated up to the highest roof, so the air
+ * above the terrain costs nothing. */
+static void carve_chunk_blocks(chunk_t *chunk, uint64_t seed)
+{
+	int x0 = chunk->loc[0] * CHUNK_WIDTH, y0 = chunk->loc[1] * CHUNK_WIDTH;
+	int lx0 = lattice_floor(x0), ly0 = lattice_floor(y0);
+	int nx = lattice_floor(x0 + CHUNK_WIDTH - 1) - lx0 + 2, ny = lattice_floor(y0 + CHUNK_WIDTH - 1) - ly0 + 2;
+	int roof[CAVE_LATTICE_WIDTH - 1][CAVE_LATTICE_WIDTH - 1], top = 0;
+	assert(nx <= CAVE_LATTICE_WIDTH && ny <= CAVE_LATTICE_WIDTH);
+	for (int j = 0; j < ny - 1; j++) {
+		for (int i = 0; i < nx - 1; i++) {
+			int cx = (lx0 + i) * CAVE_STEP - x0, cy = (ly0 + j) * CAVE_STEP - y0, r = CHUNK_HEIGHT;
+			for (int y = MAX(0, cy); y < MIN(CHUNK_WIDTH, cy + CAVE_STEP); y++) {
+				for (int x = MAX(0, cx); x < MIN(CHUNK_WIDTH, cx + CAVE_STEP); x++)
+					r = MIN(r, chunk->heightmap[x + y * CHUNK_WIDTH] - CAVE_ROOF);
+			}
+			roof[j][i] = r;
+			top = MAX(top, r);
+		}
+	}
+	if (top <= CAVE_FLOOR)
+		return;
+
+	int nz = (top - 1) / CAVE_STEP + 2;
+	assert(nz <= CAVE_LATTICE_HEIGHT);
+	/* Layer k, row j, point i is at lattice[(k * ny + j) * nx + i]. */
+	int32_t lattice[CAVE_LATTICE_HEIGHT * CAVE_LATTICE_WIDTH * CAVE_LATTICE_WIDTH];
+	for (int k = 0; k < nz; k++)
+		noise3_grid(seed ^ CAVE_SEED, lx0, ly0, k, nx, ny, CAVE_PERIOD, CAVE_OCTAVES, &lattice[k * ny * nx]);
+
+	const block_instance_t air = { 0 };
+	for (int j = 0; j < ny - 1; j++) {
+		for (int i = 0; i < nx - 1; i++) {
+			int cx = (lx0 + i) * CAVE_STEP - x0, cy = (ly0 + j) * CAVE_STEP - y0;
+			int min[3] = { MAX(0, cx), MAX(0, cy), 0 };
+			int max[3] = { MIN(CHUNK_WIDTH, cx + CAVE_STEP) - 1, MIN(CHUNK_WIDTH, cy + CAVE_STEP) - 1, 0 };
+			for (int k = 0; k * CAVE_STEP < roof[j][i]; k++) {
+				int32_t c[8], lo = INT32_MAX, hi = INT32_MIN;
+				for (int n = 0; n < 8; n++) {
+					c[n] = lattice[((k + (n >> 2)) * ny + j + (n >> 1 & 1)) * nx + i + (n & 1)];
+					lo = MIN(lo, c[n]);
+					hi = MAX(hi, c[n]);
+				}
+				min[2] = MAX(CAVE_FLOOR, k * CAVE_STEP);
+				max[2] = MIN(roof[j][i], (k + 1) * CAVE_STEP) - 1;
+				if (hi <= CAVE_THRESHOLD || min[2] > max[2])
+					continue;
+				if (lo > CAVE_THRESHOLD) {
+					chunk_fill_box(chunk, min, max, air);
+					continue;
+				}
+				/* Interpolated along z, then y, then x, each step scaling by CAVE_STEP. */
+				for (int z = min[2]; z <= max[2]; z++) {
+					int wz = z - k * CAVE_STEP, e[4];
+					for (int n = 0; n < 4; n++)
+						e[n] = c[n] * (CAVE_STEP - wz) + c[n + 4] * wz;
+					for (int y = min[1]; y <= max[1]; y++) {
+						int wy = y - cy, a = e[0] * (CAVE_STEP - wy) + e[2] * wy, b = e[1] * (CAVE_STEP - wy) + e[3] * wy;
+						for (int x = min[0]; x <= max[0]; x++) {
+							int wx = x - cx;
+							if (a * (CAVE_STEP - wx) + b * wx > CAVE_THRESHOLD * CAVE_STEP * CAVE_STEP * CAVE_STEP)
+								chunk_set_block(chunk, CHUNK_BLOCK_INDEX(x, y, z), air);
+						}
+					}
+				}
+			}
+		}
+	}
 }
 
 /****************************************************************************/
 
 static inline void world_deinit_workerpool(void)
 {
+	world_save_flush();
+	journal_close();
 	tpool_destroy(world_threadpool);
+	region_close_all();
+	climate_clear();
 }
 
-static tpool_ret_t chunk_generate_worker(void *_chunk)
+/* Stages advance through dependency counts rather than by polling. Every chunk counts the
+ * neighbors that have yet to finish the stage its next one needs, and becomes ready the moment
+ * that count is zero and it has no stage queued or running. A chunk finishing a stage counts
+ * itself down in each neighbor waiting on it, so finished work immediately makes more available.
+ * A missing neighbor counts as not finished, so chunks at the edge of the loaded area stop at the
+ * last stage that doesn't need them.
+ *
+ * Ready chunks wait in a heap ordered by load_priority(), and a few pool jobs, no more than
+ * max_running, drain it best first. Capping the jobs keeps the pool's queue, which is first in
+ * first out, from deciding the order. A job hands over to a fresh one after PIPELINE_BATCH stages,
+ * so the workers look for more urgent work, such as an edit, in between even when generation
+ * has every one of them. Moving or turning the focus marks every priority stale, and
+ * the next job to take from the heap recomputes them, so chunks in view are generated, loaded
+ * and lit first however the player got there. Chunks that have left the load radius are held
+ * back at the bottom of the heap instead, in case the player returns, and what is still queued
+ * for a chunk when it is removed is cancelled. The heap, the counts, the chunks' pipeline states,
+ * the focus and adding and removing chunks are all guarded by pipeline_mutex, which is only held
+ * for bookkeeping. */
+#define FOCUS_TURN_COS 0.9f /* turning by more than this reorders the heap, as does moving half a chunk */
+#define PIPELINE_BATCH 8     /* stages a job runs before giving its worker back to the pool */
+
+enum { GEN_IDLE, GEN_QUEUED, GEN_RUNNING };
+
+typedef struct pipeline_entry_s {
+	chunk_t *chunk;
+	float priority;
+} pipeline_entry_t;
+
+static mtx_t pipeline_mutex;
+static pipeline_entry_t *ready_heap;
+static int num_ready, max_ready, num_running, max_running;
+static unsigned int worker_count;
+static bool priorities_stale;
+static float focus[2], facing[2]; /* in chunks, and horizontal */
+static int focus_radius = -1;     /* chunks further than this from the focus are held back */
+static size_t stages_run, stages_cancelled, stages_wasted;
+
+/* The stage all eight neighbors must have finished before a chunk starts each stage; EMPTY for
+ * stages that only touch the chunk itself. Terrain, caves and where features go are functions of
+ * the seed and the position alone, so the first three stages read and write nothing outside the
+ * chunk. The stages that do depend on neighbors wait for them. */
+static const int stage_needs[CHUNK_STAGE_MAX] = {
+	[CHUNK_STAGE_TERRAIN] = CHUNK_STAGE_EMPTY,
+	[CHUNK_STAGE_CARVED] = CHUNK_STAGE_EMPTY,
+	[CHUNK_STAGE_DECORATED] = CHUNK_STAGE_EMPTY, /* features only queue their blocks */
+	[CHUNK_STAGE_LIT] = CHUNK_STAGE_DECORATED,   /* applies the blocks the neighbors queued for it */
+	[CHUNK_STAGE_READY] = CHUNK_STAGE_LIT,       /* meshing reads the neighbors' border blocks */
+};
+
+static const int neighbor_offsets[8][2] = { { -1, -1 }, { 0, -1 }, { 1, -1 }, { -1, 0 },
+					    { 1, 0 },   { -1, 1 }, { 0, 1 },  { 1, 1 } };
+
+static inline chunk_t *chunk_neighbor(chunk_t *chunk, int n)
 {
-	chunk_t *chunk = _chunk;
-	bool change_made = true;
-	if (chunk->gen_stage == 0) {
-		generate_chunk_blocks(chunk, chunk_gen_seed);
+	return chunks_get(chunk->loc[0] + neighbor_offsets[n][0], chunk->loc[1] + neighbor_offsets[n][1]);
+}
+
+/* The stage neighbors must have finished before the chunk's next stage, or EMPTY for none. */
+static inline int chunk_next_needs(chunk_t *chunk)
+{
+	int next = chunk_stage(chunk) + 1;
+	return next < CHUNK_STAGE_MAX ? stage_needs[next] : CHUNK_STAGE_EMPTY;
+}
+
+static int count_waiting(chunk_t *chunk)
+{
+	int needs = chunk_next_needs(chunk), waiting = 0;
+	if (needs == CHUNK_STAGE_EMPTY)
+		return 0;
+	for (int n = 0; n < 8; n++) {
+		chunk_t *neighbor = chunk_neighbor(chunk, n);
+		waiting += neighbor == NULL || chunk_stage(neighbor) < needs;
+	}
+	return waiting;
+}
+
+/* Lower is sooner: the distance from the focus in chunks, weighted up to twice over for chunks
+ * behind the view. Chunks outside the load radius are never run. */
+static float load_priority(int x, int y)
+{
+	float dx = x + 0.5f - focus[0], dy = y + 0.5f - focus[1], dist = sqrtf(dx * dx + dy * dy);
+	if (focus_radius >= 0 && MAX(abs(x - (int)floorf(focus[0])), abs(y - (int)floorf(focus[1]))) > focus_radius)
+		return INFINITY;
+	if (dist < 1)
+		return dist;
+	return dist * (1.5f - 0.5f * (dx * facing[0] + dy * facing[1]) / dist);
+}
+
+static void heap_sift_up(int i)
+{
+	pipeline_entry_t e = ready_heap[i];
+	for (int parent; i > 0 && ready_heap[parent = (i - 1) / 2].priority > e.priority; i = parent)
+		ready_heap[i] = ready_heap[parent];
+	ready_heap[i] = e;
+}
+
+static void heap_sift_down(int i)
+{
+	pipeline_entry_t e = ready_heap[i];
+	for (int child; (child = 2 * i + 1) < num_ready; i = child) {
+		if (child + 1 < num_ready && ready_heap[child + 1].priority < ready_heap[child].priority)
+			child++;
+		if (ready_heap[child].priority >= e.priority)
+			break;
+		ready_heap[i] = ready_heap[child];
+	}
+	ready_heap[i] = e;
+}
+
+static void heap_remove(int i)
+{
+	ready_heap[i] = ready_heap[--num_ready];
+	if (i < num_ready) {
+		heap_sift_up(i);
+		heap_sift_down(i);
+	}
+}
+
+/* Takes the best ready chunk, or NULL if every one left is held back. */
+static chunk_t *pipeline_pop(void)
+{
+	if (priorities_stale) {
+		for (int i = 0; i < num_ready; i++)
+			ready_heap[i].priority = load_priority(ready_heap[i].chunk->loc[0], ready_heap[i].chunk->loc[1]);
+		for (int i = num_ready / 2 - 1; i >= 0; i--)
+			heap_sift_down(i);
+		priorities_stale = false;
+	}
+	if (num_ready == 0 || ready_heap[0].priority == INFINITY)
+		return NULL;
+	chunk_t *chunk = ready_heap[0].chunk;
+	heap_remove(0);
+	return chunk;
+}
+
+/* Takes a queued chunk back out of the heap. */
+static void pipeline_cancel(chunk_t *chunk)
+{
+	int i = 0;
+	while (ready_heap[i].chunk != chunk)
+		i++;
+	heap_remove(i);
+	chunk->gen_state = GEN_IDLE;
+	stages_cancelled++;
+}
+
+static tpool_ret_t pipeline_worker(void *unused);
+
+static void pipeline_dispatch(void)
+{
+	while (num_running < MIN(max_running, num_ready)) {
+		num_running++;
+		tpool_add_work(world_threadpool, pipeline_worker, NULL, false, TPOOL_VISIBLE);
+	}
+}
+
+/* Makes the chunk's next stage ready if nothing holds it back, starting another job to run it if
+ * there is room. Called with pipeline_mutex held. */
+static void pipeline_try_queue(chunk_t *chunk)
+{
+	if (chunk->gen_state != GEN_IDLE || chunk->gen_waiting != 0 || chunk_stage(chunk) >= CHUNK_STAGE_READY)
+		return;
+	chunk->gen_state = GEN_QUEUED;
+	if (num_ready == max_ready) {
+		max_ready = MAX(64, max_ready * 2);
+		ready_heap = realloc(ready_heap, max_ready * sizeof(pipeline_entry_t));
+		assert(ready_heap);
+	}
+	ready_heap[num_ready] = (pipeline_entry_t){ chunk, load_priority(chunk->loc[0], chunk->loc[1]) };
+	heap_sift_up(num_ready++);
+	pipeline_dispatch();
+}
+
+/* Publishes the stage a job reached, which may be past the next one for a chunk loaded from disk,
+ * and releases whatever was waiting on it. Called with pipeline_mutex held. */
+static void pipeline_finish(chunk_t *chunk, int stage)
+{
+	int old = chunk_stage(chunk);
+	SDL_AtomicSet(&chunk->stage, stage);
+	/* The blocks are at their full size now, whether or not the chunk is ever meshed. */
+	if (old < CHUNK_STAGE_GENERATED && stage >= CHUNK_STAGE_GENERATED)
+		chunk_update_accounting(chunk);
+	for (int n = 0; n < 8; n++) {
+		chunk_t *neighbor = chunk_neighbor(chunk, n);
+		if (neighbor == NULL)
+			continue;
+		int needs = chunk_next_needs(neighbor);
+		if (needs > old && needs <= stage) {
+			assert(neighbor->gen_waiting > 0);
+			neighbor->gen_waiting--;
+			pipeline_try_queue(neighbor);
+		}
 	}
+	chunk->gen_waiting = count_waiting(chunk);
+	chunk->gen_state = GEN_IDLE;
+	chunk->gen_runs++;
+	stages_run++;
+	pipeline_try_queue(chunk);
+
+	if (stage == CHUNK_STAGE_READY)
+		chunk_mark_dirty(chunk);
+}
 
-	if (change_made) {
-		chunk->gen_stage++;
-		chunk->dirty = true;
-		for (int f = FACE_NORTH; f < FACE_MAX; f++) {
-			chunk_t *n = chunks_get(chunk->loc[0] + cube_normal[f][0], chunk->loc[1] + cube_normal[f][1]);
-			if (n)
-				n->dirty = true;
+/* Runs the chunk's next stage, returning the stage it got to. */
+static int chunk_run_stage(chunk_t *chunk, int stage)
+{
+	switch (stage) {
+	case CHUNK_STAGE_TERRAIN:
+		/* A saved chunk already went through every stage that changes its blocks, but still places
+		 * its features for the neighbors. */
+		if (chunk_load_pending(chunk) || region_load_chunk(chunk)) {
+			chunk->loaded = true;
+			return CHUNK_STAGE_CARVED;
 		}
+		generate_chunk_blocks(chunk, chunk_gen_seed);
+		break;
+	case CHUNK_STAGE_CARVED:
+		carve_chunk_blocks(chunk, chunk_gen_seed);
+		break;
+	case CHUNK_STAGE_DECORATED:
+		features_place(chunk, chunk_gen_seed);
+		break;
+	case CHUNK_STAGE_LIT:
+		/* Edits are replayed over the features, once every neighbor has queued its own. */
+		if (!chunk->loaded)
+			features_apply(chunk);
+		journal_apply(chunk);
+		chunk_update_heightmap(chunk);
+		break;
 	}
+	return stage;
+}
 
+/* Runs ready stages, best first, until there are none, or queues another job to go on after a
+ * batch of them. */
+static tpool_ret_t pipeline_worker(void *unused)
+{
+	UNUSED(unused);
+	chunk_t *chunk;
+	int run = 0;
+	mtx_lock(&pipeline_mutex);
+	for (; run < PIPELINE_BATCH && (chunk = pipeline_pop()) != NULL; run++) {
+		chunk->gen_state = GEN_RUNNING;
+		mtx_unlock(&pipeline_mutex);
+		/* The chunk can't be removed while it or a neighbor is busy, but the chunk map's memory can. */
+		int token = chunks_read_begin();
+		int stage = chunk_run_stage(chunk, chunk_stage(chunk) + 1);
+		mtx_lock(&pipeline_mutex);
+		pipeline_finish(chunk, stage);
+		chunks_read_end(token);
+	}
+	if (run == PIPELINE_BATCH)
+		tpool_add_work(world_threadpool, pipeline_worker, NULL, false, TPOOL_VISIBLE);
+	else
+		num_running--;
+	mtx_unlock(&pipeline_mutex);
 	return TPOOL_SUCCESS;
 }
 
+/* Sets where chunk work is prioritized from: a position in blocks, the view direction and the
+ * radius in chunks beyond which work is held back. Main thread only. */
+void world_set_load_focus(double x, double y, const vec3 view, int radius)
+{
+	float fx = x / CHUNK_WIDTH, fy = y / CHUNK_WIDTH, len = sqrtf(view[0] * view[0] + view[1] * view[1]);
+	float dir[2] = { len > 0.01f ? view[0] / len : 0, len > 0.01f ? view[1] / len : 0 };
+	/* Only this thread writes the focus, so it can compare without the lock. */
+	bool moved = fabsf(fx - focus[0]) >= 0.5f || fabsf(fy - focus[1]) >= 0.5f || floorf(fx) != floorf(focus[0]) ||
+		     floorf(fy) != floorf(focus[1]);
+	if (!moved && dir[0] * facing[0] + dir[1] * facing[1] > FOCUS_TURN_COS && radius == focus_radius)
+		return;
+	mtx_lock(&pipeline_mutex);
+	focus[0] = fx;
+	focus[1] = fy;
+	facing[0] = dir[0];
+	facing[1] = dir[1];
+	focus_radius = radius;
+	priorities_stale = true;
+	pipeline_dispatch(); /* held back chunks may be back in range */
+	mtx_unlock(&pipeline_mutex);
+}
+
+/* The order chunk work is done in, lower first. Main thread only. */
+float world_load_priority(int x, int y)
+{
+	return load_priority(x, y);
+}
+
+/* Sets how many workers the pool is created with, 0 to size it from the cores. Only takes effect
+ * before world_init(). */
+void world_set_worker_count(unsigned int workers)
+{
+	worker_count = workers;
+}
+
 void world_init_workerpool(void)
 {
-	world_threadpool = tpool_create(tpool_num_cores() * 2);
+	/* Two workers at least, or holding one back from saves below would hold back all of them. */
+	world_threadpool = tpool_create(worker_count ? worker_count : MAX(2, tpool_num_physical_cores() - 1));
+	mtx_init(&pipeline_mutex, mtx_plain);
+	climate_init();
+	max_running = tpool_num_workers(world_threadpool);
+	/* Saves never take every worker, so an edit or a chunk coming into view can always start. A
+	 * single worker, as pregen can be asked for, has nothing to keep free for. */
+	tpool_set_priority_limit(world_threadpool, TPOOL_BACKGROUND, MAX(1, max_running - 1));
 	atexit(world_deinit_workerpool);
 }
 
+tpool_t *world_workerpool(void)
+{
+	return world_threadpool;
+}
+
 uint64_t world_seed(void)
 {
 	return chunk_gen_seed;
@@ -59,6 +514,39 @@ void world_set_seed(uint64_t seed)
 	chunk_gen_seed = seed;
 }
 
+/* Picks up the seed the save directory was generated with, or records the current one in it if it
+ * has none yet, so a world keeps the seed it was started with. */
+void world_init_seed(const char *save_dir)
+{
+	if (save_dir == NULL)
+		return;
+	char *path = real_path_join(save_dir, "seed");
+	FILE *f = fopen(path, "r");
+	if (f != NULL) {
+		uint64_t seed;
+		if (fscanf(f, "%" SCNu64, &seed) == 1)
+			chunk_gen_seed = seed;
+		else
+			fprintf(stderr, "Can't read the seed in %s, keeping %" PRIu64 "\n", path, chunk_gen_seed);
+		fclose(f);
+	} else {
+		f = fopen(path, "w");
+		bool ok = f && fprintf(f, "%" PRIu64 "\n", chunk_gen_seed) > 0;
+		ok = f && fclose(f) == 0 && ok;
+		if (!ok)
+			fprintf(stderr, "Can't save the seed to %s, the world won't reopen the same\n", path);
+	}
+	free(path);
+}
+
+/* Returns one past the top block the generator puts in a column, before any edits. */
+int world_terrain_height(int x, int y)
+{
+	climate_t climate;
+	climate_grid(chunk_gen_seed, x, y, 1, 1, &climate);
+	return terrain_height(noise2(chunk_gen_seed, x, y, TERRAIN_PERIOD, TERRAIN_OCTAVES), &climate);
+}
+
 int world_request_chunkgen(int x, int y)
 {
 	if (chunks_get(x, y) != NULL)
@@ -67,9 +555,259 @@ int world_request_chunkgen(int x, int y)
 	chunk_t *chunk = calloc(1, sizeof(chunk_t));
 	chunk->loc[0] = x;
 	chunk->loc[1] = y;
-	chunks_add(chunk);
+	chunk_init_blocks(chunk);
 
-	tpool_add_work(world_threadpool, chunk_generate_worker, chunk, false);
+	/* A new chunk satisfies no neighbor until it finishes a stage, so only it can be queued. */
+	mtx_lock(&pipeline_mutex);
+	chunks_add(chunk);
+	chunk->gen_waiting = count_waiting(chunk);
+	pipeline_try_queue(chunk);
+	mtx_unlock(&pipeline_mutex);
 
 	return 0;
 }
+
+/* Takes a chunk out of the world, returning false if it or a neighbor is running a stage, since
+ * that may read or write it. A stage still queued for it is cancelled, as is one queued for a
+ * neighbor that needed it. Main thread only. */
+bool world_remove_chunk(chunk_t *chunk)
+{
+	mtx_lock(&pipeline_mutex);
+	bool busy = chunk->gen_state == GEN_RUNNING;
+	for (int n = 0; n < 8 && !busy; n++) {
+		chunk_t *neighbor = chunk_neighbor(chunk, n);
+		busy = neighbor && neighbor->gen_state == GEN_RUNNING;
+	}
+	if (!busy) {
+		for (int n = 0; n < 8; n++) {
+			chunk_t *neighbor = chunk_neighbor(chunk, n);
+			int needs = neighbor ? chunk_next_needs(neighbor) : CHUNK_STAGE_EMPTY;
+			if (needs != CHUNK_STAGE_EMPTY && chunk_stage(chunk) >= needs) {
+				neighbor->gen_waiting++;
+				if (neighbor->gen_state == GEN_QUEUED)
+					pipeline_cancel(neighbor);
+			}
+		}
+		if (chunk->gen_state == GEN_QUEUED)
+			pipeline_cancel(chunk);
+		/* Stages run on a chunk that never got to be meshed were for nothing. */
+		if (chunk_stage(chunk) < CHUNK_STAGE_READY)
+			stages_wasted += chunk->gen_runs;
+		chunks_remove(chunk->loc[0], chunk->loc[1]);
+	}
+	mtx_unlock(&pipeline_mutex);
+	return !busy;
+}
+
+void world_gen_stats(world_gen_stats_t *stats)
+{
+	mtx_lock(&pipeline_mutex);
+	stats->ready = stats->held = 0;
+	for (int i = 0; i < num_ready; i++) {
+		if (ready_heap[i].priority == INFINITY)
+			stats->held++;
+		else
+			stats->ready++;
+	}
+	stats->running = num_running;
+	stats->run = stages_run;
+	stats->cancelled = stages_cancelled;
+	stats->wasted = stages_wasted;
+	mtx_unlock(&pipeline_mutex);
+}
+
+#if 0
+#include <physfs.h>
+#include <stdio.h>
+/* Compares generating chunks against reading them back from a region file. Every chunk gets a
+ * few hundred edits, like a chunk a player has built in, so its sections aren't all uniform. */
+void chunkload_bench(const char *dir)
+{
+	const int n = REGION_WIDTH * REGION_WIDTH, edits = 300;
+	PHYSFS_init(NULL);
+	PHYSFS_setWriteDir(dir);
+	region_init(dir);
+	climate_init();
+	chunk_t *chunks = calloc(n, sizeof(chunk_t));
+	unsigned seed = 1;
+
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++) {
+		chunks[i].loc[0] = i % REGION_WIDTH;
+		chunks[i].loc[1] = i / REGION_WIDTH;
+		chunk_init_blocks(&chunks[i]);
+		generate_chunk_blocks(&chunks[i], 0);
+	}
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++) {
+		for (int e = 0; e < edits; e++) {
+			seed = seed * 1103515245 + 12345;
+			chunk_set_block(&chunks[i], CHUNK_BLOCK_INDEX(seed % CHUNK_WIDTH, (seed >> 8) % CHUNK_WIDTH, 4 + (seed >> 16) % 8),
+					(block_instance_t){ .id = 4 + (seed >> 24) % 4 });
+		}
+	}
+	Uint64 t2 = SDL_GetPerformanceCounter();
+	region_write_t *writes = calloc(n, sizeof(region_write_t)), **batch = calloc(n, sizeof(region_write_t *));
+	for (int i = 0; i < n; i++) {
+		writes[i] = (region_write_t){ .loc = { chunks[i].loc[0], chunks[i].loc[1] } };
+		writes[i].data = region_compress_chunk(chunks[i].sections, &writes[i].length);
+		batch[i] = &writes[i];
+	}
+	region_write_chunks(batch, n);
+	Uint64 t3 = SDL_GetPerformanceCounter();
+	size_t mismatches = 0;
+	for (int i = 0; i < n; i++) {
+		chunk_t loaded = { .loc = { chunks[i].loc[0], chunks[i].loc[1] } };
+		chunk_init_blocks(&loaded);
+		if (!region_load_chunk(&loaded))
+			mismatches++;
+		for (int bi = 0; bi < CHUNK_TOTAL_BLOCKS; bi += 7)
+			mismatches += !block_instance_equal(chunk_get_block(&loaded, bi), chunk_get_block(&chunks[i], bi));
+		chunk_free_blocks(&loaded);
+	}
+	Uint64 t4 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++) {
+		chunk_t loaded = { .loc = { chunks[i].loc[0], chunks[i].loc[1] } };
+		chunk_init_blocks(&loaded);
+		region_load_chunk(&loaded);
+		chunk_free_blocks(&loaded);
+	}
+	Uint64 t5 = SDL_GetPerformanceCounter();
+
+	double us = 1e6 / SDL_GetPerformanceFrequency() / n;
+	printf("per chunk: generate %.1fus, generate+edit %.1fus, save %.1fus, load %.1fus (%zu mismatches)\n", (t1 - t0) * us,
+	       (t2 - t0) * us, (t3 - t2) * us, (t5 - t4) * us, mismatches);
+	region_close_all();
+	exit(0);
+}
+#endif
+
+#if 0
+#include <stdio.h>
+typedef struct {
+	chunk_t *chunks;
+	SDL_atomic_t next, done;
+	int n;
+} terrain_bench_t;
+
+static tpool_ret_t terrain_bench_worker(void *_b)
+{
+	terrain_bench_t *b = _b;
+	for (int i; (i = SDL_AtomicAdd(&b->next, 1)) < b->n; SDL_AtomicAdd(&b->done, 1))
+		generate_chunk_blocks(&b->chunks[i], 1234);
+	return TPOOL_SUCCESS;
+}
+
+/* Generates a square of chunks on 1, 2, 4, ... threads and hashes their blocks, which must come
+ * out the same every time. Also compares the grid noise kernel against sampling one point at a
+ * time. */
+void terrain_bench(void)
+{
+	const int side = 16, n = side * side;
+	int32_t grid[CHUNK_AREA];
+	climate_init();
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++)
+		noise2_grid(1234, i * CHUNK_WIDTH, 0, CHUNK_WIDTH, CHUNK_WIDTH, TERRAIN_PERIOD, TERRAIN_OCTAVES, grid);
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	int32_t sum = 0;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < CHUNK_AREA; j++) {
+			int32_t v = noise2(1234, i * CHUNK_WIDTH + j % CHUNK_WIDTH, j / CHUNK_WIDTH, TERRAIN_PERIOD, TERRAIN_OCTAVES);
+			sum += v != grid[j] && i == n - 1;
+		}
+	}
+	Uint64 t2 = SDL_GetPerformanceCounter();
+	double freq = SDL_GetPerformanceFrequency();
+	printf("noise per column: grid %.1fns, single %.1fns (%d mismatches)\n", (t1 - t0) * 1e9 / freq / n / CHUNK_AREA,
+	       (t2 - t1) * 1e9 / freq / n / CHUNK_AREA, sum);
+
+	for (int threads = 1; threads <= tpool_num_cores(); threads *= 2) {
+		terrain_bench_t b = { .chunks = calloc(n, sizeof(chunk_t)), .n = n };
+		for (int i = 0; i < n; i++) {
+			b.chunks[i].loc[0] = i % side - side / 2;
+			b.chunks[i].loc[1] = i / side - side / 2;
+			chunk_init_blocks(&b.chunks[i]);
+		}
+		tpool_t *pool = tpool_create(threads);
+		Uint64 start = SDL_GetPerformanceCounter();
+		for (int t = 0; t < threads; t++)
+			tpool_add_work(pool, terrain_bench_worker, &b, false, TPOOL_BACKGROUND);
+		while (SDL_AtomicGet(&b.done) < n)
+			SDL_Delay(1);
+		double seconds = (SDL_GetPerformanceCounter() - start) / freq;
+		tpool_destroy(pool);
+
+		uint64_t hash = 0xcbf29ce484222325;
+		for (int i = 0; i < n; i++) {
+			for (int bi = 0; bi < CHUNK_TOTAL_BLOCKS; bi++)
+				hash = (hash ^ chunk_get_block(&b.chunks[i], bi).id) * 0x100000001b3;
+			chunk_free_blocks(&b.chunks[i]);
+		}
+		free(b.chunks);
+		printf("%d threads: %.0f chunks/s, %.0f per thread, hash %016llx\n", threads, n / seconds, n / seconds / threads,
+		       (unsigned long long)hash);
+	}
+	exit(0);
+}
+#endif
+
+#if 0
+#include <stdio.h>
+/* Times carving a square of chunks against generating their terrain, on one thread, and against
+ * evaluating the cave noise at every block up to the surface, which carving would cost without
+ * the lattice. Also reports how much of the stone under the roofs was hollowed out. */
+void cave_bench(void)
+{
+	const int side = 16, n = side * side;
+	chunk_t *chunks = calloc(n, sizeof(chunk_t));
+	size_t solid = 0, hollow = 0;
+	climate_init();
+	for (int i = 0; i < n; i++) {
+		chunks[i].loc[0] = i % side - side / 2;
+		chunks[i].loc[1] = i / side - side / 2;
+		chunk_init_blocks(&chunks[i]);
+	}
+
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++)
+		generate_chunk_blocks(&chunks[i], 1234);
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++) {
+		for (int xy = 0; xy < CHUNK_AREA; xy++)
+			solid += MAX(0, chunks[i].heightmap[xy] - CAVE_ROOF - CAVE_FLOOR);
+	}
+	Uint64 t2 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++)
+		carve_chunk_blocks(&chunks[i], 1234);
+	Uint64 t3 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++) {
+		for (int xy = 0; xy < CHUNK_AREA; xy++) {
+			for (int z = CAVE_FLOOR; z < chunks[i].heightmap[xy] - CAVE_ROOF; z++)
+				hollow += chunk_get_block(&chunks[i], CHUNK_BLOCK_INDEX2(xy, z)).id == 0;
+		}
+	}
+
+	/* Full resolution noise for a few chunks, up to their highest surface. */
+	const int full = 4;
+	int32_t layer[CHUNK_AREA];
+	Uint64 t4 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < full; i++) {
+		int top = 0;
+		for (int xy = 0; xy < CHUNK_AREA; xy++)
+			top = MAX(top, chunks[i].heightmap[xy]);
+		for (int z = 0; z < top; z++)
+			noise3_grid(1234, chunks[i].loc[0] * CHUNK_WIDTH, chunks[i].loc[1] * CHUNK_WIDTH, z, CHUNK_WIDTH, CHUNK_WIDTH,
+				    CAVE_PERIOD * CAVE_STEP, CAVE_OCTAVES, layer);
+	}
+	Uint64 t5 = SDL_GetPerformanceCounter();
+
+	double us = 1e6 / SDL_GetPerformanceFrequency();
+	printf("per chunk: terrain %.1fus, carve %.1fus, full resolution noise %.1fus; %.1f%% hollowed\n", (t1 - t0) * us / n,
+	       (t3 - t2) * us / n, (t5 - t4) * us / full, 100.0 * hollow / solid);
+	for (int i = 0; i < n; i++)
+		chunk_free_blocks(&chunks[i]);
+	free(chunks);
+	exit(0);
+}
+#endif
@@ -0,0 +1,408 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tinycthread.h"
+#include "util.h"
+#include "world.h"
+
+/* Every block edit is recorded in a write-ahead journal, so edits survive a crash between
+ * autosaves. Edits are buffered and committed to the log in groups, each a header (magic, record
+ * count, checksum) followed by fixed size records; replay stops at the first group that doesn't
+ * check out, which is where a crash cut the log short. Edits are also kept in memory per chunk
+ * and applied to the chunk whenever it is loaded or generated. Once a snapshot of a chunk is
+ * written to its region file, the edits it covers are dropped. Compaction drops the edits later
+ * ones overwrite and writes the rest as the delta snapshot, which replaces the log.
+ *
+ * An edit either sets one block or fills a box of the chunk with one block, so applying a chunk's
+ * edits again on top of a copy that already has them changes nothing. A fill takes two records,
+ * the second holding its box. */
+#define JOURNAL_MAGIC 0x4a584c42 /* "BLXJ" */
+#define JOURNAL_RECORD_SIZE 16
+#define JOURNAL_COMMIT_MS 50
+#define JOURNAL_COMMIT_BYTES (64 << 10)
+#define JOURNAL_COMPACT_BYTES (4 << 20)
+#define JOURNAL_FILL 0xffffffffu /* the bi of a fill */
+
+typedef struct journal_edit_s {
+	uint32_t bi, seq;
+	block_instance_t inst;
+	uint16_t box[6]; /* of a fill: min x, y, z and max x, y, z, inclusive */
+} journal_edit_t;
+
+typedef struct journal_chunk_s {
+	int loc[2];
+	journal_edit_t *edits;
+	int num_edits, max_edits;
+} journal_chunk_t;
+
+/* The chunks with edits, sorted by location. Guarded by journal_mutex, as workers apply and drop
+ * edits. Everything else is only touched by the main thread. */
+static mtx_t journal_mutex;
+static journal_chunk_t *chunks;
+static int num_chunks, max_chunks;
+static uint32_t journal_next_seq = 1;
+
+static char *log_path, *snap_path;
+static FILE *log_file;
+static long log_size;
+static uint8_t *pending;
+static size_t pending_bytes, max_pending;
+static Uint32 last_commit;
+
+static uint32_t journal_checksum(const uint8_t *data, size_t length)
+{
+	uint32_t h = 2166136261u; /* FNV-1a */
+	for (size_t i = 0; i < length; i++)
+		h = (h ^ data[i]) * 16777619u;
+	return h;
+}
+
+static inline void put32(uint8_t *out, uint32_t v)
+{
+	v = SDL_SwapLE32(v);
+	memcpy(out, &v, 4);
+}
+
+static inline uint32_t get32(const uint8_t *in)
+{
+	uint32_t v;
+	memcpy(&v, in, 4);
+	return SDL_SwapLE32(v);
+}
+
+/* Returns the position of the chunk in the sorted array, or where it would be inserted. */
+static int journal_find(const int loc[2], bool *found)
+{
+	int lo = 0, hi = num_chunks;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		const int *l = chunks[mid].loc;
+		if (l[0] < loc[0] || (l[0] == loc[0] && l[1] < loc[1]))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < num_chunks && chunks[lo].loc[0] == loc[0] && chunks[lo].loc[1] == loc[1];
+	return lo;
+}
+
+/* Called with journal_mutex held. */
+static void journal_add_edit(const int loc[2], const journal_edit_t *edit)
+{
+	bool found;
+	int i = journal_find(loc, &found);
+	if (!found) {
+		if (num_chunks == max_chunks) {
+			max_chunks = max_chunks ? max_chunks * 2 : 64;
+			chunks = realloc(chunks, max_chunks * sizeof(journal_chunk_t));
+			assert(chunks);
+		}
+		memmove(&chunks[i + 1], &chunks[i], (num_chunks - i) * sizeof(journal_chunk_t));
+		chunks[i] = (journal_chunk_t){ .loc = { loc[0], loc[1] } };
+		num_chunks++;
+	}
+
+	journal_chunk_t *jc = &chunks[i];
+	if (jc->num_edits == jc->max_edits) {
+		jc->max_edits = jc->max_edits ? jc->max_edits * 2 : 16;
+		jc->edits = realloc(jc->edits, jc->max_edits * sizeof(journal_edit_t));
+		assert(jc->edits);
+	}
+	jc->edits[jc->num_edits++] = *edit;
+}
+
+static inline int edit_records(const journal_edit_t *edit)
+{
+	return edit->bi == JOURNAL_FILL ? 2 : 1;
+}
+
+/* Returns the end of the records. */
+static uint8_t *encode_edit(uint8_t *out, const int loc[2], const journal_edit_t *edit)
+{
+	put32(out, loc[0]);
+	put32(out + 4, loc[1]);
+	put32(out + 8, edit->bi);
+	out[12] = edit->inst.id & 0xff;
+	out[13] = edit->inst.id >> 8;
+	out[14] = edit->inst.state;
+	out[15] = edit->inst.skylight & 0xf;
+	out += JOURNAL_RECORD_SIZE;
+	if (edit->bi == JOURNAL_FILL) {
+		memset(out, 0, JOURNAL_RECORD_SIZE);
+		for (int i = 0; i < 6; i++) {
+			out[i * 2] = edit->box[i] & 0xff;
+			out[i * 2 + 1] = edit->box[i] >> 8;
+		}
+		out += JOURNAL_RECORD_SIZE;
+	}
+	return out;
+}
+
+static bool box_is_valid(const uint16_t box[6])
+{
+	return box[0] <= box[3] && box[3] < CHUNK_WIDTH && box[1] <= box[4] && box[4] < CHUNK_WIDTH && box[2] <= box[5] &&
+	       box[5] < CHUNK_HEIGHT;
+}
+
+/* Reads the groups of a log or snapshot into memory. */
+static void journal_replay(const char *path)
+{
+	size_t length = 0, pos = 0;
+	uint8_t *data = NULL;
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return;
+	if (fseek(f, 0, SEEK_END) == 0 && (length = ftell(f)) > 0 && fseek(f, 0, SEEK_SET) == 0) {
+		data = malloc(length);
+		if (data == NULL || fread(data, 1, length, f) != length)
+			length = 0;
+	}
+	fclose(f);
+
+	mtx_lock(&journal_mutex);
+	while (pos + 12 <= length) {
+		uint32_t count = get32(data + pos + 4);
+		if (get32(data + pos) != JOURNAL_MAGIC || count > (length - pos - 12) / JOURNAL_RECORD_SIZE ||
+		    journal_checksum(data + pos + 12, count * JOURNAL_RECORD_SIZE) != get32(data + pos + 8))
+			break;
+		const uint8_t *end = data + pos + 12 + count * JOURNAL_RECORD_SIZE;
+		for (const uint8_t *r = data + pos + 12; r < end; r += JOURNAL_RECORD_SIZE) {
+			int loc[2] = { (int32_t)get32(r), (int32_t)get32(r + 4) };
+			journal_edit_t edit = { .bi = get32(r + 8), .seq = journal_next_seq++ };
+			edit.inst = (block_instance_t){ .id = r[12] | r[13] << 8, .state = r[14], .skylight = (r[15] ^ 8) - 8 };
+			if (edit.bi == JOURNAL_FILL && r + 2 * JOURNAL_RECORD_SIZE <= end) {
+				r += JOURNAL_RECORD_SIZE;
+				for (int i = 0; i < 6; i++)
+					edit.box[i] = r[i * 2] | r[i * 2 + 1] << 8;
+				if (box_is_valid(edit.box))
+					journal_add_edit(loc, &edit);
+			} else if (edit.bi < CHUNK_TOTAL_BLOCKS)
+				journal_add_edit(loc, &edit);
+		}
+		pos += 12 + count * JOURNAL_RECORD_SIZE;
+	}
+	mtx_unlock(&journal_mutex);
+	if (pos < length)
+		fprintf(stderr, "Journal %s is cut short, ignoring its last %zu bytes\n", path, length - pos);
+	free(data);
+}
+
+/* Drops the edits of a chunk that later ones overwrite completely, going from the newest and
+ * marking the blocks each kept edit writes in covered. The rest keep their order. Returns the
+ * number of records left. */
+static size_t journal_collapse(journal_chunk_t *jc, uint32_t *covered)
+{
+	int kept = jc->num_edits;
+	for (int e = jc->num_edits - 1; e >= 0; e--) {
+		journal_edit_t *edit = &jc->edits[e];
+		uint16_t box[6];
+		if (edit->bi == JOURNAL_FILL)
+			memcpy(box, edit->box, sizeof(box));
+		else {
+			box[0] = box[3] = edit->bi % CHUNK_WIDTH;
+			box[1] = box[4] = edit->bi / CHUNK_WIDTH % CHUNK_WIDTH;
+			box[2] = box[5] = edit->bi / CHUNK_AREA;
+		}
+		bool overwritten = true;
+		for (int z = box[2]; z <= box[5]; z++) {
+			for (int y = box[1]; y <= box[4]; y++) {
+				for (int bi = CHUNK_BLOCK_INDEX(box[0], y, z); bi <= CHUNK_BLOCK_INDEX(box[3], y, z); bi++) {
+					overwritten = overwritten && (covered[bi >> 5] & (1u << (bi & 31)));
+					covered[bi >> 5] |= 1u << (bi & 31);
+				}
+			}
+		}
+		if (!overwritten)
+			jc->edits[--kept] = *edit;
+	}
+	jc->num_edits -= kept;
+	memmove(jc->edits, jc->edits + kept, jc->num_edits * sizeof(journal_edit_t));
+	memset(covered, 0, (CHUNK_TOTAL_BLOCKS + 31) / 32 * sizeof(uint32_t));
+
+	size_t records = 0;
+	for (int e = 0; e < jc->num_edits; e++)
+		records += edit_records(&jc->edits[e]);
+	return records;
+}
+
+/* Collapses every chunk's edits, writes them as the new snapshot and starts an empty log. */
+static void journal_compact(void)
+{
+	uint32_t *covered = calloc((CHUNK_TOTAL_BLOCKS + 31) / 32, sizeof(uint32_t));
+	assert(covered);
+	mtx_lock(&journal_mutex);
+	size_t count = 0;
+	for (int i = 0; i < num_chunks; i++)
+		count += journal_collapse(&chunks[i], covered);
+	free(covered);
+
+	uint8_t *data = malloc(12 + count * JOURNAL_RECORD_SIZE), *out = data + 12;
+	assert(data);
+	for (int i = 0; i < num_chunks; i++) {
+		for (int e = 0; e < chunks[i].num_edits; e++)
+			out = encode_edit(out, chunks[i].loc, &chunks[i].edits[e]);
+	}
+	mtx_unlock(&journal_mutex);
+	put32(data, JOURNAL_MAGIC);
+	put32(data + 4, count);
+	put32(data + 8, journal_checksum(data + 12, count * JOURNAL_RECORD_SIZE));
+
+	/* The new snapshot replaces the old one before the log is emptied, so a crash in between
+	 * only means the log is replayed again on top of it. */
+	char *tmp_path = malloc(strlen(snap_path) + 5);
+	sprintf(tmp_path, "%s.tmp", snap_path);
+	FILE *f = fopen(tmp_path, "wb");
+	bool ok = f && fwrite(data, 1, 12 + count * JOURNAL_RECORD_SIZE, f) == 12 + count * JOURNAL_RECORD_SIZE;
+	ok = f && fclose(f) == 0 && ok;
+#ifdef _WIN32
+	if (ok)
+		remove(snap_path); /* rename() doesn't replace files there */
+#endif
+	if (ok && rename(tmp_path, snap_path) == 0) {
+		if (log_file)
+			fclose(log_file);
+		log_file = fopen(log_path, "wb");
+		log_size = 0;
+	} else {
+		fprintf(stderr, "Can't write journal snapshot %s\n", snap_path);
+		remove(tmp_path);
+	}
+	free(tmp_path);
+	free(data);
+}
+
+void journal_init(const char *save_dir)
+{
+	mtx_init(&journal_mutex, mtx_plain);
+	if (save_dir == NULL)
+		return;
+	log_path = real_path_join(save_dir, "journal.log");
+	snap_path = real_path_join(save_dir, "journal.snap");
+
+	journal_replay(snap_path);
+	journal_replay(log_path);
+	journal_compact();
+	if (log_file == NULL)
+		fprintf(stderr, "Can't open journal %s, edits won't survive a crash\n", log_path);
+}
+
+static void journal_record_edit(const int loc[2], journal_edit_t *edit)
+{
+	mtx_lock(&journal_mutex);
+	edit->seq = journal_next_seq++;
+	journal_add_edit(loc, edit);
+	mtx_unlock(&journal_mutex);
+
+	if (log_file == NULL)
+		return;
+	if (pending_bytes == 0)
+		pending_bytes = 12; /* room for the group header */
+	while (pending_bytes + 2 * JOURNAL_RECORD_SIZE > max_pending) {
+		max_pending = max_pending ? max_pending * 2 : 4096;
+		pending = realloc(pending, max_pending);
+		assert(pending);
+	}
+	pending_bytes = encode_edit(pending + pending_bytes, loc, edit) - pending;
+	if (pending_bytes >= JOURNAL_COMMIT_BYTES)
+		journal_commit(true);
+}
+
+/* Records an edit made by world_set_block(). Main thread only. */
+void journal_record(const int loc[2], int bi, block_instance_t inst)
+{
+	journal_edit_t edit = { .bi = bi, .inst = inst };
+	journal_record_edit(loc, &edit);
+}
+
+/* Records a fill of a box of chunk-local coordinates, corners inclusive, made by the bulk edits.
+ * Main thread only. */
+void journal_record_fill(const int loc[2], const int min[3], const int max[3], block_instance_t inst)
+{
+	journal_edit_t edit = { .bi = JOURNAL_FILL, .inst = inst };
+	for (int i = 0; i < 3; i++) {
+		edit.box[i] = min[i];
+		edit.box[i + 3] = max[i];
+	}
+	assert(box_is_valid(edit.box));
+	journal_record_edit(loc, &edit);
+}
+
+/* Appends the buffered edits to the log as one group, at most every JOURNAL_COMMIT_MS unless
+ * forced. The log is flushed but not synced, so it survives the game crashing, not the system. */
+void journal_commit(bool force)
+{
+	Uint32 now = SDL_GetTicks();
+	if (log_file == NULL || pending_bytes == 0 || (!force && now - last_commit < JOURNAL_COMMIT_MS))
+		return;
+	last_commit = now;
+
+	size_t count = (pending_bytes - 12) / JOURNAL_RECORD_SIZE;
+	put32(pending, JOURNAL_MAGIC);
+	put32(pending + 4, count);
+	put32(pending + 8, journal_checksum(pending + 12, pending_bytes - 12));
+	if (fwrite(pending, 1, pending_bytes, log_file) != pending_bytes || fflush(log_file) != 0)
+		fprintf(stderr, "Can't write journal %s\n", log_path);
+	log_size += pending_bytes;
+	pending_bytes = 0;
+
+	if (log_size > JOURNAL_COMPACT_BYTES)
+		journal_compact();
+}
+
+/* The sequence number the next edit will get. A snapshot taken now covers every edit before it. */
+uint32_t journal_seq(void)
+{
+	return journal_next_seq;
+}
+
+/* Applies the recorded edits of a chunk that was just loaded or generated. */
+void journal_apply(chunk_t *chunk)
+{
+	bool found;
+	mtx_lock(&journal_mutex);
+	int i = journal_find(chunk->loc, &found);
+	for (int e = 0; found && e < chunks[i].num_edits; e++) {
+		const journal_edit_t *edit = &chunks[i].edits[e];
+		if (edit->bi == JOURNAL_FILL) {
+			int min[3] = { edit->box[0], edit->box[1], edit->box[2] }, max[3] = { edit->box[3], edit->box[4], edit->box[5] };
+			chunk_fill_box(chunk, min, max, edit->inst);
+		} else
+			chunk_set_block(chunk, edit->bi, edit->inst);
+	}
+	mtx_unlock(&journal_mutex);
+}
+
+/* Drops the edits of a chunk made before seq, once a snapshot covering them is on disk. */
+void journal_retire(const int loc[2], uint32_t seq)
+{
+	bool found;
+	mtx_lock(&journal_mutex);
+	int i = journal_find(loc, &found);
+	if (found) {
+		journal_chunk_t *jc = &chunks[i];
+		int n = 0;
+		for (int e = 0; e < jc->num_edits; e++) {
+			if (jc->edits[e].seq >= seq)
+				jc->edits[n++] = jc->edits[e];
+		}
+		jc->num_edits = n;
+		if (n == 0) {
+			free(jc->edits);
+			memmove(&chunks[i], &chunks[i + 1], (num_chunks - i - 1) * sizeof(journal_chunk_t));
+			num_chunks--;
+		}
+	}
+	mtx_unlock(&journal_mutex);
+}
+
+/* Commits what is buffered and compacts the journal. Call once every save has been written. */
+void journal_close(void)
+{
+	journal_commit(true);
+	if (log_file) {
+		journal_compact();
+		fclose(log_file);
+		log_file = NULL;
+	}
+}
@@ -0,0 +1,317 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util.h"
+#include "world.h"
+
+static inline int palette_data_words(int bits, int size)
+{
+	return (bits * size + 31) / 32;
+}
+
+static inline void palette_store(uint32_t *data, int bits, int index, uint32_t value)
+{
+	int bit = index * bits, shift = bit & 31;
+	uint32_t mask = ((1u << bits) - 1) << shift;
+	data[bit >> 5] = (data[bit >> 5] & ~mask) | (value << shift);
+}
+
+void palette_init(palette_t *p, int size, block_instance_t fill)
+{
+	assert(size < 1 << 16);
+	memset(p, 0, sizeof(palette_t));
+	p->size = size;
+	if (fill.id != 0 || fill.state != 0 || fill.skylight != 0) {
+		p->entries = malloc(sizeof(block_instance_t));
+		assert(p->entries);
+		p->entries[0] = fill;
+		p->num_entries = p->max_entries = 1;
+	}
+}
+
+void palette_free(palette_t *p)
+{
+	free(p->entries);
+	free(p->data);
+	p->entries = NULL;
+	p->data = NULL;
+	p->num_entries = p->max_entries = 0;
+	p->bits = 0;
+}
+
+void palette_copy(palette_t *dst, const palette_t *src)
+{
+	palette_init(dst, src->size, (block_instance_t){ 0 });
+	if (src->num_entries > 0) {
+		dst->entries = malloc(src->num_entries * sizeof(block_instance_t));
+		assert(dst->entries);
+		memcpy(dst->entries, src->entries, src->num_entries * sizeof(block_instance_t));
+		dst->num_entries = dst->max_entries = src->num_entries;
+	}
+	if (src->bits > 0) {
+		size_t bytes = palette_data_words(src->bits, src->size) * sizeof(uint32_t);
+		dst->data = malloc(bytes);
+		assert(dst->data);
+		memcpy(dst->data, src->data, bytes);
+		dst->bits = src->bits;
+	}
+}
+
+size_t palette_memory_usage(const palette_t *p)
+{
+	return p->max_entries * sizeof(block_instance_t) + palette_data_words(p->bits, p->size) * sizeof(uint32_t);
+}
+
+/* Widens every index to the next supported width. Indexes never straddle a word because the
+ * widths all divide 32. */
+static void palette_grow(palette_t *p)
+{
+	int new_bits = p->bits == 0 ? 1 : p->bits * 2;
+	assert(new_bits <= 16);
+	uint32_t *nd = calloc(palette_data_words(new_bits, p->size), sizeof(uint32_t));
+	assert(nd);
+	if (p->data) {
+		for (int i = 0; i < p->size; i++)
+			palette_store(nd, new_bits, i, palette_index(p, i));
+		free(p->data);
+	}
+	p->data = nd;
+	p->bits = new_bits;
+}
+
+/* Entries are never removed as cells are overwritten, so a palette at the widest indexes can fill
+ * up with blocks no cell holds any more. Drops those, keeping the rest in order. There are fewer
+ * cells than 16 bit indexes, so at least one entry goes. */
+static void palette_prune(palette_t *p)
+{
+	uint32_t *remap = calloc(p->num_entries, sizeof(uint32_t));
+	assert(remap);
+	for (int i = 0; i < p->size; i++)
+		remap[palette_index(p, i)] = 1;
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < p->num_entries; i++) {
+		if (remap[i]) {
+			p->entries[n] = p->entries[i];
+			remap[i] = n++;
+		}
+	}
+	for (int i = 0; i < p->size; i++)
+		palette_store(p->data, p->bits, i, remap[palette_index(p, i)]);
+	free(remap);
+	assert(n < p->num_entries);
+	p->num_entries = n;
+	p->hint = 0;
+}
+
+/* Returns the palette index of the block, adding it if it isn't present yet. */
+static int palette_lookup_or_add(palette_t *p, block_instance_t v)
+{
+	if (p->num_entries == 0) {
+		/* A zeroed palette is all air; make that explicit before anything else is added. */
+		p->entries = calloc(2, sizeof(block_instance_t));
+		assert(p->entries);
+		p->num_entries = 1;
+		p->max_entries = 2;
+	}
+	/* Writes tend to come in runs of the same block, so try the last match first. */
+	if (p->hint < p->num_entries && block_instance_equal(p->entries[p->hint], v))
+		return p->hint;
+	for (uint32_t i = 0; i < p->num_entries; i++) {
+		if (block_instance_equal(p->entries[i], v))
+			return p->hint = i;
+	}
+
+	if (p->bits == 16 && p->num_entries == 1 << 16)
+		palette_prune(p);
+	if (p->num_entries == p->max_entries) {
+		block_instance_t *ne = realloc(p->entries, p->max_entries * 2 * sizeof(block_instance_t));
+		assert(ne);
+		p->entries = ne;
+		p->max_entries *= 2;
+	}
+	if (p->num_entries >= 1u << p->bits)
+		palette_grow(p);
+	p->entries[p->num_entries] = v;
+	return p->hint = p->num_entries++;
+}
+
+void palette_set(palette_t *p, int index, block_instance_t v)
+{
+	if (p->bits == 0 && block_instance_equal(palette_get(p, index), v))
+		return;
+	int pi = palette_lookup_or_add(p, v);
+	palette_store(p->data, p->bits, index, pi);
+}
+
+void palette_fill(palette_t *p, int start, int count, block_instance_t v)
+{
+	if (count <= 0)
+		return;
+	if (start == 0 && count == p->size) {
+		palette_free(p);
+		palette_init(p, count, v);
+		return;
+	}
+	if (p->bits == 0 && block_instance_equal(palette_get(p, start), v))
+		return;
+
+	int pi = palette_lookup_or_add(p, v), i = start, end = start + count;
+	/* Fill partial words one index at a time, and whole words with a replicated pattern. */
+	int per_word = 32 / p->bits;
+	while (i < end && i % per_word != 0)
+		palette_store(p->data, p->bits, i++, pi);
+	if (i + per_word <= end) {
+		uint32_t pattern = 0;
+		for (int j = 0; j < per_word; j++)
+			pattern |= (uint32_t)pi << (j * p->bits);
+		for (; i + per_word <= end; i += per_word)
+			p->data[i * p->bits >> 5] = pattern;
+	}
+	while (i < end)
+		palette_store(p->data, p->bits, i++, pi);
+}
+
+/* Drops the index data if every cell holds the same block, returning whether it did. */
+bool palette_compact(palette_t *p)
+{
+	if (p->bits == 0)
+		return true;
+	int first = palette_index(p, 0);
+	for (int i = 1; i < p->size; i++) {
+		if (palette_index(p, i) != first)
+			return false;
+	}
+	block_instance_t v = p->entries[first];
+	palette_free(p);
+	palette_init(p, p->size, v);
+	return true;
+}
+
+/* The encoded form is the index width, the entry count, the entries and the packed index words,
+ * all little endian. The count's third byte comes second, in what used to be padding, so older
+ * saves read the same. An entry is its id, state and skylight in four bytes. */
+size_t palette_encoded_size(const palette_t *p)
+{
+	return 4 + p->num_entries * 4 + palette_data_words(p->bits, p->size) * sizeof(uint32_t);
+}
+
+uint8_t *palette_encode(const palette_t *p, uint8_t *out)
+{
+	*out++ = p->bits;
+	*out++ = p->num_entries >> 16;
+	*out++ = p->num_entries & 0xff;
+	*out++ = p->num_entries >> 8 & 0xff;
+	for (uint32_t i = 0; i < p->num_entries; i++) {
+		*out++ = p->entries[i].id & 0xff;
+		*out++ = p->entries[i].id >> 8;
+		*out++ = p->entries[i].state;
+		*out++ = p->entries[i].skylight & 0xf;
+	}
+	for (int i = 0, words = palette_data_words(p->bits, p->size); i < words; i++) {
+		uint32_t w = SDL_SwapLE32(p->data[i]);
+		memcpy(out, &w, sizeof(w));
+		out += sizeof(w);
+	}
+	return out;
+}
+
+/* Returns the end of the encoded palette, or NULL if it is malformed, in which case p is left
+ * empty. An index past the entry count can only come from a damaged file, so for the narrow
+ * widths the entries are padded to cover every index, which then reads as air; 16 bit indexes
+ * are checked instead. */
+const uint8_t *palette_decode(palette_t *p, int size, const uint8_t *in, const uint8_t *end)
+{
+	memset(p, 0, sizeof(palette_t));
+	p->size = size;
+	if (end - in < 4)
+		return NULL;
+	int bits = in[0], num_entries = in[2] | in[3] << 8 | in[1] << 16, words = palette_data_words(bits, size);
+	in += 4;
+	if ((bits != 0 && bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16) ||
+	    num_entries > (1 << bits) || (bits != 0 && num_entries == 0) ||
+	    end - in < num_entries * 4 + words * (ptrdiff_t)sizeof(uint32_t))
+		return NULL;
+
+	if (num_entries > 0) {
+		int max_entries = bits < 16 ? 1 << bits : num_entries;
+		p->entries = calloc(max_entries, sizeof(block_instance_t));
+		assert(p->entries);
+		for (int i = 0; i < num_entries; i++, in += 4)
+			p->entries[i] = (block_instance_t){ .id = in[0] | in[1] << 8, .state = in[2], .skylight = (in[3] ^ 8) - 8 };
+		p->num_entries = num_entries;
+		p->max_entries = max_entries;
+	}
+	if (bits > 0) {
+		p->data = malloc(words * sizeof(uint32_t));
+		assert(p->data);
+		for (int i = 0; i < words; i++, in += sizeof(uint32_t)) {
+			memcpy(&p->data[i], in, sizeof(uint32_t));
+			p->data[i] = SDL_SwapLE32(p->data[i]);
+		}
+		p->bits = bits;
+		for (int i = 0; bits == 16 && i < size; i++) {
+			if (palette_index(p, i) >= num_entries) {
+				palette_free(p);
+				return NULL;
+			}
+		}
+	}
+	return in;
+}
+
+#if 0
+#include <stdio.h>
+/* Compares the palettes against the flat block_instance_t array they replaced, on a chunk shaped
+ * like generated terrain: a few distinct blocks, with one added midway through the writes. The
+ * chunk has a palette per section, as chunk_t does. */
+#define BENCH_GET(pal, idx) palette_get(&(pal)[(idx) / CHUNK_SECTION_BLOCKS], (idx) % CHUNK_SECTION_BLOCKS)
+#define BENCH_SET(pal, idx, inst) palette_set(&(pal)[(idx) / CHUNK_SECTION_BLOCKS], (idx) % CHUNK_SECTION_BLOCKS, inst)
+
+void palette_bench()
+{
+	const int n = CHUNK_TOTAL_BLOCKS, ops = 20000000;
+	block_instance_t *flat = calloc(n, sizeof(block_instance_t)), blocks[4] = { { .id = 1 }, { .id = 2 }, { .id = 3 }, { .id = 7 } };
+	palette_t pal[CHUNK_SECTIONS];
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		palette_init(&pal[s], CHUNK_SECTION_BLOCKS, (block_instance_t){ 0 });
+	for (int i = 0; i < CHUNK_AREA * 4; i++) {
+		flat[i] = blocks[i / CHUNK_AREA % 3];
+		BENCH_SET(pal, i, blocks[i / CHUNK_AREA % 3]);
+	}
+
+	for (int pattern = 0; pattern < 4; pattern++) {
+		bool random = pattern & 1, write = pattern & 2;
+		unsigned seed = 1, sum = 0;
+		Uint64 t0 = SDL_GetPerformanceCounter();
+		for (int i = 0; i < ops; i++) {
+			int idx = random ? (seed = seed * 1103515245 + 12345) % n : i % n;
+			if (write)
+				flat[idx] = blocks[(idx >> 3) & 3];
+			else
+				sum += flat[idx].id;
+		}
+		Uint64 t1 = SDL_GetPerformanceCounter();
+		seed = 1;
+		for (int i = 0; i < ops; i++) {
+			int idx = random ? (seed = seed * 1103515245 + 12345) % n : i % n;
+			if (write)
+				BENCH_SET(pal, idx, blocks[(idx >> 3) & 3]);
+			else
+				sum += BENCH_GET(pal, idx).id;
+		}
+		Uint64 t2 = SDL_GetPerformanceCounter();
+		printf("%s %s: flat %.0f Mops/s, palette %.0f Mops/s (%u)\n", random ? "random    " : "sequential", write ? "write" : "read ",
+		       ops / (1e6 * (t1 - t0) / SDL_GetPerformanceFrequency()), ops / (1e6 * (t2 - t1) / SDL_GetPerformanceFrequency()), sum);
+	}
+	size_t bytes = 0;
+	int bits = 0;
+	for (int s = 0; s < CHUNK_SECTIONS; s++) {
+		bytes += palette_memory_usage(&pal[s]);
+		bits = MAX(bits, pal[s].bits);
+		palette_free(&pal[s]);
+	}
+	printf("memory: flat %zu bytes, palettes %zu bytes (up to %d bits per block)\n", n * sizeof(block_instance_t), bytes, bits);
+	free(flat);
+	exit(0);
+}
+#endif
@@ -0,0 +1,485 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <physfs.h>
+#include "tinycthread.h"
+#include "util.h"
+#include "world.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#define STBI_WRITE_NO_STDIO
+#include "stb_image_write.h"
+#include "stb_image.h"
+
+/* A region file holds the chunks of a REGION_WIDTH x REGION_WIDTH square. Each stored chunk is its
+ * encoded sections, compressed with zlib. All access goes through PhysFS, which only appends to a
+ * file or replaces it whole, so the file is a log: every batch of writes appends its chunks and
+ * then an index of one (offset, length) pair per chunk, followed by a generation, a checksum of
+ * the index, a version and a magic number, all little endian 32 bit words. A length of zero means
+ * the chunk isn't stored. The index at the end of the file is the current one; if a crash cut the
+ * last batch short, the latest complete index before it is used, and the torn tail is just space
+ * lost until the next compaction.
+ *
+ * A region has two file names, and compaction copies the live chunks to the other one with the
+ * next generation, then deletes the old file. If both are found, the valid one with the higher
+ * generation wins and the other is left over from an interrupted compaction. A file with no valid
+ * index at all is copied aside for inspection and the region starts afresh, rather than every
+ * later save to it failing. Files are compacted once the space lost to old copies and indexes
+ * outweighs the live data. */
+#define REGION_CHUNKS (REGION_WIDTH * REGION_WIDTH)
+#define REGION_MAGIC 0x52584c42 /* "BLXR" */
+#define REGION_VERSION 2
+#define REGION_INDEX_WORDS (REGION_CHUNKS * 2 + 4)
+#define REGION_INDEX_SIZE (REGION_INDEX_WORDS * 4)
+#define REGION_MOUNT "/save" /* where the save directory is mounted for reading */
+#define REGION_CACHE_SIZE 16         /* open regions */
+#define REGION_COMPACT_MIN (1 << 20) /* never compact files wasting less than this */
+#define REGION_COMPRESSION_LEVEL 5
+
+typedef struct region_s {
+	int loc[2];
+	int slot; /* which of the region's two file names it is in */
+	uint32_t generation;
+	bool used;
+	PHYSFS_File *reader, *writer; /* opened when first needed */
+	unsigned last_used;
+	uint32_t offsets[REGION_CHUNKS], lengths[REGION_CHUNKS];
+	long end, live_bytes; /* end is the size of the file, 0 if there is none yet */
+} region_t;
+
+/* All file access is serialized by one mutex. It is held for the reads and writes only; chunks
+ * are compressed and decompressed outside of it. */
+static mtx_t region_mutex;
+static region_t regions[REGION_CACHE_SIZE], region_scratch;
+static unsigned region_clock;
+static bool region_enabled;
+
+static inline void region_locate(const int loc[2], int rloc[2], int *index)
+{
+	int off[2];
+	for (int i = 0; i < 2; i++) {
+		rloc[i] = (loc[i] >= 0 ? loc[i] : loc[i] - REGION_WIDTH + 1) / REGION_WIDTH;
+		off[i] = loc[i] - rloc[i] * REGION_WIDTH;
+	}
+	*index = off[0] + off[1] * REGION_WIDTH;
+}
+
+/* The PhysFS path of one of a region's files, in the write directory or, with mounted set, where
+ * it is read from. */
+static void region_path(char *path, size_t size, const int rloc[2], int slot, bool mounted)
+{
+	if (slot < 0)
+		snprintf(path, size, "%sregions/r.%d.%d.damaged", mounted ? REGION_MOUNT "/" : "", rloc[0], rloc[1]);
+	else
+		snprintf(path, size, "%sregions/r.%d.%d.%d.bin", mounted ? REGION_MOUNT "/" : "", rloc[0], rloc[1], slot);
+}
+
+/* FNV-1a over the index entries and the generation. */
+static uint32_t region_checksum(const uint32_t *words, int count)
+{
+	uint32_t hash = 0x811c9dc5;
+	for (int i = 0; i < count; i++) {
+		for (int b = 0; b < 32; b += 8)
+			hash = (hash ^ (words[i] >> b & 0xff)) * 0x01000193;
+	}
+	return hash;
+}
+
+static void region_encode_index(const uint32_t *offsets, const uint32_t *lengths, uint32_t generation, uint32_t out[REGION_INDEX_WORDS])
+{
+	for (int i = 0; i < REGION_CHUNKS; i++) {
+		out[i * 2] = offsets[i];
+		out[i * 2 + 1] = lengths[i];
+	}
+	out[REGION_CHUNKS * 2] = generation;
+	out[REGION_CHUNKS * 2 + 1] = region_checksum(out, REGION_CHUNKS * 2 + 1);
+	out[REGION_CHUNKS * 2 + 2] = REGION_VERSION;
+	out[REGION_CHUNKS * 2 + 3] = REGION_MAGIC;
+	for (int i = 0; i < REGION_INDEX_WORDS; i++)
+		out[i] = SDL_SwapLE32(out[i]);
+}
+
+/* Reads the index stored at pos, as bytes from the file, into the region if it is valid. */
+static bool region_decode_index(region_t *r, const uint8_t *bytes, long pos)
+{
+	uint32_t words[REGION_INDEX_WORDS];
+	memcpy(words, bytes, REGION_INDEX_SIZE);
+	for (int i = 0; i < REGION_INDEX_WORDS; i++)
+		words[i] = SDL_SwapLE32(words[i]);
+	if (words[REGION_CHUNKS * 2 + 3] != REGION_MAGIC || words[REGION_CHUNKS * 2 + 2] != REGION_VERSION ||
+	    words[REGION_CHUNKS * 2 + 1] != region_checksum(words, REGION_CHUNKS * 2 + 1))
+		return false;
+	for (int i = 0; i < REGION_CHUNKS; i++) {
+		if (words[i * 2 + 1] != 0 && words[i * 2] + (long)words[i * 2 + 1] > pos)
+			return false;
+	}
+
+	r->live_bytes = 0;
+	for (int i = 0; i < REGION_CHUNKS; i++) {
+		r->offsets[i] = words[i * 2];
+		r->lengths[i] = words[i * 2 + 1];
+		r->live_bytes += r->lengths[i];
+	}
+	r->generation = words[REGION_CHUNKS * 2];
+	return true;
+}
+
+/* Finds the latest complete index of one of the region's files and reads it into r, returning
+ * false if the file has none. Usually that is the one at the very end; otherwise the file is
+ * searched backwards for one. */
+static bool region_read_index(region_t *r, int slot)
+{
+	char path[96];
+	region_path(path, sizeof(path), r->loc, slot, true);
+	PHYSFS_File *f = PHYSFS_openRead(path);
+	if (f == NULL)
+		return false;
+	uint8_t bytes[REGION_INDEX_SIZE];
+	long length = PHYSFS_fileLength(f);
+	bool ok = length >= REGION_INDEX_SIZE && PHYSFS_seek(f, length - REGION_INDEX_SIZE) != 0 &&
+		  PHYSFS_readBytes(f, bytes, REGION_INDEX_SIZE) == REGION_INDEX_SIZE &&
+		  region_decode_index(r, bytes, length - REGION_INDEX_SIZE);
+	PHYSFS_close(f);
+
+	if (!ok && length > REGION_INDEX_SIZE) {
+		size_t size;
+		uint8_t *data = read_physfs_file(path, &size), magic[4];
+		uint32_t m = SDL_SwapLE32(REGION_MAGIC);
+		memcpy(magic, &m, 4);
+		for (long pos = (long)size - REGION_INDEX_SIZE; data && pos >= 0 && !ok; pos--) {
+			if (memcmp(data + pos + REGION_INDEX_SIZE - 4, magic, 4) == 0)
+				ok = region_decode_index(r, data + pos, pos);
+		}
+		free(data);
+		if (ok)
+			fprintf(stderr, "Region file %s was cut short, using its last complete index\n", path);
+	}
+	if (ok) {
+		r->slot = slot;
+		r->end = length;
+	}
+	return ok;
+}
+
+/* Copies a damaged file to the side and deletes it. */
+static void region_move_aside(const int rloc[2], int slot)
+{
+	char path[96], aside[96];
+	size_t size;
+	region_path(path, sizeof(path), rloc, slot, true);
+	region_path(aside, sizeof(aside), rloc, -1, false);
+	fprintf(stderr, "Region file %s is damaged, moving it to %s and starting the region afresh\n", path, aside);
+	void *data = read_physfs_file(path, &size);
+	PHYSFS_File *f = data ? PHYSFS_openWrite(aside) : NULL;
+	if (f) {
+		PHYSFS_writeBytes(f, data, size);
+		PHYSFS_close(f);
+	}
+	free(data);
+	region_path(path, sizeof(path), rloc, slot, false);
+	PHYSFS_delete(path);
+}
+
+/* Reads the region's index from whichever of its files is current, and deletes the other. */
+static void region_load(region_t *r)
+{
+	bool exists[2], valid[2];
+	char path[96];
+	for (int slot = 0; slot < 2; slot++) {
+		region_path(path, sizeof(path), r->loc, slot, true);
+		exists[slot] = PHYSFS_exists(path);
+	}
+	region_scratch.loc[0] = r->loc[0];
+	region_scratch.loc[1] = r->loc[1];
+	valid[0] = exists[0] && region_read_index(r, 0);
+	valid[1] = exists[1] && region_read_index(&region_scratch, 1);
+	if (valid[1] && (!valid[0] || region_scratch.generation > r->generation)) {
+		memcpy(r->offsets, region_scratch.offsets, sizeof(r->offsets));
+		memcpy(r->lengths, region_scratch.lengths, sizeof(r->lengths));
+		r->slot = 1;
+		r->generation = region_scratch.generation;
+		r->end = region_scratch.end;
+		r->live_bytes = region_scratch.live_bytes;
+	}
+
+	for (int slot = 0; slot < 2; slot++) {
+		if (!exists[slot] || (valid[slot] && slot == r->slot))
+			continue;
+		if (valid[0] || valid[1]) {
+			region_path(path, sizeof(path), r->loc, slot, false);
+			PHYSFS_delete(path);
+		} else
+			region_move_aside(r->loc, slot);
+	}
+	if (!valid[0] && !valid[1]) {
+		memset(r->offsets, 0, sizeof(r->offsets));
+		memset(r->lengths, 0, sizeof(r->lengths));
+		r->slot = 0;
+		r->generation = 0;
+		r->end = r->live_bytes = 0;
+	}
+}
+
+static void region_close(region_t *r)
+{
+	if (r->reader)
+		PHYSFS_close(r->reader);
+	if (r->writer)
+		PHYSFS_close(r->writer);
+	r->reader = r->writer = NULL;
+	r->used = false;
+}
+
+/* Returns the cached region, reading its index if it isn't cached yet. Called with region_mutex
+ * held. */
+static region_t *region_open(const int rloc[2])
+{
+	region_t *r = NULL;
+	for (int i = 0; i < REGION_CACHE_SIZE; i++) {
+		if (regions[i].used && regions[i].loc[0] == rloc[0] && regions[i].loc[1] == rloc[1]) {
+			r = &regions[i];
+			break;
+		}
+	}
+
+	if (r == NULL) {
+		r = &regions[0];
+		for (int i = 1; i < REGION_CACHE_SIZE && r->used; i++) {
+			if (!regions[i].used || regions[i].last_used < r->last_used)
+				r = &regions[i];
+		}
+		region_close(r);
+		r->loc[0] = rloc[0];
+		r->loc[1] = rloc[1];
+		region_load(r);
+		r->used = true;
+	}
+	r->last_used = ++region_clock;
+	return r;
+}
+
+/* Copies the live chunks to the region's other file, which then replaces this one. */
+static void region_compact(region_t *r)
+{
+	char path[96], old_path[96];
+	uint32_t offsets[REGION_CHUNKS], index[REGION_INDEX_WORDS];
+	long end = 0;
+	region_path(path, sizeof(path), r->loc, 1 - r->slot, false);
+	if (r->writer)
+		PHYSFS_close(r->writer);
+	r->writer = NULL;
+	if (r->reader == NULL) {
+		region_path(old_path, sizeof(old_path), r->loc, r->slot, true);
+		r->reader = PHYSFS_openRead(old_path);
+	}
+	PHYSFS_File *f = PHYSFS_openWrite(path);
+	bool ok = f != NULL && r->reader != NULL;
+	for (int i = 0; i < REGION_CHUNKS && ok; i++) {
+		offsets[i] = r->lengths[i] ? end : 0;
+		if (r->lengths[i] == 0)
+			continue;
+		void *buf = malloc(r->lengths[i]);
+		ok = buf && PHYSFS_seek(r->reader, r->offsets[i]) != 0 &&
+		     PHYSFS_readBytes(r->reader, buf, r->lengths[i]) == r->lengths[i] &&
+		     PHYSFS_writeBytes(f, buf, r->lengths[i]) == r->lengths[i];
+		free(buf);
+		end += r->lengths[i];
+	}
+	if (ok) {
+		region_encode_index(offsets, r->lengths, r->generation + 1, index);
+		ok = PHYSFS_writeBytes(f, index, REGION_INDEX_SIZE) == REGION_INDEX_SIZE && PHYSFS_flush(f) != 0;
+	}
+	if (f && PHYSFS_close(f) == 0)
+		ok = false;
+
+	if (ok) {
+		PHYSFS_close(r->reader);
+		r->reader = NULL;
+		region_path(old_path, sizeof(old_path), r->loc, r->slot, false);
+		PHYSFS_delete(old_path);
+		memcpy(r->offsets, offsets, sizeof(offsets));
+		r->slot = 1 - r->slot;
+		r->generation++;
+		r->end = end + REGION_INDEX_SIZE;
+	} else {
+		fprintf(stderr, "Compacting region file %s failed\n", path);
+		PHYSFS_delete(path);
+	}
+}
+
+/* Appends the compressed chunks of a batch and then an index pointing at them, and flushes. On
+ * failure the region is closed, so that it is read again from what made it to the file. Called
+ * with region_mutex held. */
+static bool region_write(region_t *r, region_write_t **writes, int count)
+{
+	char path[96];
+	uint32_t offsets[REGION_CHUNKS], lengths[REGION_CHUNKS], index[REGION_INDEX_WORDS];
+	long end = r->end, live_bytes = r->live_bytes;
+	if (r->writer == NULL) {
+		region_path(path, sizeof(path), r->loc, r->slot, false);
+		if ((r->writer = PHYSFS_openAppend(path)) == NULL) {
+			fprintf(stderr, "Can't write region file %s: %s\n", path, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+			return false;
+		}
+	}
+
+	memcpy(offsets, r->offsets, sizeof(offsets));
+	memcpy(lengths, r->lengths, sizeof(lengths));
+	bool ok = true;
+	for (int i = 0; i < count && ok; i++) {
+		int rloc[2], ci;
+		region_locate(writes[i]->loc, rloc, &ci);
+		ok = PHYSFS_writeBytes(r->writer, writes[i]->data, writes[i]->length) == writes[i]->length;
+		live_bytes += (long)writes[i]->length - lengths[ci];
+		offsets[ci] = end;
+		lengths[ci] = writes[i]->length;
+		end += writes[i]->length;
+	}
+	region_encode_index(offsets, lengths, r->generation, index);
+	if (!ok || PHYSFS_writeBytes(r->writer, index, REGION_INDEX_SIZE) != REGION_INDEX_SIZE || PHYSFS_flush(r->writer) == 0) {
+		region_close(r);
+		return false;
+	}
+	memcpy(r->offsets, offsets, sizeof(offsets));
+	memcpy(r->lengths, lengths, sizeof(lengths));
+	r->end = end + REGION_INDEX_SIZE;
+	r->live_bytes = live_bytes;
+
+	long wasted = r->end - REGION_INDEX_SIZE - r->live_bytes;
+	if (wasted > REGION_COMPACT_MIN && wasted > r->live_bytes)
+		region_compact(r);
+	return true;
+}
+
+static int compare_region_writes(const void *a, const void *b)
+{
+	const region_write_t *w1 = *(region_write_t *const *)a, *w2 = *(region_write_t *const *)b;
+	int r1[2], r2[2], i1, i2;
+	region_locate(w1->loc, r1, &i1);
+	region_locate(w2->loc, r2, &i2);
+	if (r1[0] != r2[0])
+		return (r1[0] > r2[0]) - (r1[0] < r2[0]);
+	return (r1[1] > r2[1]) - (r1[1] < r2[1]);
+}
+
+/****************************************************************************/
+
+static uint8_t *chunk_encode(const palette_t sections[CHUNK_SECTIONS], size_t *length)
+{
+	size_t size = 0;
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		size += palette_encoded_size(&sections[s]);
+	uint8_t *data = malloc(size), *out = data;
+	assert(data);
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		out = palette_encode(&sections[s], out);
+	*length = size;
+	return data;
+}
+
+/* Decodes into the chunk's sections, which must be empty. On failure they are left empty. */
+static bool chunk_decode(chunk_t *chunk, const uint8_t *data, size_t length)
+{
+	const uint8_t *in = data, *end = data + length;
+	for (int s = 0; s < CHUNK_SECTIONS; s++) {
+		if ((in = palette_decode(&chunk->sections[s], CHUNK_SECTION_BLOCKS, in, end)) == NULL) {
+			chunk_free_blocks(chunk);
+			return false;
+		}
+	}
+	if (in != end) {
+		chunk_free_blocks(chunk);
+		return false;
+	}
+	return true;
+}
+
+void region_init(const char *save_dir)
+{
+	mtx_init(&region_mutex, mtx_plain);
+	if (save_dir == NULL)
+		return;
+
+	/* The game mounts its save directory there already, in which case this does nothing. */
+	if (PHYSFS_mount(save_dir, REGION_MOUNT, 0) == 0 || PHYSFS_mkdir("regions") == 0) {
+		fprintf(stderr, "Can't use %s for regions: %s\n", save_dir, PHYSFS_getErrorByCode(PHYSFS_getLastErrorCode()));
+		return;
+	}
+	region_enabled = true;
+}
+
+/* Reads a stored chunk into the (empty) chunk, returning false if it isn't stored. Safe to call
+ * from any thread. */
+bool region_load_chunk(chunk_t *chunk)
+{
+	int rloc[2], index;
+	if (!region_enabled)
+		return false;
+	region_locate(chunk->loc, rloc, &index);
+
+	mtx_lock(&region_mutex);
+	region_t *r = region_open(rloc);
+	uint32_t length = r->lengths[index];
+	if (length && r->reader == NULL) {
+		char path[96];
+		region_path(path, sizeof(path), rloc, r->slot, true);
+		r->reader = PHYSFS_openRead(path);
+	}
+	char *compressed = length && r->reader ? malloc(length) : NULL;
+	if (compressed && (PHYSFS_seek(r->reader, r->offsets[index]) == 0 || PHYSFS_readBytes(r->reader, compressed, length) != length)) {
+		free(compressed);
+		compressed = NULL;
+	}
+	mtx_unlock(&region_mutex);
+	if (compressed == NULL)
+		return false;
+
+	int raw_length;
+	char *raw = stbi_zlib_decode_malloc(compressed, length, &raw_length);
+	free(compressed);
+	bool ok = raw && chunk_decode(chunk, (uint8_t *)raw, raw_length);
+	free(raw);
+	if (!ok) {
+		fprintf(stderr, "Stored chunk %d,%d is damaged, regenerating it\n", chunk->loc[0], chunk->loc[1]);
+		chunk_init_blocks(chunk);
+	}
+	return ok;
+}
+
+/* Encodes and compresses a chunk's sections for region_write_chunks(). Safe to call from any
+ * thread; the result is released with free(). */
+void *region_compress_chunk(const palette_t sections[CHUNK_SECTIONS], int *length)
+{
+	size_t raw_length;
+	uint8_t *raw = chunk_encode(sections, &raw_length);
+	unsigned char *compressed = stbi_zlib_compress(raw, raw_length, length, REGION_COMPRESSION_LEVEL);
+	free(raw);
+	return compressed;
+}
+
+/* Writes a batch of compressed chunks, grouped by region file, and sets each one's ok flag. The
+ * order of writes is changed. Safe to call from any thread. */
+void region_write_chunks(region_write_t **writes, int count)
+{
+	qsort(writes, count, sizeof(region_write_t *), compare_region_writes);
+	mtx_lock(&region_mutex);
+	for (int i = 0, n; i < count; i += n) {
+		int rloc[2], index;
+		region_locate(writes[i]->loc, rloc, &index);
+		for (n = 1; i + n < count && compare_region_writes(&writes[i], &writes[i + n]) == 0; n++)
+			;
+
+		bool ok = region_enabled && region_write(region_open(rloc), &writes[i], n);
+		for (int j = i; j < i + n; j++)
+			writes[j]->ok = ok;
+	}
+	mtx_unlock(&region_mutex);
+}
+
+void region_close_all(void)
+{
+	mtx_lock(&region_mutex);
+	for (int i = 0; i < REGION_CACHE_SIZE; i++)
+		region_close(&regions[i]);
+	mtx_unlock(&region_mutex);
+}
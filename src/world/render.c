@@ -2,8 +2,24 @@
 #include <cglm/cglm.h>
 #include <stdlib.h>
 #include <string.h>
+#include "util.h"
 #include "world.h"
 #define VERTEX_PER_FACE 6
+#define MESH_JOBS_MAX 8 /* meshes being built or waiting to be uploaded at once */
+
+/* Meshes are built by pool jobs and uploaded by the main thread, which owns the GL context, as it
+ * drains main_completions. A chunk being meshed can't be unloaded, and the jobs keep out of the
+ * main thread's way while it writes blocks, since they read the chunk's neighbors as well. */
+typedef struct chunk_mesh_s {
+	completion_t done; /* must be first */
+	chunk_t *chunk;
+	float *vtx[VBUF_MAX];
+	size_t num_vertices[VBUF_MAX];
+	int num_lights;
+	mat4 *light_data;
+} chunk_mesh_t;
+
+static int meshes_in_flight; /* main thread only */
 
 /** Which UV coordinate does this vertex correspond to? */
 static uint8_t uv_idx[] = { 0, 1, 2, 1, 2, 3, 2, 3, 0, 3, 0, 1 };
@@ -19,17 +35,74 @@ static uint8_t fv_idx[6][18] = {
 	{ 0, 1, 5, 0, 4, 5, 0, 4, 2, 0, 4, 2, 0, 1, 2, 0, 1, 5 }, /* west */
 };
 
-static inline blockstate_t *get_block_state(block_instance_t *blk)
+static inline blockstate_t *get_block_state(block_instance_t blk)
+{
+	return &blockdefs[blk.id].states[blk.state];
+}
+
+/* Does this block hide every face of its neighbors, and have every one of its own faces hidden by
+ * a neighbor like it? A section filled with such a block only has faces on its boundary. */
+static bool block_is_sealed(block_instance_t blk)
+{
+	blockstate_t *bstate = get_block_state(blk);
+	model_info_t *model = bstate->model;
+	if (model == NULL || !bstate->opaque || model->cull_neighbors != 0x3F)
+		return false;
+	for (model_element_t *el = model->elements; el < model->elements + model->num_elements; el++) {
+		if ((el->cull_faces & 0x3F) != 0x3F)
+			return false;
+	}
+	return true;
+}
+
+/* Can meshing skip this section entirely? True for sections of empty blocks, and for sections of
+ * a sealed block whose six neighboring sections are sealed as well. */
+static bool section_is_hidden(block_cursor_t *cursor, int section)
 {
-	if (blk != NULL)
-		return &blockdefs[blk->id].states[blk->state];
-	else
-		return NULL;
+	chunk_t *chunk = cursor->chunk;
+	if (!chunk_section_is_uniform(chunk, section))
+		return false;
+
+	block_instance_t blk = chunk_get_block(chunk, section * CHUNK_SECTION_BLOCKS);
+	if (get_block_state(blk)->model == NULL)
+		return true;
+	if (!block_is_sealed(blk) || get_block_state(blk)->pointlight.luminosity[0] != 0 || section == 0 ||
+	    section == CHUNK_SECTIONS - 1)
+		return false;
+
+	for (int f = 0; f < FACE_MAX; f++) {
+		chunk_t *nc = chunk;
+		int ns = section + cube_normal[f][2];
+		if (f >= FACE_NORTH) {
+			nc = block_cursor_neighbor(cursor, f);
+			if (nc == NULL || chunk_stage(nc) < CHUNK_STAGE_GENERATED)
+				return false;
+		}
+		if (!chunk_section_is_uniform(nc, ns) || !block_is_sealed(chunk_get_block(nc, ns * CHUNK_SECTION_BLOCKS)))
+			return false;
+	}
+	return true;
+}
+
+/* Could this section contain a point light? */
+static bool section_has_lights(chunk_t *chunk, int section)
+{
+	palette_t *p = &chunk->sections[section];
+	if (p->num_entries == 0)
+		return false;
+	for (uint32_t i = 0; i < p->num_entries; i++) {
+		if (get_block_state(p->entries[i])->pointlight.luminosity[0] != 0)
+			return true;
+	}
+	return false;
 }
 
 int render_one_block(int x, int y, int z, bool preserve_uv, GLuint vbo)
 {
-	blockstate_t *bstate = get_block_state(world_get_block(x, y, z));
+	block_instance_t binst;
+	block_cursor_t cursor;
+	block_cursor_init(&cursor, x, y, z);
+	blockstate_t *bstate = block_cursor_get(&cursor, 0, 0, 0, &binst) ? get_block_state(binst) : NULL;
 	model_info_t *mdl = bstate ? bstate->model : NULL;
 	if (bstate == NULL || mdl == NULL || mdl->num_elements == 0) {
 		glBindBuffer(GL_ARRAY_BUFFER, vbo);
@@ -59,13 +132,10 @@ int render_one_block(int x, int y, int z, bool preserve_uv, GLuint vbo)
 	return num_verts;
 }
 
-void chunk_render(chunk_t *chunk)
+static void chunk_build_mesh(chunk_t *chunk, chunk_mesh_t *mesh)
 {
-	if (chunk == NULL || chunk->dirty == false)
-		return;
-
-	size_t num_vertices[VBUF_MAX] = { 0 }, max_vertices[VBUF_MAX];
-	float *vtx[VBUF_MAX];
+	size_t *num_vertices = mesh->num_vertices, max_vertices[VBUF_MAX];
+	float **vtx = mesh->vtx;
 	int num_lights = 0;
 	for (int vb = 0; vb < VBUF_MAX; vb++) {
 		max_vertices[vb] = CHUNK_AREA * 3 * 2 * 6 * 2;
@@ -73,13 +143,26 @@ void chunk_render(chunk_t *chunk)
 		assert(vtx[vb]);
 	}
 
-	/* Render the blocks to a VBO, and count the number of lights. */
-	for (int bi = 0; bi < CHUNK_TOTAL_BLOCKS; bi++) {
-		block_instance_t *binst = chunk->blocks + bi;
-		assert(binst->state < blockdefs[binst->id].num_states);
+	/* Build the vertices, and count the number of lights. Sections that can't produce a visible
+	 * face are skipped, as are the layers outside the chunk's bounds and the air above each
+	 * column, so the cost follows the occupied volume rather than the height. Neighbors are read
+	 * through a cursor at the chunk's corner, so the neighboring chunks are looked up once per
+	 * mesh rather than once per face. */
+	block_cursor_t cursor;
+	block_cursor_init_chunk(&cursor, chunk, 0, 0, 0);
+	for (int bi = CHUNK_BLOCK_INDEX(0, 0, chunk->min_z); bi < CHUNK_BLOCK_INDEX(0, 0, chunk->max_z); bi++) {
+		if (bi % CHUNK_SECTION_BLOCKS == 0 && section_is_hidden(&cursor, bi / CHUNK_SECTION_BLOCKS)) {
+			bi += CHUNK_SECTION_BLOCKS - 1;
+			continue;
+		}
 
 		int bx = bi % CHUNK_WIDTH, by = (bi / CHUNK_WIDTH) % CHUNK_WIDTH, bz = bi / CHUNK_AREA;
-		blockstate_t *bstate = &blockdefs[binst->id].states[binst->state];
+		if (bz >= chunk->heightmap[bi % CHUNK_AREA])
+			continue;
+		block_instance_t binst = chunk_get_block(chunk, bi);
+		assert(binst.state < blockdefs[binst.id].num_states);
+
+		blockstate_t *bstate = get_block_state(binst);
 		model_info_t *model = bstate->model;
 		if (model == NULL)
 			continue;
@@ -92,16 +175,17 @@ void chunk_render(chunk_t *chunk)
 				bool draw_face = (el->faces & (1 << fi)) != 0, cull_face = false;
 				if ((el->cull_faces & (1 << fi)) != 0) {
 					/* Check the neighbor to see if it's possible to cull */
-					block_instance_t *nbinst = world_get_block(chunk->loc[0] * CHUNK_WIDTH + bx + cube_normal[fi][0],
-										   chunk->loc[1] * CHUNK_WIDTH + by + cube_normal[fi][1],
-										   bz + cube_normal[fi][2]);
-					blockstate_t *nbst = get_block_state(nbinst);
+					block_instance_t nbinst;
+					blockstate_t *nbst = block_cursor_get(&cursor, bx + cube_normal[fi][0], by + cube_normal[fi][1],
+									      bz + cube_normal[fi][2], &nbinst) ?
+								     get_block_state(nbinst) :
+								     NULL;
 					if (nbst == NULL || nbst->model == NULL)
 						cull_face = false;
-					else if (nbst->opaque || nbinst->id == binst->id)
+					else if (nbst->opaque || nbinst.id == binst.id)
 						cull_face = (nbst->model->cull_neighbors & (1 << fi)) != 0;
 					else if (nbst->translucent && bstate->translucent)
-						cull_face = (nbst->model->cull_neighbors & (1 << fi)) != 0 && nbinst->id > binst->id;
+						cull_face = (nbst->model->cull_neighbors & (1 << fi)) != 0 && nbinst.id > binst.id;
 				}
 
 				int dest_vbuf = -1;
@@ -131,7 +215,7 @@ void chunk_render(chunk_t *chunk)
 				}
 
 				if (max_vertices[dest_vbuf] < num_vertices[dest_vbuf] + VERTEX_PER_FACE) {
-					float *nvtx = realloc(vtx[dest_vbuf], sizeof(float) * max_vertices[dest_vbuf] * 4 / 3);
+					float *nvtx = realloc(vtx[dest_vbuf], max_vertices[dest_vbuf] * 4 / 3 * VERTEX_DATA_SIZE * sizeof(float));
 					assert(nvtx);
 					vtx[dest_vbuf] = nvtx;
 					max_vertices[dest_vbuf] = max_vertices[dest_vbuf] * 4 / 3;
@@ -144,37 +228,98 @@ void chunk_render(chunk_t *chunk)
 	}
 
 	/* Gather information on the point lights in the chunk. */
-	if (chunk->num_lights != num_lights || chunk->light_data == NULL) {
-		mat4 *nld = realloc(chunk->light_data, num_lights * sizeof(mat4));
-		chunk->num_lights = num_lights;
-		chunk->light_data = nld;
-		for (int bi = 0, li = 0; bi < CHUNK_TOTAL_BLOCKS; bi++) {
-			block_instance_t *binst = chunk->blocks + bi;
-			blockstate_t *bstate = &blockdefs[binst->id].states[binst->state];
-			if (bstate->pointlight.luminosity[0] == 0)
-				continue;
-
-			chunk->light_data[li][0][0] = bi % CHUNK_WIDTH;
-			chunk->light_data[li][0][1] = (bi / CHUNK_WIDTH) % CHUNK_WIDTH;
-			chunk->light_data[li][0][2] = bi / CHUNK_AREA;
-			chunk->light_data[li][0][3] = bstate->pointlight.luminosity[3];
-			for (int j = 0; j < 3; j++) {
-				chunk->light_data[li][1][j] = bstate->pointlight.color[j] / 255.f;
-				chunk->light_data[li][2][j] = bstate->pointlight.luminosity[j];
+	mesh->num_lights = num_lights;
+	mesh->light_data = num_lights ? malloc(num_lights * sizeof(mat4)) : NULL;
+	for (int bi = CHUNK_BLOCK_INDEX(0, 0, chunk->min_z), li = 0; li < num_lights && bi < CHUNK_BLOCK_INDEX(0, 0, chunk->max_z); bi++) {
+		if (bi % CHUNK_SECTION_BLOCKS == 0 && !section_has_lights(chunk, bi / CHUNK_SECTION_BLOCKS)) {
+			bi += CHUNK_SECTION_BLOCKS - 1;
+			continue;
+		}
+
+		blockstate_t *bstate = get_block_state(chunk_get_block(chunk, bi));
+		if (bstate->pointlight.luminosity[0] == 0)
+			continue;
+
+		mesh->light_data[li][0][0] = bi % CHUNK_WIDTH;
+		mesh->light_data[li][0][1] = (bi / CHUNK_WIDTH) % CHUNK_WIDTH;
+		mesh->light_data[li][0][2] = bi / CHUNK_AREA;
+		mesh->light_data[li][0][3] = bstate->pointlight.luminosity[3];
+		for (int j = 0; j < 3; j++) {
+			mesh->light_data[li][1][j] = bstate->pointlight.color[j] / 255.f;
+			mesh->light_data[li][2][j] = bstate->pointlight.luminosity[j];
+		}
+		li++;
+	}
+}
+
+static tpool_ret_t mesh_worker(void *arg)
+{
+	chunk_mesh_t *mesh = arg;
+	int token = chunks_read_begin();
+	/* The chunk and the neighbors its faces look into, the only blocks meshing reads. */
+	chunk_t *read[5] = { mesh->chunk };
+	for (int f = FACE_NORTH; f <= FACE_WEST; f++)
+		read[f - FACE_NORTH + 1] = chunks_get(mesh->chunk->loc[0] + cube_normal[f][0], mesh->chunk->loc[1] + cube_normal[f][1]);
+	for (int i = 0; i < 5; i++) {
+		if (read[i] && !chunk_blocks_read_begin(read[i])) {
+			while (i-- > 0) {
+				if (read[i])
+					chunk_blocks_read_end(read[i]);
 			}
-			li++;
+			chunks_read_end(token);
+			return TPOOL_RETRY_LATER;
 		}
 	}
+	chunk_build_mesh(mesh->chunk, mesh);
+	for (int i = 0; i < 5; i++) {
+		if (read[i])
+			chunk_blocks_read_end(read[i]);
+	}
+	chunks_read_end(token);
+	for (int vb = 0; vb < VBUF_MAX; vb++)
+		mesh->done.bytes += mesh->num_vertices[vb] * VERTEX_DATA_SIZE * sizeof(float);
+	completion_push(&main_completions, &mesh->done);
+	return TPOOL_SUCCESS;
+}
 
+static void mesh_upload(completion_t *done)
+{
+	chunk_mesh_t *mesh = (chunk_mesh_t *)done;
+	chunk_t *chunk = mesh->chunk;
 	if (chunk->vbuf[0] == 0)
 		glGenBuffers(VBUF_MAX, chunk->vbuf);
 
 	for (int vb = 0; vb < VBUF_MAX; vb++) {
 		glBindBuffer(GL_ARRAY_BUFFER, chunk->vbuf[vb]);
-		glBufferData(GL_ARRAY_BUFFER, num_vertices[vb] * VERTEX_DATA_SIZE * sizeof(float), vtx[vb], GL_DYNAMIC_DRAW);
-		chunk->vbufsize[vb] = num_vertices[vb];
-		free(vtx[vb]);
+		glBufferData(GL_ARRAY_BUFFER, mesh->num_vertices[vb] * VERTEX_DATA_SIZE * sizeof(float), mesh->vtx[vb], GL_DYNAMIC_DRAW);
+		chunk->vbufsize[vb] = mesh->num_vertices[vb];
+		free(mesh->vtx[vb]);
 	}
+	free(chunk->light_data);
+	chunk->light_data = mesh->light_data;
+	chunk->num_lights = mesh->num_lights;
+	chunk->meshing = false;
+	meshes_in_flight--;
+	chunk_update_accounting(chunk);
+	free(mesh);
+}
+
+/* Starts meshing a ready chunk that is dirty, returning false if it isn't or if enough meshes are
+ * on their way already. The mesh is uploaded by completion_drain() on main_completions. */
+bool chunk_render(chunk_t *chunk)
+{
+	if (chunk == NULL || chunk->meshing || meshes_in_flight >= MESH_JOBS_MAX || chunk_stage(chunk) < CHUNK_STAGE_READY)
+		return false;
+	if (SDL_AtomicCAS(&chunk->dirty, 1, 0) == SDL_FALSE)
+		return false;
 
-	chunk->dirty = false;
+	chunk_mesh_t *mesh = calloc(1, sizeof(chunk_mesh_t));
+	assert(mesh);
+	mesh->done.run = mesh_upload;
+	mesh->chunk = chunk;
+	chunk->meshing = true;
+	meshes_in_flight++;
+	/* A chunk already on screen is remeshed because something in it changed, usually the player. */
+	tpool_add_work(world_workerpool(), mesh_worker, mesh, false, chunk->vbuf[0] ? TPOOL_INTERACTIVE : TPOOL_VISIBLE);
+	return true;
 }
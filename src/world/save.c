@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "tinycthread.h"
+#include "util.h"
+#include "world.h"
+
+#define SAVE_MAX_IN_FLIGHT ((size_t)16 << 20) /* snapshot bytes autosaves may have queued */
+#define SAVE_INTERVAL_MS 5000
+#define SAVE_BATCH_MAX 64
+
+/* A modified chunk is saved in three steps. The main thread clears its modified flag and takes a
+ * snapshot of its sections, so the chunk can be edited or unloaded right away. A worker encodes
+ * and compresses the snapshot. Whichever worker then finds the writer idle writes every
+ * compressed snapshot in one batch. Snapshots stay queued until written, so a chunk reloaded in
+ * the meantime is copied from its snapshot instead of an older copy on disk. */
+typedef struct save_job_s {
+	region_write_t write;
+	palette_t sections[CHUNK_SECTIONS];
+	size_t bytes;
+	uint32_t journal_seq;
+	Uint32 queued_at;
+	bool compressed, superseded;
+	struct save_job_s *next;
+} save_job_t;
+
+static mtx_t save_mutex, write_mutex;
+static cnd_t save_done;
+static save_job_t *save_queue; /* oldest first; guarded by save_mutex, as are the next two */
+static size_t queued_chunks, queued_bytes;
+static SDL_atomic_t saved_chunks, write_latency_ms;
+static Uint32 last_autosave, rate_time;
+static int rate_saved;
+static float rate;
+
+static void save_job_free(save_job_t *job)
+{
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		palette_free(&job->sections[s]);
+	free(job->write.data);
+	free(job);
+}
+
+static void save_job_unlink(save_job_t *job)
+{
+	save_job_t **pp = &save_queue;
+	while (*pp != job)
+		pp = &(*pp)->next;
+	*pp = job->next;
+	queued_chunks--;
+	queued_bytes -= job->bytes;
+}
+
+static bool save_ready(void)
+{
+	bool ready = false;
+	mtx_lock(&save_mutex);
+	for (save_job_t *job = save_queue; job && !ready; job = job->next)
+		ready = job->compressed;
+	mtx_unlock(&save_mutex);
+	return ready;
+}
+
+/* Writes compressed snapshots until there are none left. Called with write_mutex held, so
+ * batches are written in the order they were taken. */
+static void save_write_ready(void)
+{
+	while (true) {
+		save_job_t *batch[SAVE_BATCH_MAX], *job, *next;
+		region_write_t *writes[SAVE_BATCH_MAX];
+		int n = 0;
+
+		mtx_lock(&save_mutex);
+		for (job = save_queue; job && n < SAVE_BATCH_MAX; job = next) {
+			next = job->next;
+			if (!job->compressed)
+				continue;
+			if (job->superseded) {
+				/* a newer snapshot of the chunk is queued behind it */
+				save_job_unlink(job);
+				save_job_free(job);
+				continue;
+			}
+			batch[n] = job;
+			writes[n++] = &job->write;
+		}
+		if (save_queue == NULL)
+			cnd_broadcast(&save_done);
+		mtx_unlock(&save_mutex);
+		if (n == 0)
+			break;
+
+		region_write_chunks(writes, n);
+
+		Uint32 now = SDL_GetTicks();
+		int token = chunks_read_begin();
+		mtx_lock(&save_mutex);
+		for (int i = 0; i < n; i++) {
+			job = batch[i];
+			if (job->write.ok) {
+				int latency = SDL_AtomicGet(&write_latency_ms);
+				SDL_AtomicSet(&write_latency_ms, (latency * 7 + (int)(now - job->queued_at)) / 8);
+				SDL_AtomicAdd(&saved_chunks, 1);
+				journal_retire(job->write.loc, job->journal_seq);
+			} else {
+				fprintf(stderr, "Failed to save chunk %d,%d\n", job->write.loc[0], job->write.loc[1]);
+				chunk_t *chunk = chunks_get(job->write.loc[0], job->write.loc[1]);
+				if (chunk && !job->superseded)
+					SDL_AtomicSet(&chunk->modified, 1); /* try again with the next autosave */
+			}
+			save_job_unlink(job);
+			save_job_free(job);
+		}
+		if (save_queue == NULL)
+			cnd_broadcast(&save_done);
+		mtx_unlock(&save_mutex);
+		chunks_read_end(token);
+	}
+}
+
+static tpool_ret_t save_worker(void *_job)
+{
+	save_job_t *job = _job;
+	job->write.data = region_compress_chunk(job->sections, &job->write.length);
+	mtx_lock(&save_mutex);
+	job->compressed = true;
+	mtx_unlock(&save_mutex);
+
+	/* Checking again after unlocking picks up snapshots compressed while the last batch was being
+	 * written, whose workers found the writer busy. */
+	while (save_ready() && mtx_trylock(&write_mutex) == thrd_success) {
+		save_write_ready();
+		mtx_unlock(&write_mutex);
+	}
+	return TPOOL_SUCCESS;
+}
+
+void save_init(void)
+{
+	mtx_init(&save_mutex, mtx_plain);
+	mtx_init(&write_mutex, mtx_plain);
+	cnd_init(&save_done);
+}
+
+/* Queues a modified chunk to be saved, returning false if the queue is full. A forced save is
+ * queued regardless, for chunks about to be unloaded. Main thread only. */
+bool chunk_save(chunk_t *chunk, bool force)
+{
+	size_t bytes = chunk_blocks_memory_usage(chunk);
+	mtx_lock(&save_mutex);
+	bool full = queued_bytes + bytes > SAVE_MAX_IN_FLIGHT;
+	mtx_unlock(&save_mutex);
+	if (full && !force)
+		return false;
+
+	save_job_t *job = calloc(1, sizeof(save_job_t));
+	job->write.loc[0] = chunk->loc[0];
+	job->write.loc[1] = chunk->loc[1];
+	job->bytes = bytes;
+	job->queued_at = SDL_GetTicks();
+	job->journal_seq = journal_seq();
+	SDL_AtomicSet(&chunk->modified, 0);
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		palette_copy(&job->sections[s], &chunk->sections[s]);
+
+	mtx_lock(&save_mutex);
+	save_job_t **pp = &save_queue;
+	for (; *pp; pp = &(*pp)->next) {
+		if ((*pp)->write.loc[0] == chunk->loc[0] && (*pp)->write.loc[1] == chunk->loc[1])
+			(*pp)->superseded = true;
+	}
+	*pp = job;
+	queued_chunks++;
+	queued_bytes += bytes;
+	mtx_unlock(&save_mutex);
+
+	tpool_add_work(world_workerpool(), save_worker, job, false, TPOOL_BACKGROUND);
+	return true;
+}
+
+/* Copies the chunk's blocks from a queued snapshot, if there is one. */
+bool chunk_load_pending(chunk_t *chunk)
+{
+	mtx_lock(&save_mutex);
+	save_job_t *found = NULL;
+	for (save_job_t *job = save_queue; job; job = job->next) {
+		if (job->write.loc[0] == chunk->loc[0] && job->write.loc[1] == chunk->loc[1] && !job->superseded)
+			found = job;
+	}
+	if (found) {
+		for (int s = 0; s < CHUNK_SECTIONS; s++)
+			palette_copy(&chunk->sections[s], &found->sections[s]);
+	}
+	mtx_unlock(&save_mutex);
+	return found != NULL;
+}
+
+/* Periodically queues modified chunks, as many as fit in the queue. */
+void world_autosave(void)
+{
+	Uint32 now = SDL_GetTicks();
+	if (now - last_autosave < SAVE_INTERVAL_MS)
+		return;
+	last_autosave = now;
+
+	size_t iter = 0;
+	chunk_t *chunk;
+	while ((chunk = chunks_next(&iter)) != NULL) {
+		if (SDL_AtomicGet(&chunk->modified) && !chunk_save(chunk, false))
+			break;
+	}
+}
+
+/* Queues every modified chunk and waits until everything queued is on disk. */
+void world_save_flush(void)
+{
+	size_t iter = 0;
+	chunk_t *chunk;
+	while ((chunk = chunks_next(&iter)) != NULL) {
+		if (SDL_AtomicGet(&chunk->modified))
+			chunk_save(chunk, true);
+	}
+
+	mtx_lock(&save_mutex);
+	while (save_queue != NULL)
+		cnd_wait(&save_done, &save_mutex);
+	mtx_unlock(&save_mutex);
+}
+
+void world_save_stats(world_save_stats_t *stats)
+{
+	mtx_lock(&save_mutex);
+	stats->queued_chunks = queued_chunks;
+	stats->queued_bytes = queued_bytes;
+	mtx_unlock(&save_mutex);
+	stats->saved_chunks = SDL_AtomicGet(&saved_chunks);
+	stats->write_latency_ms = SDL_AtomicGet(&write_latency_ms);
+
+	Uint32 now = SDL_GetTicks();
+	if (now - rate_time >= 1000) {
+		rate = (stats->saved_chunks - rate_saved) * 1000.0f / (now - rate_time);
+		rate_saved = stats->saved_chunks;
+		rate_time = now;
+	}
+	stats->chunks_per_second = rate;
+}
+
+#if 0
+#include <physfs.h>
+/* Measures how long the main thread is held up saving edited chunks: compressing and writing each
+ * one itself, against queueing snapshots for the workers. */
+void save_bench(const char *dir)
+{
+	const int n = 128, edits = 300;
+	PHYSFS_init(NULL);
+	PHYSFS_setWriteDir(dir);
+	world_init();
+	chunk_t *chunks = calloc(n, sizeof(chunk_t));
+	unsigned seed = 1;
+	for (int i = 0; i < n; i++) {
+		chunks[i].loc[0] = i % REGION_WIDTH;
+		chunks[i].loc[1] = i / REGION_WIDTH;
+		chunk_init_blocks(&chunks[i]);
+		chunk_fill_blocks(&chunks[i], 0, CHUNK_AREA * 4, (block_instance_t){ .id = 1 });
+		for (int e = 0; e < edits; e++) {
+			seed = seed * 1103515245 + 12345;
+			chunk_set_block(&chunks[i], CHUNK_BLOCK_INDEX(seed % CHUNK_WIDTH, (seed >> 8) % CHUNK_WIDTH, 4 + (seed >> 16) % 8),
+					(block_instance_t){ .id = 4 + (seed >> 24) % 4 });
+		}
+	}
+
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++) {
+		region_write_t write = { .loc = { chunks[i].loc[0], chunks[i].loc[1] } }, *batch = &write;
+		write.data = region_compress_chunk(chunks[i].sections, &write.length);
+		region_write_chunks(&batch, 1);
+		free(write.data);
+	}
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	for (int i = 0; i < n; i++)
+		chunk_save(&chunks[i], true);
+	Uint64 t2 = SDL_GetPerformanceCounter();
+	world_save_flush();
+	Uint64 t3 = SDL_GetPerformanceCounter();
+
+	world_save_stats_t stats;
+	world_save_stats(&stats);
+	double us = 1e6 / SDL_GetPerformanceFrequency();
+	printf("main thread per chunk: synchronous %.1fus, queued %.1fus; queue drained in %.0fms, %zu saved, latency %ums\n",
+	       (t1 - t0) * us / n, (t2 - t1) * us / n, (t3 - t2) * us / 1000, stats.saved_chunks, stats.write_latency_ms);
+	exit(0);
+}
+#endif
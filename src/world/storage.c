@@ -1,76 +1,259 @@
+#include <physfs.h>
+#include <string.h>
+#include "tinycthread.h"
 #include "util.h"
 #include "world.h"
 
 int8_t cube_normal[FACE_MAX][3] = { { 0, 0, 1 }, { 0, 0, -1 }, { 0, 1, 0 }, { 0, -1, 0 }, { 1, 0, 0 }, { -1, 0, 0 } };
-static rbtree_t *chunktree = NULL;
+static chunkmap_t *chunkmap = NULL;
 
-static int chunktree_cmp(const void *const a, const void *const b, void *extradata)
+static void chunk_release(chunk_t *chunk)
 {
-	/* If a and b point to chunks, they also point to the first element in the chunk structure,
-	 * which happens to be an int[2]. This allows comparisons between chunks and int[2]'s, a
-	 * necessary operation when trying to find a chunk. */
-	const int *const c1 = a, *const c2 = b;
-	UNUSED(extradata);
-	if (c1[0] == c2[0])
-		return c2[1] - c1[1];
-	return c2[0] - c1[0];
+	chunk_free_blocks(chunk);
+	features_free(chunk);
+	free(chunk);
 }
 
-static void chunktree_rel(void *key, void *value)
+void chunk_init_blocks(chunk_t *chunk)
 {
-	if (key != value) {
-		fprintf(stderr, "FATAL: Chunk tree invariant (key != value) was violated.\n");
-		abort();
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		palette_init(&chunk->sections[s], CHUNK_SECTION_BLOCKS, (block_instance_t){ 0 });
+}
+
+void chunk_free_blocks(chunk_t *chunk)
+{
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		palette_free(&chunk->sections[s]);
+}
+
+size_t chunk_blocks_memory_usage(chunk_t *chunk)
+{
+	size_t bytes = 0;
+	for (int s = 0; s < CHUNK_SECTIONS; s++)
+		bytes += palette_memory_usage(&chunk->sections[s]);
+	return bytes;
+}
+
+void chunk_set_block(chunk_t *chunk, int bi, block_instance_t inst)
+{
+	palette_set(&chunk->sections[bi / CHUNK_SECTION_BLOCKS], bi % CHUNK_SECTION_BLOCKS, inst);
+}
+
+/* Fills a run of block indexes. Sections covered completely collapse to a single value. */
+void chunk_fill_blocks(chunk_t *chunk, int start, int count, block_instance_t inst)
+{
+	int end = start + count;
+	while (start < end) {
+		int s = start / CHUNK_SECTION_BLOCKS, section_end = MIN(end, (s + 1) * CHUNK_SECTION_BLOCKS);
+		palette_fill(&chunk->sections[s], start % CHUNK_SECTION_BLOCKS, section_end - start, inst);
+		start = section_end;
+	}
+}
+
+/* Fills a box of chunk-local coordinates, corners inclusive, in as few runs as it spans. */
+void chunk_fill_box(chunk_t *chunk, const int min[3], const int max[3], block_instance_t inst)
+{
+	int width = max[0] - min[0] + 1, depth = max[1] - min[1] + 1;
+	if (width == CHUNK_WIDTH && depth == CHUNK_WIDTH) {
+		chunk_fill_blocks(chunk, CHUNK_BLOCK_INDEX(0, 0, min[2]), (max[2] - min[2] + 1) * CHUNK_AREA, inst);
+		return;
+	}
+	for (int z = min[2]; z <= max[2]; z++) {
+		if (width == CHUNK_WIDTH)
+			chunk_fill_blocks(chunk, CHUNK_BLOCK_INDEX(0, min[1], z), depth * CHUNK_WIDTH, inst);
+		else {
+			for (int y = min[1]; y <= max[1]; y++)
+				chunk_fill_blocks(chunk, CHUNK_BLOCK_INDEX(min[0], y, z), width, inst);
+		}
+	}
+}
+
+static inline bool section_is_air(chunk_t *chunk, int s)
+{
+	return chunk_section_is_uniform(chunk, s) && chunk_get_block(chunk, s * CHUNK_SECTION_BLOCKS).id == 0;
+}
+
+/* Returns one past the highest non-air block of a column below top, or 0. */
+static int column_height(chunk_t *chunk, int xy, int top)
+{
+	for (int z = top - 1; z >= 0; z--) {
+		int s = z / CHUNK_SECTION_HEIGHT;
+		if (section_is_air(chunk, s))
+			z = s * CHUNK_SECTION_HEIGHT;
+		else if (chunk_get_block(chunk, CHUNK_BLOCK_INDEX2(xy, z)).id != 0)
+			return z + 1;
+	}
+	return 0;
+}
+
+/* Rebuilds the heightmap and bounds from the blocks, skipping air sections. */
+void chunk_update_heightmap(chunk_t *chunk)
+{
+	int top = CHUNK_SECTIONS, min_z = 0, max_z = 0;
+	while (top > 0 && section_is_air(chunk, top - 1))
+		top--;
+	for (int xy = 0; xy < CHUNK_AREA; xy++) {
+		chunk->heightmap[xy] = column_height(chunk, xy, top * CHUNK_SECTION_HEIGHT);
+		max_z = MAX(max_z, chunk->heightmap[xy]);
+	}
+	for (int s = 0; s < top && min_z == 0 && max_z != 0; s++) {
+		if (section_is_air(chunk, s))
+			continue;
+		int i = 0;
+		while (i < CHUNK_SECTION_BLOCKS && chunk_get_block(chunk, s * CHUNK_SECTION_BLOCKS + i).id == 0)
+			i++;
+		if (i < CHUNK_SECTION_BLOCKS) {
+			min_z = s * CHUNK_SECTION_HEIGHT + i / CHUNK_AREA;
+			break;
+		}
+	}
+	chunk->min_z = min_z;
+	chunk->max_z = max_z;
+}
+
+/* Updates the heightmap for one block having been set. */
+static void chunk_heightmap_set(chunk_t *chunk, int bi, block_instance_t inst)
+{
+	int xy = bi % CHUNK_AREA, z = bi / CHUNK_AREA, height = chunk->heightmap[xy];
+	if (inst.id != 0) {
+		if (chunk->max_z == 0)
+			chunk->min_z = z;
+		chunk->heightmap[xy] = MAX(height, z + 1);
+		chunk->min_z = MIN(chunk->min_z, z);
+		chunk->max_z = MAX(chunk->max_z, z + 1);
+	} else if (z + 1 == height) {
+		chunk->heightmap[xy] = column_height(chunk, xy, z);
+		if (height == chunk->max_z) {
+			int max_z = 0;
+			for (int i = 0; i < CHUNK_AREA; i++)
+				max_z = MAX(max_z, chunk->heightmap[i]);
+			chunk->max_z = max_z;
+			if (max_z == 0)
+				chunk->min_z = 0;
+		}
 	}
-	free(key);
 }
 
 void chunks_deinit(void)
 {
-	rbtree_destroy(chunktree);
+	chunkmap_destroy(chunkmap);
 }
 
 void chunks_add(chunk_t *chunk)
 {
-	rbtree_insert(chunktree, chunk, chunk);
+	if (chunkmap_insert(chunkmap, chunk))
+		chunk_update_accounting(chunk);
 }
 
 void chunks_clear(void)
 {
-	rbtree_removeall(chunktree);
+	chunkmap_clear(chunkmap);
 }
 
 chunk_t *chunks_get(int x, int y)
 {
-	int loc[] = { x, y };
-	return rbtree_get(chunktree, loc);
+	return chunkmap_get(chunkmap, x, y);
+}
+
+chunk_t *chunks_next(size_t *iter)
+{
+	return chunkmap_next(chunkmap, iter);
 }
 
+/* The chunk is released once no worker can still be reading it; see chunks_reclaim(). */
 void chunks_remove(int x, int y)
 {
-	int loc[] = { x, y };
-	rbtree_remove(chunktree, loc);
+	chunkmap_remove(chunkmap, x, y);
+}
+
+void chunks_set_center(int x, int y)
+{
+	chunkmap_recenter(chunkmap, x, y);
+}
+
+/* Code running off the main thread must bracket its use of chunks it didn't create itself with
+ * these, so a concurrent chunks_remove() can't free them underneath it. */
+int chunks_read_begin(void)
+{
+	return chunkmap_read_begin(chunkmap);
+}
+
+void chunks_read_end(int token)
+{
+	chunkmap_read_end(chunkmap, token);
 }
 
+/* Jobs that read the blocks of generated chunks while the main thread goes on, as meshing does,
+ * bracket the reads of each chunk with chunk_blocks_read_begin() and chunk_blocks_read_end(), and
+ * the main thread brackets its writes to a chunk with chunk_blocks_write_begin() and
+ * chunk_blocks_write_end(). The gate is per chunk, so a writer only waits for the readers already
+ * reading the chunks it changes, which are quick; a reader that comes along during a write is
+ * retried once it is over instead of holding up a worker. Each side raises its own count before
+ * reading the other's, so they can't both go ahead. */
+static tpool_signal_t *blocks_written;
+
+/* Returns false if the main thread is writing to the chunk, in which case the job must return
+ * TPOOL_RETRY_LATER; it is run again when a write is over. Only from pool jobs. */
+bool chunk_blocks_read_begin(chunk_t *chunk)
+{
+	tpool_retry_on(blocks_written);
+	SDL_AtomicAdd(&chunk->readers, 1);
+	if (!SDL_AtomicGet(&chunk->writing))
+		return true;
+	SDL_AtomicAdd(&chunk->readers, -1);
+	return false;
+}
+
+void chunk_blocks_read_end(chunk_t *chunk)
+{
+	SDL_AtomicAdd(&chunk->readers, -1);
+}
+
+/* Main thread only. */
+void chunk_blocks_write_begin(chunk_t *chunk)
+{
+	SDL_AtomicSet(&chunk->writing, 1);
+	while (SDL_AtomicGet(&chunk->readers) != 0)
+		thrd_yield();
+}
+
+void chunk_blocks_write_end(chunk_t *chunk)
+{
+	SDL_AtomicSet(&chunk->writing, 0);
+	tpool_signal(blocks_written);
+}
+
+void chunks_reclaim(void)
+{
+	chunkmap_reclaim(chunkmap);
+}
+
+/* Sets up storage and generation. Blocks can't be drawn until world_load_resources() has loaded
+ * their models and textures, but nothing here needs them. */
 void world_init(void)
 {
-	world_load_resources();
+	world_init_seed(PHYSFS_getWriteDir());
+	region_init(PHYSFS_getWriteDir());
+	journal_init(PHYSFS_getWriteDir());
+	save_init();
 	world_init_workerpool();
+	blocks_written = tpool_signal_create();
 
-	chunktree = rbtree_create(chunktree_cmp, chunktree_rel, NULL);
+	chunkmap = chunkmap_create(0, chunk_release);
 }
 
-block_instance_t *world_get_block(int x, int y, int z)
+bool world_get_block(int x, int y, int z, block_instance_t *inst)
 {
 	int chunkloc[2], xoff, yoff;
 	WORLD_CHUNK(x, &chunkloc[0], &xoff);
 	WORLD_CHUNK(y, &chunkloc[1], &yoff);
 
-	chunk_t *chunk = rbtree_get(chunktree, chunkloc);
-	if (chunk != NULL && z >= 0 && z < CHUNK_HEIGHT)
-		return chunk->blocks + CHUNK_BLOCK_INDEX(xoff, yoff, z);
-	else
-		return NULL;
+	chunk_t *chunk = chunkmap_get(chunkmap, chunkloc[0], chunkloc[1]);
+	if (chunk != NULL && chunk_stage(chunk) >= CHUNK_STAGE_GENERATED && z >= 0 && z < CHUNK_HEIGHT) {
+		*inst = chunk_get_block(chunk, CHUNK_BLOCK_INDEX(xoff, yoff, z));
+		return true;
+	} else
+		return false;
 }
 
 void world_set_block(int x, int y, int z, block_instance_t *inst)
@@ -79,30 +262,173 @@ void world_set_block(int x, int y, int z, block_instance_t *inst)
 	WORLD_CHUNK(x, &chunkloc[0], &xoff);
 	WORLD_CHUNK(y, &chunkloc[1], &yoff);
 
-	chunk_t *chunk = rbtree_get(chunktree, chunkloc);
-	if (chunk != NULL) {
-		memcpy(chunk->blocks + CHUNK_BLOCK_INDEX(xoff, yoff, z), inst, sizeof(block_instance_t));
+	chunk_t *chunk = chunkmap_get(chunkmap, chunkloc[0], chunkloc[1]);
+	if (chunk != NULL && chunk_stage(chunk) >= CHUNK_STAGE_GENERATED && z >= 0 && z < CHUNK_HEIGHT) {
+		int bi = CHUNK_BLOCK_INDEX(xoff, yoff, z);
+		chunk_blocks_write_begin(chunk);
+		chunk_set_block(chunk, bi, *inst);
+		chunk_heightmap_set(chunk, bi, *inst);
+		chunk_blocks_write_end(chunk);
 		/* some callbacks will be necessary here */
 
-		chunk->dirty = true;
+		journal_record(chunk->loc, bi, *inst);
+		SDL_AtomicSet(&chunk->modified, 1);
+		chunk_mark_dirty(chunk);
+
+		if (xoff == 0)
+			chunk_mark_dirty(chunks_get(chunkloc[0] - 1, chunkloc[1]));
+		else if (xoff == CHUNK_WIDTH - 1)
+			chunk_mark_dirty(chunks_get(chunkloc[0] + 1, chunkloc[1]));
+		if (yoff == 0)
+			chunk_mark_dirty(chunks_get(chunkloc[0], chunkloc[1] - 1));
+		else if (yoff == CHUNK_WIDTH - 1)
+			chunk_mark_dirty(chunks_get(chunkloc[0], chunkloc[1] + 1));
+	}
+}
+
+void block_cursor_init(block_cursor_t *c, int x, int y, int z)
+{
+	int loc[2], xoff, yoff;
+	WORLD_CHUNK(x, &loc[0], &xoff);
+	WORLD_CHUNK(y, &loc[1], &yoff);
+	block_cursor_init_chunk(c, chunkmap_get(chunkmap, loc[0], loc[1]), xoff, yoff, z);
+	c->x = x;
+	c->y = y;
+	c->lookups = 1;
+}
+
+/* Starts a cursor in a chunk the caller already has, without looking it up. */
+void block_cursor_init_chunk(block_cursor_t *c, chunk_t *chunk, int xoff, int yoff, int z)
+{
+	memset(c, 0, sizeof(block_cursor_t));
+	if (chunk) {
+		c->x = chunk->loc[0] * CHUNK_WIDTH + xoff;
+		c->y = chunk->loc[1] * CHUNK_WIDTH + yoff;
+	}
+	c->z = z;
+	c->xoff = xoff;
+	c->yoff = yoff;
+	c->chunk = chunk;
+}
+
+/* Moves the cursor. Moving into a chunk beside the current one keeps the chunks already known. */
+void block_cursor_move(block_cursor_t *c, int x, int y, int z)
+{
+	int dx = x - c->x + c->xoff, dy = y - c->y + c->yoff, loc[2], xoff, yoff;
+	WORLD_CHUNK(x, &loc[0], &xoff);
+	WORLD_CHUNK(y, &loc[1], &yoff);
+	if (dx != xoff || dy != yoff) {
+		chunk_t *old = c->chunk, *next = NULL;
+		int back = -1;
+		for (int f = FACE_NORTH; f < FACE_MAX && back < 0; f++) {
+			if (dx == xoff + cube_normal[f][0] * CHUNK_WIDTH && dy == yoff + cube_normal[f][1] * CHUNK_WIDTH) {
+				next = block_cursor_neighbor(c, f);
+				back = f ^ 1; /* the faces come in opposite pairs */
+			}
+		}
+		if (back < 0) {
+			next = chunkmap_get(chunkmap, loc[0], loc[1]);
+			c->lookups++;
+		}
+		c->chunk = next;
+		c->fetched = 0;
+		if (back >= 0) {
+			c->neighbors[back - FACE_NORTH] = old;
+			c->fetched = 1 << (back - FACE_NORTH);
+		}
+	}
+	c->x = x;
+	c->y = y;
+	c->z = z;
+	c->xoff = xoff;
+	c->yoff = yoff;
+}
+
+/* Returns the chunk beside the cursor's chunk on one of the horizontal faces. */
+chunk_t *block_cursor_neighbor(block_cursor_t *c, int face)
+{
+	int n = face - FACE_NORTH;
+	if (!(c->fetched & (1 << n))) {
+		int loc[2];
+		WORLD_CHUNK(c->x, &loc[0], NULL);
+		WORLD_CHUNK(c->y, &loc[1], NULL);
+		c->neighbors[n] = chunkmap_get(chunkmap, loc[0] + cube_normal[face][0], loc[1] + cube_normal[face][1]);
+		c->fetched |= 1 << n;
+		c->lookups++;
+	}
+	return c->neighbors[n];
+}
+
+/* Finds the chunk of a position given relative to the cursor's chunk, which is outside it, and
+ * makes the position relative to that chunk. */
+chunk_t *block_cursor_resolve(block_cursor_t *c, int *xoff, int *yoff)
+{
+	bool inside_x = *xoff >= 0 && *xoff < CHUNK_WIDTH, inside_y = *yoff >= 0 && *yoff < CHUNK_WIDTH;
+	if (inside_x && *yoff >= -CHUNK_WIDTH && *yoff < 2 * CHUNK_WIDTH) {
+		int face = *yoff < 0 ? FACE_SOUTH : FACE_NORTH;
+		*yoff -= cube_normal[face][1] * CHUNK_WIDTH;
+		return block_cursor_neighbor(c, face);
+	}
+	if (inside_y && *xoff >= -CHUNK_WIDTH && *xoff < 2 * CHUNK_WIDTH) {
+		int face = *xoff < 0 ? FACE_WEST : FACE_EAST;
+		*xoff -= cube_normal[face][0] * CHUNK_WIDTH;
+		return block_cursor_neighbor(c, face);
+	}
+
+	int loc[2];
+	int x = c->x - c->xoff + *xoff, y = c->y - c->yoff + *yoff;
+	WORLD_CHUNK(x, &loc[0], xoff);
+	WORLD_CHUNK(y, &loc[1], yoff);
+	c->lookups++;
+	return chunkmap_get(chunkmap, loc[0], loc[1]);
+}
+
+#if 0
+#include <stdio.h>
+/* Reads the six neighbors of every block of a chunk, as meshing does, with world_get_block()
+ * against a cursor, counting the chunk map lookups each makes. */
+void cursor_bench(void)
+{
+	world_init();
+	for (int cy = -1; cy <= 1; cy++) {
+		for (int cx = -1; cx <= 1; cx++) {
+			chunk_t *chunk = calloc(1, sizeof(chunk_t));
+			chunk->loc[0] = cx;
+			chunk->loc[1] = cy;
+			chunk_init_blocks(chunk);
+			for (int i = 0; i < CHUNK_AREA * 64; i++)
+				chunk_set_block(chunk, i, (block_instance_t){ .id = 1 + i % 3 });
+			SDL_AtomicSet(&chunk->stage, CHUNK_STAGE_GENERATED);
+			chunks_add(chunk);
+		}
+	}
 
-		if (xoff == 0) {
-			chunk_t *nb = chunks_get(chunkloc[0] - 1, chunkloc[1]);
-			if (nb)
-				nb->dirty = true;
-		} else if (xoff == CHUNK_WIDTH - 1) {
-			chunk_t *nb = chunks_get(chunkloc[0] + 1, chunkloc[1]);
-			if (nb)
-				nb->dirty = true;
+	chunk_t *chunk = chunks_get(0, 0);
+	unsigned sum = 0, lookups = 0;
+	block_instance_t inst;
+	Uint64 t0 = SDL_GetPerformanceCounter();
+	for (int bi = 0; bi < CHUNK_AREA * 64; bi++) {
+		int x = bi % CHUNK_WIDTH, y = bi / CHUNK_WIDTH % CHUNK_WIDTH, z = bi / CHUNK_AREA;
+		for (int f = 0; f < FACE_MAX; f++, lookups++) {
+			if (world_get_block(x + cube_normal[f][0], y + cube_normal[f][1], z + cube_normal[f][2], &inst))
+				sum += inst.id;
 		}
-		if (yoff == 0) {
-			chunk_t *nb = chunks_get(chunkloc[0], chunkloc[1] - 1);
-			if (nb)
-				nb->dirty = true;
-		} else if (yoff == CHUNK_WIDTH - 1) {
-			chunk_t *nb = chunks_get(chunkloc[0], chunkloc[1] + 1);
-			if (nb)
-				nb->dirty = true;
+	}
+	Uint64 t1 = SDL_GetPerformanceCounter();
+	block_cursor_t cursor;
+	block_cursor_init_chunk(&cursor, chunk, 0, 0, 0);
+	for (int bi = 0; bi < CHUNK_AREA * 64; bi++) {
+		int x = bi % CHUNK_WIDTH, y = bi / CHUNK_WIDTH % CHUNK_WIDTH, z = bi / CHUNK_AREA;
+		for (int f = 0; f < FACE_MAX; f++) {
+			if (block_cursor_get(&cursor, x + cube_normal[f][0], y + cube_normal[f][1], z + cube_normal[f][2], &inst))
+				sum -= inst.id;
 		}
 	}
+	Uint64 t2 = SDL_GetPerformanceCounter();
+
+	double ms = 1000.0 / SDL_GetPerformanceFrequency();
+	printf("neighbors of %d blocks: world_get_block %.2fms, %u lookups; cursor %.2fms, %d lookups (%u)\n", CHUNK_AREA * 64,
+	       (t1 - t0) * ms, lookups, (t2 - t1) * ms, cursor.lookups, sum);
+	exit(0);
 }
+#endif